@@ -391,14 +391,15 @@ void OptionsView::createAbout()
 {
     mAboutLabel = std::make_unique<Label>();
     
-    String fftlib;
+    StringArray fftlibs;
 #if PS_USE_VDSP_FFT
-    fftlib = "vDSP";
-#elif PS_USE_PFFFT
-    fftlib = "pffft";
-#else
-    fftlib = fftwf_version;
+    fftlibs.add("vDSP");
 #endif
+#if PS_HAVE_FFTW
+    fftlibs.add(fftwf_version);
+#endif
+    fftlibs.add("pffft (" + FFTPlan::getPFFFTSimdName() + ")");
+    String fftlib = fftlibs.joinIntoString(" and ");
     String juceversiontxt = String("JUCE ") + String(JUCE_MAJOR_VERSION) + "." + String(JUCE_MINOR_VERSION);
     String title = String(JucePlugin_Name) + " " + String(JucePlugin_VersionString);
 #ifdef JUCE_DEBUG
@@ -0,0 +1,1133 @@
+// SPDX-License-Identifier: GPLv3-or-later WITH Appstore-exception
+
+#if PS_USE_VDSP_FFT
+#define VIMAGE_H // crazy hack needed
+#include <Accelerate/Accelerate.h>
+#endif
+
+#include "FFTBackend.h"
+#include <math.h>
+
+#if PS_PFFFT_WIDE
+#include "../pffft/pffft_wide.h"
+#endif
+
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PS_FFT_SSE 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && (defined(__aarch64__) || defined(_M_ARM64))
+#define PS_FFT_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Kernels for the spectrum layouts of the FFT backends. The FFTW halfcomplex layout keeps
+// the real parts of bins 0..n/2 in ascending order and the imaginary parts of bins 1..n/2-1
+// in descending order at the end of the array, so the imaginary side is walked backwards.
+
+// mag[k] = |re[k] + i*imrev[-k]|
+static inline void halfcomplexMagnitudes(const float* re, const float* imrev, float* mag, int count)
+{
+	int k = 0;
+#if PS_FFT_SSE
+	for (; k + 4 <= count; k += 4)
+	{
+		__m128 r = _mm_loadu_ps(re + k);
+		__m128 i = _mm_loadu_ps(imrev - k - 3);
+		i = _mm_shuffle_ps(i, i, _MM_SHUFFLE(0, 1, 2, 3));
+		_mm_storeu_ps(mag + k, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(r, r), _mm_mul_ps(i, i))));
+	}
+#elif PS_FFT_NEON
+	for (; k + 4 <= count; k += 4)
+	{
+		float32x4_t r = vld1q_f32(re + k);
+		float32x4_t i = vrev64q_f32(vld1q_f32(imrev - k - 3));
+		i = vcombine_f32(vget_high_f32(i), vget_low_f32(i));
+		vst1q_f32(mag + k, vsqrtq_f32(vmlaq_f32(vmulq_f32(r, r), i, i)));
+	}
+#endif
+	for (; k < count; ++k)
+		mag[k] = sqrt(re[k] * re[k] + imrev[-k] * imrev[-k]);
+}
+
+// re[k] = mag[k]*cos, imrev[-k] = mag[k]*sin
+static inline void halfcomplexFromPolar(const float* mag, const RandomPhaseGenerator::Phasor* ph, 
+	float* re, float* imrev, int count)
+{
+	int k = 0;
+	const float* phf = &ph[0].c;
+#if PS_FFT_SSE
+	for (; k + 4 <= count; k += 4)
+	{
+		__m128 m = _mm_loadu_ps(mag + k);
+		__m128 p0 = _mm_loadu_ps(phf + 2 * k);
+		__m128 p1 = _mm_loadu_ps(phf + 2 * k + 4);
+		__m128 c = _mm_shuffle_ps(p0, p1, _MM_SHUFFLE(2, 0, 2, 0));
+		__m128 s = _mm_shuffle_ps(p0, p1, _MM_SHUFFLE(3, 1, 3, 1));
+		_mm_storeu_ps(re + k, _mm_mul_ps(m, c));
+		s = _mm_mul_ps(m, s);
+		_mm_storeu_ps(imrev - k - 3, _mm_shuffle_ps(s, s, _MM_SHUFFLE(0, 1, 2, 3)));
+	}
+#elif PS_FFT_NEON
+	for (; k + 4 <= count; k += 4)
+	{
+		float32x4_t m = vld1q_f32(mag + k);
+		float32x4x2_t cs = vld2q_f32(phf + 2 * k);
+		vst1q_f32(re + k, vmulq_f32(m, cs.val[0]));
+		float32x4_t s = vrev64q_f32(vmulq_f32(m, cs.val[1]));
+		vst1q_f32(imrev - k - 3, vcombine_f32(vget_high_f32(s), vget_low_f32(s)));
+	}
+#endif
+	for (; k < count; ++k)
+	{
+		re[k] = mag[k] * ph[k].c;
+		imrev[-k] = mag[k] * ph[k].s;
+	}
+}
+
+// dest[2k] = mag[k]*cos, dest[2k+1] = mag[k]*sin
+static inline void interleavedFromPolar(const float* mag, const RandomPhaseGenerator::Phasor* ph, 
+	float* dest, int count)
+{
+	int k = 0;
+	const float* phf = &ph[0].c;
+#if PS_FFT_SSE
+	for (; k + 4 <= count; k += 4)
+	{
+		__m128 m = _mm_loadu_ps(mag + k);
+		_mm_storeu_ps(dest + 2 * k, _mm_mul_ps(_mm_unpacklo_ps(m, m), _mm_loadu_ps(phf + 2 * k)));
+		_mm_storeu_ps(dest + 2 * k + 4, _mm_mul_ps(_mm_unpackhi_ps(m, m), _mm_loadu_ps(phf + 2 * k + 4)));
+	}
+#elif PS_FFT_NEON
+	for (; k + 4 <= count; k += 4)
+	{
+		float32x4_t m = vld1q_f32(mag + k);
+		float32x4x2_t cs = vld2q_f32(phf + 2 * k);
+		float32x4x2_t out = { { vmulq_f32(m, cs.val[0]), vmulq_f32(m, cs.val[1]) } };
+		vst2q_f32(dest + 2 * k, out);
+	}
+#endif
+	for (; k < count; ++k)
+	{
+		dest[2 * k] = mag[k] * ph[k].c;
+		dest[2 * k + 1] = mag[k] * ph[k].s;
+	}
+}
+
+RandomPhaseGenerator::RandomPhaseGenerator(uint32_t seed)
+#if !PS_USE_PHASE_TABLE
+	: m_randgen(seed)
+#endif
+{
+	std::mt19937 seeder(seed);
+	for (int k = 0; k < numlanes; ++k)
+	{
+		for (int j = 0; j < 4; ++j)
+			m_state[j][k] = (uint32_t)seeder();
+		// xoshiro must not be started from the all zero state
+		if ((m_state[0][k] | m_state[1][k] | m_state[2][k] | m_state[3][k]) == 0)
+			m_state[0][k] = 1;
+	}
+}
+
+void RandomPhaseGenerator::nextBlock(uint32_t* dest)
+{
+	uint32_t* s0 = m_state[0];
+	uint32_t* s1 = m_state[1];
+	uint32_t* s2 = m_state[2];
+	uint32_t* s3 = m_state[3];
+	for (int k = 0; k < numlanes; ++k)
+	{
+		const uint32_t result = s0[k] + s3[k];
+		const uint32_t t = s1[k] << 9;
+		s2[k] ^= s0[k];
+		s3[k] ^= s1[k];
+		s1[k] ^= s2[k];
+		s0[k] ^= s3[k];
+		s2[k] ^= t;
+		s3[k] = (s3[k] << 11) | (s3[k] >> 21);
+		// the upper bits of xoshiro128+ are the well distributed ones
+		dest[k] = result >> 17;
+	}
+}
+
+void RandomPhaseGenerator::generate(uint32_t* dest, int n)
+{
+	int i = 0;
+	for (; i + numlanes <= n; i += numlanes)
+		nextBlock(dest + i);
+	if (i < n)
+	{
+		uint32_t block[numlanes];
+		nextBlock(block);
+		for (int k = 0; i + k < n; ++k)
+			dest[i + k] = block[k];
+	}
+}
+
+void RandomPhaseGenerator::generatePhasors(Phasor* dest, int n)
+{
+#if PS_USE_PHASE_TABLE
+	const auto* phasors = getPhasorTable();
+	const int blocksize = 256;
+	uint32_t indices[blocksize];
+	for (int i = 0; i < n; i += blocksize)
+	{
+		const int count = std::min(blocksize, n - i);
+		generate(indices, count);
+		for (int k = 0; k < count; ++k)
+			dest[i + k] = phasors[indices[k]];
+	}
+#else
+	const REALTYPE inv_2p15_2pi=1.0f/16384.0f*(float)c_PI;
+	for (int k = 0; k < n; ++k)
+	{
+		unsigned int rand = m_randdist(m_randgen);
+		REALTYPE phase=rand*inv_2p15_2pi;
+		dest[k] = { (float)cos(phase), (float)sin(phase) };
+	}
+#endif
+}
+
+const RandomPhaseGenerator::Phasor* RandomPhaseGenerator::getPhasorTable()
+{
+	static const std::vector<Phasor> table = []()
+	{
+		std::vector<Phasor> result(numphases);
+		for (int i = 0; i < numphases; ++i)
+		{
+			double phase = 2.0 * c_PI * i / numphases;
+			result[i] = { (float)cos(phase), (float)sin(phase) };
+		}
+		return result;
+	}();
+	return table.data();
+}
+
+
+
+// Random phases are made in blocks of this many bins, small enough to stay in the L1 cache
+static const int phasorblocksize = 256;
+
+template<typename F>
+static void forEachRandomPhasorBlock(int nsamples, RandomPhaseGenerator& phases, F&& f)
+{
+	const int halfsamples = nsamples / 2;
+	RandomPhaseGenerator::Phasor block[phasorblocksize];
+	for (int start = 1; start < halfsamples; start += phasorblocksize)
+	{
+		const int count = std::min(phasorblocksize, halfsamples - start);
+		phases.generatePhasors(block, count);
+		f(start, count, block);
+	}
+}
+
+#if PS_HAVE_FFTW
+// FFTW r2r halfcomplex transforms. The plans are made out-of-place on scratch buffers and
+// executed with fftwf_execute_r2r on the buffers of each FFT object.
+class FFTWPlan : public FFTPlan
+{
+public:
+	FFTWPlan(int nsamples_, FFTDirection direction_) : FFTPlan(nsamples_, direction_)
+	{
+		plan = makePlan(FFTW_ESTIMATE);
+	}
+	~FFTWPlan()
+	{
+		if (measuredplan.load() != nullptr)
+			fftwf_destroy_plan(measuredplan.load());
+		if (plan != nullptr)
+			fftwf_destroy_plan(plan);
+	}
+	FFTBackendType getBackend() const override { return FFTBackendType::FFTW; }
+	int getScratchSize() const override { return nsamples; }
+	void forwardMagnitudes(float* smp, float* freq, float* scratch) const override
+	{
+		jassert(direction == FFTDirection::Forward);
+		fftwf_execute_r2r(getCurrentPlan(), smp, scratch);
+		halfcomplexMagnitudes(scratch + 1, scratch + nsamples - 1, freq + 1, nsamples / 2 - 1);
+		freq[0] = 0.0;
+	}
+	void inverseRandomPhases(const float* freq, RandomPhaseGenerator& phases, float* smp, float* scratch) const override
+	{
+		jassert(direction == FFTDirection::Inverse);
+		const int n = nsamples;
+		forEachRandomPhasorBlock(nsamples, phases, [scratch, freq, n](int start, int count, const RandomPhaseGenerator::Phasor* ph)
+		{
+			halfcomplexFromPolar(freq + start, ph, scratch + start, scratch + n - start, count);
+		});
+		scratch[0] = scratch[nsamples / 2 + 1] = scratch[nsamples / 2] = 0.0;
+
+		fftwf_execute_r2r(getCurrentPlan(), scratch, smp);
+
+		// post scale
+		float scale = 1.f / nsamples;
+		FloatVectorOperations::multiply(smp, scale, nsamples);
+	}
+	void forwardComplex(float* smp, float* re, float* im, float* scratch) const override
+	{
+		jassert(direction == FFTDirection::Forward);
+		const int halfsamples = nsamples / 2;
+		fftwf_execute_r2r(getCurrentPlan(), smp, scratch);
+		for (int k = 0; k <= halfsamples; ++k)
+			re[k] = scratch[k];
+		for (int k = 1; k < halfsamples; ++k)
+			im[k] = scratch[nsamples - k];
+		im[0] = im[halfsamples] = 0.0f;
+	}
+	void inverseComplex(const float* re, const float* im, float* smp, float* scratch) const override
+	{
+		jassert(direction == FFTDirection::Inverse);
+		const int halfsamples = nsamples / 2;
+		for (int k = 0; k <= halfsamples; ++k)
+			scratch[k] = re[k];
+		for (int k = 1; k < halfsamples; ++k)
+			scratch[nsamples - k] = im[k];
+		fftwf_execute_r2r(getCurrentPlan(), scratch, smp);
+	}
+	bool makeMeasuredPlan(FFTPlanningMode mode) const override
+	{
+		if (mode == FFTPlanningMode::Estimate || measuredplan.load() != nullptr)
+			return false;
+		// Other threads asking for new plans wait for this, so keep it bounded
+		fftwf_set_timelimit(mode == FFTPlanningMode::Patient ? 10.0 : 2.0);
+		auto measured = makePlan(mode == FFTPlanningMode::Patient ? FFTW_PATIENT : FFTW_MEASURE);
+		fftwf_set_timelimit(FFTW_NO_TIMELIMIT);
+		if (measured == nullptr)
+			return false;
+		measuredplan.store(measured, std::memory_order_release);
+		return true;
+	}
+private:
+	// The measured plan replaces the initial estimated one when the planner thread has made it,
+	// the estimated plan is kept around since other threads may still be executing it
+	fftwf_plan getCurrentPlan() const
+	{
+		auto measured = measuredplan.load(std::memory_order_acquire);
+		return measured != nullptr ? measured : plan;
+	}
+	// Measuring overwrites the buffers, so scratch buffers are needed for that anyway. The
+	// buffers the plan is later executed on come from the same allocator and have the same alignment.
+	fftwf_plan makePlan(unsigned flags) const
+	{
+		FFTWBuffer<REALTYPE> in, out;
+		in.resize(nsamples, true);
+		out.resize(nsamples, true);
+		const auto kind = direction == FFTDirection::Forward ? FFTW_R2HC : FFTW_HC2R;
+		//fftwf_plan_with_nthreads(2);
+		return fftwf_plan_r2r_1d(nsamples, in.data(), out.data(), kind, flags);
+	}
+	fftwf_plan plan = nullptr;
+	mutable std::atomic<fftwf_plan> measuredplan{ nullptr };
+};
+#endif
+
+// The builds of pffft that this CPU can run, widest first. The 8 and 16 float wide x86 builds
+// are compiled in when PS_PFFFT_WIDE is set and are picked by the CPU features at runtime,
+// the plain 4 float wide SSE/NEON build is always there.
+struct PFFFTBuild
+{
+	const char* name;
+	int simdsize;
+	PFFFT_Setup* (*newSetup)(int, pffft_transform_t);
+	void (*destroySetup)(PFFFT_Setup*);
+	void (*transformOrdered)(PFFFT_Setup*, const float*, float*, float*, pffft_direction_t);
+};
+
+static const std::vector<PFFFTBuild>& getPFFFTBuilds()
+{
+	static const std::vector<PFFFTBuild> builds = []
+	{
+		std::vector<PFFFTBuild> result;
+#if PS_PFFFT_WIDE
+		if (SystemStats::hasAVX512F())
+			result.push_back({ "AVX-512", pffft_avx512_simd_size(), pffft_avx512_new_setup, pffft_avx512_destroy_setup, pffft_avx512_transform_ordered });
+		if (SystemStats::hasAVX2() && SystemStats::hasFMA3())
+			result.push_back({ "AVX2", pffft_avx2_simd_size(), pffft_avx2_new_setup, pffft_avx2_destroy_setup, pffft_avx2_transform_ordered });
+#endif
+		const int simdsize = pffft_simd_size();
+		result.push_back({ simdsize == 1 ? "scalar" : (JUCE_INTEL ? "SSE" : (JUCE_ARM ? "NEON" : "SIMD")), simdsize,
+			pffft_new_setup, pffft_destroy_setup, pffft_transform_ordered });
+		return result;
+	}();
+	return builds;
+}
+
+// The widest build whose real transforms can do the size, they need a multiple of 2*simdsize^2.
+// The last one is the 4 wide build that FFTPlan::isSizeSupported checks against.
+static const PFFFTBuild& getPFFFTBuildForSize(int nsamples)
+{
+	auto& builds = getPFFFTBuilds();
+	for (auto& build : builds)
+		if (nsamples % (2 * build.simdsize * build.simdsize) == 0)
+			return build;
+	return builds.back();
+}
+
+// pffft real transforms, ordered output has DC and Nyquist in the first two floats followed
+// by interleaved complex bins
+class PFFFTPlan : public FFTPlan
+{
+public:
+	PFFFTPlan(int nsamples_) : FFTPlan(nsamples_, FFTDirection::Forward), build(getPFFFTBuildForSize(nsamples_))
+	{
+		setup = build.newSetup(nsamples, PFFFT_REAL);
+		jassert(setup != nullptr);
+	}
+	~PFFFTPlan()
+	{
+		if (setup)
+			build.destroySetup(setup);
+	}
+	FFTBackendType getBackend() const override { return FFTBackendType::PFFFT; }
+	// the transformed data followed by the pffft work area
+	int getScratchSize() const override { return 3 * nsamples; }
+	void forwardMagnitudes(float* smp, float* freq, float* scratch) const override
+	{
+		const int halfsamples = nsamples / 2;
+		auto * databuf = scratch;
+
+		build.transformOrdered(setup, smp, databuf, scratch + nsamples, PFFFT_FORWARD);
+
+		databuf[1] = 0.0f;
+
+		// compute magnitude
+
+		FloatVectorOperations::multiply(databuf, databuf, nsamples);
+
+		for (int k=1, l=2; k < halfsamples; ++k, l+=2) {
+			freq[k] = sqrt(databuf[l] + databuf[l+1]);
+		}
+
+		freq[0] = 0.0;
+	}
+	void inverseRandomPhases(const float* freq, RandomPhaseGenerator& phases, float* smp, float* scratch) const override
+	{
+		auto * databuf = scratch;
+		forEachRandomPhasorBlock(nsamples, phases, [databuf, freq](int start, int count, const RandomPhaseGenerator::Phasor* ph)
+		{
+			interleavedFromPolar(freq + start, ph, databuf + 2 * start, count);
+		});
+		databuf[0] = databuf[1] = 0.0;
+
+		build.transformOrdered(setup, databuf, smp, scratch + nsamples, PFFFT_BACKWARD);
+
+		// post scale
+		float scale = 1.f / nsamples;
+		FloatVectorOperations::multiply(smp, scale, nsamples);
+	}
+	void forwardComplex(float* smp, float* re, float* im, float* scratch) const override
+	{
+		const int halfsamples = nsamples / 2;
+		build.transformOrdered(setup, smp, scratch, scratch + nsamples, PFFFT_FORWARD);
+		re[0] = scratch[0];
+		re[halfsamples] = scratch[1];
+		im[0] = im[halfsamples] = 0.0f;
+		for (int k = 1; k < halfsamples; ++k)
+		{
+			re[k] = scratch[2 * k];
+			im[k] = scratch[2 * k + 1];
+		}
+	}
+	void inverseComplex(const float* re, const float* im, float* smp, float* scratch) const override
+	{
+		const int halfsamples = nsamples / 2;
+		scratch[0] = re[0];
+		scratch[1] = re[halfsamples];
+		for (int k = 1; k < halfsamples; ++k)
+		{
+			scratch[2 * k] = re[k];
+			scratch[2 * k + 1] = im[k];
+		}
+		build.transformOrdered(setup, scratch, smp, scratch + nsamples, PFFFT_BACKWARD);
+	}
+private:
+	const PFFFTBuild& build;
+	PFFFT_Setup *setup = nullptr;
+};
+
+#if PS_USE_VDSP_FFT
+// vDSP split complex transforms, only powers of 2
+class VDSPPlan : public FFTPlan
+{
+public:
+	VDSPPlan(int nsamples_) : FFTPlan(nsamples_, FFTDirection::Forward)
+	{
+		int maxlog2N = 1;
+		while ((1 << maxlog2N) < nsamples)
+			++maxlog2N;
+		log2N = maxlog2N;
+		setup = vDSP_create_fftsetup(maxlog2N, kFFTRadix2);
+		//Logger::writeToLog("fftsize: "  + String(nsamples) + " log2N: " + String(log2N));
+	}
+	~VDSPPlan()
+	{
+		vDSP_destroy_fftsetup(setup);
+	}
+	FFTBackendType getBackend() const override { return FFTBackendType::VDSP; }
+	// the unpacked data followed by the split real and imaginary parts
+	int getScratchSize() const override { return 3 * nsamples; }
+	void forwardMagnitudes(float* smp, float* freq, float* scratch) const override
+	{
+		const int halfsamples = nsamples / 2;
+
+		COMPLEX_SPLIT A;
+		A.realp = scratch + nsamples;
+		A.imagp = scratch + 2 * nsamples;
+
+		//convert real input to even-odd
+
+		vDSP_ctoz((COMPLEX*)smp, 2, &A, 1, halfsamples);
+
+		// forward fft
+		vDSP_fft_zrip(setup, &A, 1, log2N, FFT_FORWARD);
+
+		// result is in split packed complex A.realp[0] is DC, A.imagp[0] is NY, so we zero NY before doing mag^2
+		A.imagp[0] = 0.0f;
+
+		// forward scale
+		const float scale = 0.5f;
+		vDSP_vsmul(A.realp, 1, &scale, A.realp, 1, halfsamples);
+		vDSP_vsmul(A.imagp, 1, &scale, A.imagp, 1, halfsamples);
+
+		// Absolute square (equivalent to mag^2)
+		vDSP_zvmags(&A, 1, freq, 1, halfsamples);
+
+		// take square root
+		for (int i=1; i < halfsamples;i++)
+		{
+			freq[i]=sqrt(freq[i]);
+		}
+
+		freq[0] = 0.0;
+	}
+	void inverseRandomPhases(const float* freq, RandomPhaseGenerator& phases, float* smp, float* scratch) const override
+	{
+		const int halfsamples = nsamples / 2;
+
+		COMPLEX_SPLIT A;
+		A.realp = scratch + nsamples;
+		A.imagp = scratch + 2 * nsamples;
+
+		REALTYPE* workreal = A.realp;
+		REALTYPE* workimag = A.imagp;
+		forEachRandomPhasorBlock(nsamples, phases, [workreal, workimag, freq](int start, int count, const RandomPhaseGenerator::Phasor* ph)
+		{
+			for (int k = 0; k < count; ++k)
+			{
+				workreal[start + k] = freq[start + k]*ph[k].c;
+				workimag[start + k] = freq[start + k]*ph[k].s;
+			}
+		});
+		workreal[0] = workimag[0] = 0.0;
+
+		// inverse fft
+		vDSP_fft_zrip(setup, &A, 1, log2N, FFT_INVERSE);
+
+		// unpack
+		vDSP_ztoc(&A, 1, (COMPLEX*)scratch, 2, halfsamples);
+
+		// scale
+		float scale = 1.f / nsamples;
+		vDSP_vsmul(scratch, 1, &scale, smp, 1, nsamples);
+	}
+	void forwardComplex(float* smp, float* re, float* im, float* scratch) const override
+	{
+		const int halfsamples = nsamples / 2;
+		COMPLEX_SPLIT A;
+		A.realp = scratch + nsamples;
+		A.imagp = scratch + 2 * nsamples;
+		vDSP_ctoz((COMPLEX*)smp, 2, &A, 1, halfsamples);
+		vDSP_fft_zrip(setup, &A, 1, log2N, FFT_FORWARD);
+		// zrip results are twice the spectrum, and Nyquist is packed into imagp[0]
+		const float scale = 0.5f;
+		vDSP_vsmul(A.realp, 1, &scale, re, 1, halfsamples);
+		vDSP_vsmul(A.imagp, 1, &scale, im, 1, halfsamples);
+		re[halfsamples] = im[0];
+		im[0] = im[halfsamples] = 0.0f;
+	}
+	void inverseComplex(const float* re, const float* im, float* smp, float* scratch) const override
+	{
+		const int halfsamples = nsamples / 2;
+		COMPLEX_SPLIT A;
+		A.realp = scratch + nsamples;
+		A.imagp = scratch + 2 * nsamples;
+		for (int k = 0; k < halfsamples; ++k)
+		{
+			A.realp[k] = re[k];
+			A.imagp[k] = im[k];
+		}
+		A.imagp[0] = re[halfsamples];
+		vDSP_fft_zrip(setup, &A, 1, log2N, FFT_INVERSE);
+		vDSP_ztoc(&A, 1, (COMPLEX*)smp, 2, halfsamples);
+	}
+private:
+	FFTSetup setup;
+	int log2N = 0;
+};
+#endif
+
+class FFTWorkerPool::Worker : public Thread
+{
+public:
+	Worker(FFTWorkerPool& owner_) : Thread("PaulXFFTWorker"), owner(owner_) {}
+	void run() override
+	{
+		while (threadShouldExit() == false)
+		{
+			wait(-1);
+			if (auto* job = m_job.exchange(nullptr))
+			{
+				runTasks(*job);
+				// The caller returns as soon as this reaches 0, the job mustn't be touched after that
+				if (--job->pendingworkers == 0)
+					owner.m_finished.signal();
+			}
+		}
+	}
+	std::atomic<Job*> m_job{ nullptr };
+private:
+	FFTWorkerPool& owner;
+};
+
+FFTWorkerPool::FFTWorkerPool()
+{
+}
+
+FFTWorkerPool::~FFTWorkerPool()
+{
+	setNumThreads(1);
+}
+
+void FFTWorkerPool::setNumThreads(int numthreads)
+{
+	numthreads = jlimit(1, 16, numthreads);
+	const ScopedLock locker(m_cs);
+	while ((int)m_workers.size() > numthreads - 1)
+	{
+		m_workers.back()->signalThreadShouldExit();
+		m_workers.back()->notify();
+		m_workers.back()->stopThread(1000);
+		m_workers.pop_back();
+	}
+	while ((int)m_workers.size() < numthreads - 1)
+	{
+		m_workers.push_back(std::make_unique<Worker>(*this));
+		// these are waited on by the buffering thread, which runs at the highest priority too
+		m_workers.back()->startThread(Thread::Priority::highest);
+	}
+	m_numthreads = numthreads;
+}
+
+void FFTWorkerPool::runTasks(Job& job)
+{
+	for (int task = job.nexttask++; task < job.numtasks; task = job.nexttask++)
+		job.function(job.context, task);
+}
+
+void FFTWorkerPool::run(int numtasks, TaskFunction function, void* context)
+{
+	Job job;
+	job.function = function;
+	job.context = context;
+	job.numtasks = numtasks;
+	const ScopedTryLock locker(m_cs);
+	if (locker.isLocked() == false || m_workers.empty() || numtasks < 2)
+	{
+		runTasks(job);
+		return;
+	}
+	const int numworkers = std::min((int)m_workers.size(), numtasks - 1);
+	job.pendingworkers = numworkers;
+	for (int i = 0; i < numworkers; ++i)
+	{
+		m_workers[i]->m_job.store(&job);
+		m_workers[i]->notify();
+	}
+	runTasks(job);
+	m_finished.wait(-1);
+}
+
+// The combining passes keep the twiddled bins of all the parts in local arrays
+static const int maxparallelparts = 16;
+
+// Buffers in the scratch area start at 64 byte boundaries, FFTW plans need the alignment they
+// were planned with
+static int roundUpToAlignment(int numfloats)
+{
+	return (numfloats + 15) & ~15;
+}
+
+void BufferArena::add(ArenaBuffer& buffer, int size)
+{
+	jassert(size > 0 && m_memory.getSize() == 0);
+	m_buffers.emplace_back(&buffer, m_size);
+	buffer.m_buf = nullptr;
+	buffer.m_size = size;
+	m_size += roundUpToAlignment(size);
+}
+
+void BufferArena::allocate()
+{
+	jassert(m_size > 0);
+	m_memory.resize(m_size, true);
+	for (auto& e : m_buffers)
+		e.first->m_buf = m_memory.data() + e.second;
+}
+
+void BufferArena::clear()
+{
+	if (m_memory.getSize() > 0)
+		FloatVectorOperations::clear(m_memory.data(), m_size);
+}
+
+struct ParallelFFTPlan::ScratchLayout
+{
+	int partstride, binstride, subscratchstride;
+	float* parts; // the samples of each part
+	float* partre; // bins 0..N/P/2 of each part
+	float* partim;
+	float* subscratch;
+	float* specre; // bins 0..N/2 of the whole transform
+	float* specim;
+};
+
+ParallelFFTPlan::ParallelFFTPlan(int nsamples_, FFTDirection direction_, std::shared_ptr<const FFTPlan> subplan_, FFTWorkerPool& workers_)
+	: FFTPlan(nsamples_, direction_), numparts(nsamples_ / subplan_->nsamples), subplan(std::move(subplan_)), 
+	workers(workers_), partsize(subplan->nsamples)
+{
+	jassert(numparts > 1 && numparts <= maxparallelparts && numparts * partsize == nsamples && partsize % 2 == 0);
+	twiddlecos.resize(partsize / 2 + 1);
+	twiddlesin.resize(partsize / 2 + 1);
+	for (int k = 0; k <= partsize / 2; ++k)
+	{
+		const double angle = -2.0 * c_PI * k / nsamples;
+		twiddlecos[k] = (float)cos(angle);
+		twiddlesin[k] = (float)sin(angle);
+	}
+	partcos.resize(numparts);
+	partsin.resize(numparts);
+	for (int k = 0; k < numparts; ++k)
+	{
+		const double angle = -2.0 * c_PI * k / numparts;
+		partcos[k] = (float)cos(angle);
+		partsin[k] = (float)sin(angle);
+	}
+}
+
+int ParallelFFTPlan::getNumParts(FFTBackendType backend, int nsamples, int numthreads)
+{
+	if (numthreads < 2 || nsamples < minsize)
+		return 0;
+	for (int parts = std::min(numthreads, maxparallelparts); parts > 1; --parts)
+		if (nsamples % parts == 0 && isSizeSupported(backend, nsamples / parts))
+			return parts;
+	return 0;
+}
+
+ParallelFFTPlan::ScratchLayout ParallelFFTPlan::getScratchLayout(float* scratch) const
+{
+	ScratchLayout layout;
+	layout.partstride = roundUpToAlignment(partsize);
+	layout.binstride = roundUpToAlignment(partsize / 2 + 1);
+	layout.subscratchstride = roundUpToAlignment(subplan->getScratchSize());
+	layout.parts = scratch;
+	layout.partre = layout.parts + numparts * layout.partstride;
+	layout.partim = layout.partre + numparts * layout.binstride;
+	layout.subscratch = layout.partim + numparts * layout.binstride;
+	layout.specre = layout.subscratch + numparts * layout.subscratchstride;
+	layout.specim = layout.specre + roundUpToAlignment(nsamples / 2 + 1);
+	return layout;
+}
+
+int ParallelFFTPlan::getScratchSize() const
+{
+	return numparts * (roundUpToAlignment(partsize) + 2 * roundUpToAlignment(partsize / 2 + 1) + roundUpToAlignment(subplan->getScratchSize()))
+		+ 2 * roundUpToAlignment(nsamples / 2 + 1);
+}
+
+// The combining passes are split into one range of bins per part
+static void getBinRange(int numbins, int numranges, int range, int& start, int& end)
+{
+	start = (int)((int64)numbins * range / numranges);
+	end = (int)((int64)numbins * (range + 1) / numranges);
+}
+
+// The parts' bins are combined in blocks of this many, so that the arrays stay in the L1 cache
+static const int combineblocksize = 64;
+
+// x[p + P*m] of each part p goes through the sub transform, then bin k + q*N/P of the whole
+// transform is the sum over p of W_P^(pq) * W_N^(pk) * Y_p[k]. Only bins k <= N/P/2 of the
+// parts are used, the whole transform's bins above N/2 are the conjugates of the ones below,
+// so they are stored mirrored. All the transforms of a batch share the handoffs to the workers.
+template<typename F>
+void ParallelFFTPlan::forwardParts(const BatchItem* items, int count, F&& store) const
+{
+	workers.parallelFor(count * numparts, [this, items](int task)
+	{
+		const auto layout = getScratchLayout(items[task / numparts].scratch);
+		const float* smp = items[task / numparts].smp;
+		const int p = task % numparts;
+		float* part = layout.parts + p * layout.partstride;
+		for (int m = 0; m < partsize; ++m)
+			part[m] = smp[p + numparts * m];
+		subplan->forwardComplex(part, layout.partre + p * layout.binstride, layout.partim + p * layout.binstride,
+			layout.subscratch + p * layout.subscratchstride);
+	});
+	workers.parallelFor(count * numparts, [this, items, &store](int task)
+	{
+		const int item = task / numparts;
+		const auto layout = getScratchLayout(items[item].scratch);
+		int k0, k1;
+		getBinRange(partsize / 2 + 1, numparts, task % numparts, k0, k1);
+		float tr[maxparallelparts][combineblocksize], ti[maxparallelparts][combineblocksize];
+		float wr[combineblocksize], wi[combineblocksize];
+		float xr[combineblocksize], xi[combineblocksize];
+		for (int block = k0; block < k1; block += combineblocksize)
+		{
+			const int blocklen = std::min(combineblocksize, k1 - block);
+			const float* twr = twiddlecos.data() + block;
+			const float* twi = twiddlesin.data() + block;
+			// the twiddles of each part are the previous part's times W_N^k
+			for (int i = 0; i < blocklen; ++i)
+			{
+				tr[0][i] = layout.partre[block + i];
+				ti[0][i] = layout.partim[block + i];
+				wr[i] = twr[i];
+				wi[i] = twi[i];
+			}
+			for (int p = 1; p < numparts; ++p)
+			{
+				const float* yr = layout.partre + p * layout.binstride + block;
+				const float* yi = layout.partim + p * layout.binstride + block;
+				for (int i = 0; i < blocklen; ++i)
+				{
+					tr[p][i] = yr[i] * wr[i] - yi[i] * wi[i];
+					ti[p][i] = yr[i] * wi[i] + yi[i] * wr[i];
+					const float nextwr = wr[i] * twr[i] - wi[i] * twi[i];
+					wi[i] = wr[i] * twi[i] + wi[i] * twr[i];
+					wr[i] = nextwr;
+				}
+			}
+			for (int q = 0; q < numparts; ++q)
+			{
+				for (int i = 0; i < blocklen; ++i)
+				{
+					xr[i] = tr[0][i];
+					xi[i] = ti[0][i];
+				}
+				for (int p = 1, idx = q; p < numparts; ++p, idx = idx + q < numparts ? idx + q : idx + q - numparts)
+				{
+					const float c = partcos[idx];
+					const float s = partsin[idx];
+					for (int i = 0; i < blocklen; ++i)
+					{
+						xr[i] += tr[p][i] * c - ti[p][i] * s;
+						xi[i] += tr[p][i] * s + ti[p][i] * c;
+					}
+				}
+				const int firstbin = block + q * partsize;
+				const int numdirect = jlimit(0, blocklen, nsamples / 2 - firstbin + 1);
+				if (numdirect > 0)
+					store(item, firstbin, 1, xr, xi, numdirect);
+				if (numdirect < blocklen)
+					store(item, nsamples - firstbin - numdirect, -1, xr + numdirect, xi + numdirect, blocklen - numdirect);
+			}
+		}
+	});
+}
+
+// The other way around, Y_p[k] = W_N^(-pk) * sum over q of W_P^(-pq) * X[k + q*N/P] with the
+// spectrum in specre/specim of the scratch layout, then the inverse sub transforms of the
+// parts are interleaved back into smp
+void ParallelFFTPlan::inverseParts(const BatchItem* items, int count, float scale) const
+{
+	workers.parallelFor(count * numparts, [this, items](int task)
+	{
+		const auto layout = getScratchLayout(items[task / numparts].scratch);
+		const float* specre = layout.specre;
+		const float* specim = layout.specim;
+		const int halfsamples = nsamples / 2;
+		int k0, k1;
+		getBinRange(partsize / 2 + 1, numparts, task % numparts, k0, k1);
+		float sr[maxparallelparts][combineblocksize], si[maxparallelparts][combineblocksize];
+		float wr[combineblocksize], wi[combineblocksize];
+		float xr[combineblocksize], xi[combineblocksize];
+		for (int block = k0; block < k1; block += combineblocksize)
+		{
+			const int blocklen = std::min(combineblocksize, k1 - block);
+			const float* twr = twiddlecos.data() + block;
+			const float* twi = twiddlesin.data() + block;
+			for (int q = 0; q < numparts; ++q)
+			{
+				const int firstbin = block + q * partsize;
+				const int numdirect = jlimit(0, blocklen, halfsamples - firstbin + 1);
+				for (int i = 0; i < numdirect; ++i)
+				{
+					sr[q][i] = specre[firstbin + i];
+					si[q][i] = specim[firstbin + i];
+				}
+				for (int i = numdirect; i < blocklen; ++i)
+				{
+					sr[q][i] = specre[nsamples - firstbin - i];
+					si[q][i] = -specim[nsamples - firstbin - i];
+				}
+				// the imaginary parts of DC and Nyquist are ignored
+				if (firstbin == 0)
+					si[q][0] = 0.0f;
+				if (firstbin <= halfsamples && halfsamples < firstbin + blocklen)
+					si[q][halfsamples - firstbin] = 0.0f;
+			}
+			for (int i = 0; i < blocklen; ++i)
+			{
+				wr[i] = twr[i];
+				wi[i] = twi[i];
+			}
+			for (int p = 0; p < numparts; ++p)
+			{
+				for (int i = 0; i < blocklen; ++i)
+				{
+					xr[i] = sr[0][i];
+					xi[i] = si[0][i];
+				}
+				for (int q = 1, idx = p; q < numparts; ++q, idx = idx + p < numparts ? idx + p : idx + p - numparts)
+				{
+					const float c = partcos[idx];
+					const float s = partsin[idx];
+					for (int i = 0; i < blocklen; ++i)
+					{
+						xr[i] += sr[q][i] * c + si[q][i] * s;
+						xi[i] += si[q][i] * c - sr[q][i] * s;
+					}
+				}
+				float* yr = layout.partre + p * layout.binstride + block;
+				float* yi = layout.partim + p * layout.binstride + block;
+				if (p == 0)
+				{
+					FloatVectorOperations::copy(yr, xr, blocklen);
+					FloatVectorOperations::copy(yi, xi, blocklen);
+					continue;
+				}
+				for (int i = 0; i < blocklen; ++i)
+				{
+					yr[i] = xr[i] * wr[i] + xi[i] * wi[i];
+					yi[i] = xi[i] * wr[i] - xr[i] * wi[i];
+					const float nextwr = wr[i] * twr[i] - wi[i] * twi[i];
+					wi[i] = wr[i] * twi[i] + wi[i] * twr[i];
+					wr[i] = nextwr;
+				}
+			}
+		}
+	});
+	workers.parallelFor(count * numparts, [this, items](int task)
+	{
+		const auto layout = getScratchLayout(items[task / numparts].scratch);
+		const int p = task % numparts;
+		subplan->inverseComplex(layout.partre + p * layout.binstride, layout.partim + p * layout.binstride,
+			layout.parts + p * layout.partstride, layout.subscratch + p * layout.subscratchstride);
+	});
+	// Each task writes a contiguous range of smp, so the threads don't share cache lines
+	workers.parallelFor(count * numparts, [this, items, scale](int task)
+	{
+		const auto layout = getScratchLayout(items[task / numparts].scratch);
+		float* smp = items[task / numparts].smp;
+		int m0, m1;
+		getBinRange(partsize, numparts, task % numparts, m0, m1);
+		for (int p = 0; p < numparts; ++p)
+		{
+			const float* part = layout.parts + p * layout.partstride;
+			for (int m = m0; m < m1; ++m)
+				smp[p + numparts * m] = part[m] * scale;
+		}
+	});
+}
+
+void ParallelFFTPlan::fillRandomSpectrum(const float* freq, RandomPhaseGenerator& phases, float* scratch) const
+{
+	const auto layout = getScratchLayout(scratch);
+	float* specre = layout.specre;
+	float* specim = layout.specim;
+	// the phases are used in the same order as by the unsplit plans
+	forEachRandomPhasorBlock(nsamples, phases, [specre, specim, freq](int start, int count, const RandomPhaseGenerator::Phasor* ph)
+	{
+		for (int k = 0; k < count; ++k)
+		{
+			specre[start + k] = freq[start + k] * ph[k].c;
+			specim[start + k] = freq[start + k] * ph[k].s;
+		}
+	});
+	specre[0] = specim[0] = specre[nsamples / 2] = specim[nsamples / 2] = 0.0f;
+}
+
+void ParallelFFTPlan::forwardMagnitudes(float* smp, float* freq, float* scratch) const
+{
+	const BatchItem item{ smp, freq, scratch, nullptr };
+	forwardMagnitudesBatch(&item, 1);
+}
+
+void ParallelFFTPlan::inverseRandomPhases(const float* freq, RandomPhaseGenerator& phases, float* smp, float* scratch) const
+{
+	fillRandomSpectrum(freq, phases, scratch);
+	const BatchItem item{ smp, nullptr, scratch, &phases };
+	inverseParts(&item, 1, 1.0f / nsamples);
+}
+
+void ParallelFFTPlan::forwardMagnitudesBatch(const BatchItem* items, int count) const
+{
+	forwardParts(items, count, [items](int item, int firstbin, int step, const float* xr, const float* xi, int n)
+	{
+		float* freq = items[item].freq;
+		for (int i = 0; i < n; ++i)
+			freq[firstbin + step * i] = sqrt(xr[i] * xr[i] + xi[i] * xi[i]);
+	});
+	for (int i = 0; i < count; ++i)
+		items[i].freq[0] = 0.0;
+}
+
+void ParallelFFTPlan::inverseRandomPhasesBatch(const BatchItem* items, int count) const
+{
+	// each transform has its own phase generator, so their spectra can be made at the same time
+	workers.parallelFor(count, [this, items](int i)
+	{
+		fillRandomSpectrum(items[i].freq, *items[i].phases, items[i].scratch);
+	});
+	inverseParts(items, count, 1.0f / nsamples);
+}
+
+void ParallelFFTPlan::forwardComplex(float* smp, float* re, float* im, float* scratch) const
+{
+	const BatchItem item{ smp, nullptr, scratch, nullptr };
+	forwardParts(&item, 1, [re, im](int, int firstbin, int step, const float* xr, const float* xi, int n)
+	{
+		// the mirrored bins are the conjugates
+		for (int i = 0; i < n; ++i)
+		{
+			re[firstbin + step * i] = xr[i];
+			im[firstbin + step * i] = (float)step * xi[i];
+		}
+	});
+	im[0] = im[nsamples / 2] = 0.0f;
+}
+
+void ParallelFFTPlan::inverseComplex(const float* re, const float* im, float* smp, float* scratch) const
+{
+	const auto layout = getScratchLayout(scratch);
+	FloatVectorOperations::copy(layout.specre, re, nsamples / 2 + 1);
+	FloatVectorOperations::copy(layout.specim, im, nsamples / 2 + 1);
+	const BatchItem item{ smp, nullptr, scratch, nullptr };
+	inverseParts(&item, 1, 1.0f);
+}
+
+void FFTPlan::forwardMagnitudesBatch(const BatchItem* items, int count) const
+{
+	for (int i = 0; i < count; ++i)
+		forwardMagnitudes(items[i].smp, items[i].freq, items[i].scratch);
+}
+
+void FFTPlan::inverseRandomPhasesBatch(const BatchItem* items, int count) const
+{
+	for (int i = 0; i < count; ++i)
+		inverseRandomPhases(items[i].freq, *items[i].phases, items[i].smp, items[i].scratch);
+}
+
+std::unique_ptr<FFTPlan> FFTPlan::create(FFTBackendType backend, int nsamples, FFTDirection direction)
+{
+	jassert(isSizeSupported(backend, nsamples));
+	ignoreUnused(direction);
+#if PS_HAVE_FFTW
+	if (backend == FFTBackendType::FFTW)
+		return std::make_unique<FFTWPlan>(nsamples, direction);
+#endif
+#if PS_USE_VDSP_FFT
+	if (backend == FFTBackendType::VDSP)
+		return std::make_unique<VDSPPlan>(nsamples);
+#endif
+	return std::make_unique<PFFFTPlan>(nsamples);
+}
+
+bool FFTPlan::isBackendAvailable(FFTBackendType backend)
+{
+	if (backend == FFTBackendType::FFTW)
+		return PS_HAVE_FFTW;
+	if (backend == FFTBackendType::VDSP)
+		return PS_USE_VDSP_FFT;
+	return true;
+}
+
+std::vector<FFTBackendType> FFTPlan::getAvailableBackends()
+{
+	std::vector<FFTBackendType> result;
+	for (auto backend : { FFTBackendType::FFTW, FFTBackendType::VDSP, FFTBackendType::PFFFT })
+		if (isBackendAvailable(backend))
+			result.push_back(backend);
+	return result;
+}
+
+bool FFTPlan::isSizeSupported(FFTBackendType backend, int nsamples)
+{
+	if (isBackendAvailable(backend) == false || nsamples < 2 || nsamples % 2 != 0)
+		return false;
+	if (backend == FFTBackendType::VDSP)
+		return isPowerOfTwo(nsamples);
+	if (backend == FFTBackendType::PFFFT)
+	{
+		// real transforms need a multiple of 2*simdsize^2 that only has the prime factors 2, 3 and 5.
+		// This checks the 4 wide build, the wider ones hand the sizes they can't do down to it.
+		const int simdsize = pffft_simd_size();
+		if (nsamples % (2 * simdsize * simdsize) != 0)
+			return false;
+		int n = nsamples;
+		for (int factor : { 2, 3, 5 })
+			while (n % factor == 0)
+				n /= factor;
+		return n == 1;
+	}
+	return true;
+}
+
+String FFTPlan::getPFFFTSimdName()
+{
+	return getPFFFTBuilds().front().name;
+}
+
+String FFTPlan::getBackendName(FFTBackendType backend)
+{
+	if (backend == FFTBackendType::FFTW)
+		return "fftw";
+	if (backend == FFTBackendType::VDSP)
+		return "vdsp";
+	return "pffft";
+}
+
+bool FFTPlan::getBackendFromName(const String& name, FFTBackendType& result)
+{
+	for (auto backend : { FFTBackendType::FFTW, FFTBackendType::VDSP, FFTBackendType::PFFFT })
+	{
+		if (name == getBackendName(backend))
+		{
+			result = backend;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool importFFTWWisdom(const File& file)
+{
+#if PS_HAVE_FFTW
+	return fftwf_import_wisdom_from_filename(file.getFullPathName().toRawUTF8()) != 0;
+#else
+	ignoreUnused(file);
+	return false;
+#endif
+}
+
+bool exportFFTWWisdom(const File& file)
+{
+#if PS_HAVE_FFTW
+	return fftwf_export_wisdom_to_filename(file.getFullPathName().toRawUTF8()) != 0;
+#else
+	ignoreUnused(file);
+	return false;
+#endif
+}
@@ -0,0 +1,345 @@
+// SPDX-License-Identifier: GPLv3-or-later WITH Appstore-exception
+
+#pragma once
+
+#include "globals.h"
+
+#ifndef PS_USE_VDSP_FFT
+#define PS_USE_VDSP_FFT 0
+#endif
+
+#ifndef PS_USE_PFFFT
+#define PS_USE_PFFFT 0
+#endif
+
+// The AVX2 and AVX-512 builds of pffft are linked in, set by the build system on x86
+#ifndef PS_PFFFT_WIDE
+#define PS_PFFFT_WIDE 0
+#endif
+
+// The builds that don't link FFTW (PS_USE_VDSP_FFT or PS_USE_PFFFT) only have those backends,
+// the others have both FFTW and pffft and choose between them at runtime
+#if PS_USE_VDSP_FFT || PS_USE_PFFFT
+#define PS_HAVE_FFTW 0
+#else
+#define PS_HAVE_FFTW 1
+#endif
+
+// Use the phasor table and vectorized generator for the random phases in FFT::freq2smp,
+// set to 0 to get the original per bin mt19937 and cos/sin calls
+#ifndef PS_USE_PHASE_TABLE
+#define PS_USE_PHASE_TABLE 1
+#endif
+
+#include "../pffft/pffft.h"
+#if PS_HAVE_FFTW
+#include "fftw3.h"
+#endif
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include <random>
+#include <type_traits>
+#include <atomic>
+
+// 64 byte aligned buffer, which satisfies all the FFT backends and their SIMD code
+template<typename T>
+class FFTWBuffer
+{
+public:
+    FFTWBuffer()
+    {
+        static_assert(std::is_floating_point<T>::value,"FFTWBuffer only works with floating point types");
+    }
+    ~FFTWBuffer()
+    {
+        freeimpl(m_buf);
+    }
+    void resize(int size, bool clear)
+    {
+        // come on, zero size doesn't make sense!
+        jassert(size>0);
+        if (size==m_size && clear==false)
+            return;
+        if (m_buf)
+            freeimpl(m_buf);
+        mallocimpl(m_buf,size);
+
+        if (clear)
+            for (int i=0;i<size;++i)
+                m_buf[i]=T();
+        m_size = size;
+    }
+
+	T& operator[](int index)
+	{
+		jassert(index >= 0 && index < m_size);
+		return m_buf[index];
+	}
+	const T& operator[](int index) const
+	{
+		jassert(index >= 0 && index < m_size);
+		return m_buf[index];
+	}
+
+    T* data()
+    {
+        // callers to this will likely just blow themselves up if they get a nullptr back
+        jassert(m_buf!=nullptr);
+        return m_buf;
+    }
+    int getSize() const { return m_size; }
+    T* begin() { return m_buf; }
+    T* end() { return m_buf + m_size; }
+    FFTWBuffer(FFTWBuffer&& other) : m_buf(other.m_buf), m_size(other.m_size)
+	{
+		other.m_buf = nullptr;
+		other.m_size = 0;
+	}
+	FFTWBuffer& operator = (FFTWBuffer&& other)
+	{
+		std::swap(other.m_buf, m_buf);
+		std::swap(other.m_size, m_size);
+		return *this;
+	}
+	// These buffers probably shouldn't be copied anywhere, so just disallow that for now
+	FFTWBuffer(const FFTWBuffer&) = delete;
+	FFTWBuffer& operator = (const FFTWBuffer&) = delete;
+private:
+    T* m_buf = nullptr;
+    int m_size = 0;
+    // FFTW plans may only be executed on buffers with the alignment of the planning buffers,
+    // so everything uses the same allocator whatever backend ends up using the buffer
+    void mallocimpl(T*& buf,int size)
+    {
+        buf = (T*)pffft_aligned_malloc(size*sizeof(T));
+    }
+	void freeimpl(T*& buf)
+    {
+        if (buf!=nullptr)
+        {
+            pffft_aligned_free(buf);
+			buf = nullptr;
+        }
+    }
+};
+
+// A buffer carved out of a BufferArena, it doesn't own its memory and is valid while the arena is
+class ArenaBuffer
+{
+public:
+	float* data()
+	{
+		jassert(m_buf != nullptr);
+		return m_buf;
+	}
+	const float* data() const { return m_buf; }
+	int size() const { return m_size; }
+	float& operator[](int index)
+	{
+		jassert(index >= 0 && index < m_size);
+		return m_buf[index];
+	}
+	const float& operator[](int index) const
+	{
+		jassert(index >= 0 && index < m_size);
+		return m_buf[index];
+	}
+	float* begin() { return m_buf; }
+	float* end() { return m_buf + m_size; }
+	const float* begin() const { return m_buf; }
+	const float* end() const { return m_buf + m_size; }
+private:
+	friend class BufferArena;
+	float* m_buf = nullptr;
+	int m_size = 0;
+};
+
+// One 64 byte aligned allocation that the working buffers of a stretcher are carved out of, each
+// of them 64 byte aligned too. The buffers are added first and get their memory from allocate,
+// so the buffers must not move while they are in an arena.
+class BufferArena
+{
+public:
+	BufferArena() {}
+	void add(ArenaBuffer& buffer, int size);
+	// Allocates the memory of all the added buffers, cleared to zero
+	void allocate();
+	// Sets all the buffers to zero
+	void clear();
+	// Size of the allocation in floats
+	int getSize() const { return m_size; }
+	BufferArena(BufferArena&&) = default;
+	BufferArena& operator = (BufferArena&&) = default;
+private:
+	std::vector<std::pair<ArenaBuffer*, int>> m_buffers;
+	FFTWBuffer<float> m_memory;
+	int m_size = 0;
+	JUCE_DECLARE_NON_COPYABLE(BufferArena)
+};
+
+// Random phase source for FFT::freq2smp. The phases are quantized to 32768 steps, so they
+// are looked up from a table of unit phasors that all FFT instances share. The table indices
+// come from independent xoshiro128+ lanes that are advanced together, so the compiler can
+// keep the whole generator state in vector registers.
+class RandomPhaseGenerator
+{
+public:
+	static constexpr int numphases = 32768;
+	static constexpr int numlanes = 8;
+	struct Phasor
+	{
+		float c, s;
+	};
+	explicit RandomPhaseGenerator(uint32_t seed);
+	// Fills dest with n uniformly distributed phase indices in the range 0..numphases-1
+	void generate(uint32_t* dest, int n);
+	// Fills dest with n unit phasors of random phase
+	void generatePhasors(Phasor* dest, int n);
+	static const Phasor* getPhasorTable();
+private:
+	alignas(32) uint32_t m_state[4][numlanes];
+	void nextBlock(uint32_t* dest);
+#if !PS_USE_PHASE_TABLE
+	std::mt19937 m_randgen;
+	std::uniform_int_distribution<unsigned int> m_randdist{0,32767};
+#endif
+};
+
+enum class FFTBackendType { FFTW, PFFFT, VDSP };
+enum class FFTDirection { Forward, Inverse };
+// How much time FFTW may spend looking for a fast plan, only used by the FFTW backend
+enum class FFTPlanningMode { Estimate, Measure, Patient };
+
+// A transform plan/setup of one of the FFT backends. Plans are immutable once created and
+// are executed on the caller's own buffers, so one plan can be used by any number of FFT
+// objects at the same time. Get these from FFTPlanRegistry instead of creating them directly.
+// The spectrum layout differs between the backends, so the plans take care of turning it
+// into magnitudes and back.
+class FFTPlan
+{
+public:
+	FFTPlan(int nsamples_, FFTDirection direction_) : nsamples(nsamples_), direction(direction_) {}
+	virtual ~FFTPlan() {}
+	virtual FFTBackendType getBackend() const = 0;
+	// Size in floats of the scratch buffer the transforms need
+	virtual int getScratchSize() const = 0;
+	// Magnitudes of bins 1..nsamples/2-1 of smp into freq, freq[0] is set to 0
+	virtual void forwardMagnitudes(float* smp, float* freq, float* scratch) const = 0;
+	// Inverse transform of the magnitudes in freq with random phases into smp,
+	// the DC and Nyquist bins are set to 0
+	virtual void inverseRandomPhases(const float* freq, RandomPhaseGenerator& phases, float* smp, float* scratch) const = 0;
+	// Unscaled complex spectrum of bins 0..nsamples/2 of smp into separate real and imaginary
+	// arrays, the imaginary parts of DC and Nyquist are 0
+	virtual void forwardComplex(float* smp, float* re, float* im, float* scratch) const = 0;
+	// Unscaled inverse of forwardComplex, the imaginary parts of DC and Nyquist are ignored
+	virtual void inverseComplex(const float* re, const float* im, float* smp, float* scratch) const = 0;
+	// The buffers of one transform of a batch, as for the single transforms
+	struct BatchItem
+	{
+		float* smp;
+		float* freq;
+		float* scratch;
+		RandomPhaseGenerator* phases;
+	};
+	// Several transforms of this plan, the same as doing them one by one. The split plans
+	// override these to run the parts of all of them with the same handoffs to the workers.
+	virtual void forwardMagnitudesBatch(const BatchItem* items, int count) const;
+	virtual void inverseRandomPhasesBatch(const BatchItem* items, int count) const;
+	// Replaces the plan with a measured one if the backend supports that, returns true if it did.
+	// Called only on the registry's planner thread.
+	virtual bool makeMeasuredPlan(FFTPlanningMode) const { return false; }
+
+	static std::unique_ptr<FFTPlan> create(FFTBackendType backend, int nsamples, FFTDirection direction);
+	static bool isBackendAvailable(FFTBackendType backend);
+	static std::vector<FFTBackendType> getAvailableBackends();
+	static bool isSizeSupported(FFTBackendType backend, int nsamples);
+	// pffft and vDSP setups do both directions, FFTW needs a plan for each
+	static bool hasSeparateInversePlans(FFTBackendType backend) { return backend == FFTBackendType::FFTW; }
+	static String getBackendName(FFTBackendType backend);
+	// Instruction set of the widest pffft build this CPU runs, for example "AVX2"
+	static String getPFFFTSimdName();
+	static bool getBackendFromName(const String& name, FFTBackendType& result);
+
+	const int nsamples;
+	const FFTDirection direction;
+	JUCE_DECLARE_NON_COPYABLE(FFTPlan)
+};
+
+// Threads that run the parts of one transform at the same time. The calling thread takes part
+// too, so n threads means n-1 workers. Only one transform at a time uses the workers, when
+// they are busy the caller runs all the tasks on its own.
+class FFTWorkerPool
+{
+public:
+	using TaskFunction = void(*)(void* context, int task);
+	FFTWorkerPool();
+	~FFTWorkerPool();
+	void setNumThreads(int numthreads);
+	int getNumThreads() const { return m_numthreads.load(); }
+	// Calls task(i) for i in 0..numtasks-1 and returns when all of them have finished
+	template<typename F>
+	void parallelFor(int numtasks, F&& task)
+	{
+		run(numtasks, [](void* context, int i) { (*(std::remove_reference_t<F>*)context)(i); }, (void*)&task);
+	}
+	void run(int numtasks, TaskFunction function, void* context);
+private:
+	struct Job
+	{
+		TaskFunction function;
+		void* context;
+		int numtasks;
+		std::atomic<int> nexttask{ 0 };
+		std::atomic<int> pendingworkers{ 0 };
+	};
+	class Worker;
+	static void runTasks(Job& job);
+	std::vector<std::unique_ptr<Worker>> m_workers;
+	std::atomic<int> m_numthreads{ 1 };
+	WaitableEvent m_finished;
+	CriticalSection m_cs;
+	JUCE_DECLARE_NON_COPYABLE(FFTWorkerPool)
+};
+
+// Splits a transform of size N into P real transforms of size N/P done by a plan of the
+// backend (decimation in time) and runs those and the radix-P combining pass over the worker
+// threads. Only worth it for the very large sizes, where a single transform takes milliseconds.
+class ParallelFFTPlan : public FFTPlan
+{
+public:
+	ParallelFFTPlan(int nsamples_, FFTDirection direction_, std::shared_ptr<const FFTPlan> subplan_, FFTWorkerPool& workers_);
+	FFTBackendType getBackend() const override { return subplan->getBackend(); }
+	int getScratchSize() const override;
+	void forwardMagnitudes(float* smp, float* freq, float* scratch) const override;
+	void inverseRandomPhases(const float* freq, RandomPhaseGenerator& phases, float* smp, float* scratch) const override;
+	void forwardComplex(float* smp, float* re, float* im, float* scratch) const override;
+	void inverseComplex(const float* re, const float* im, float* smp, float* scratch) const override;
+	void forwardMagnitudesBatch(const BatchItem* items, int count) const override;
+	void inverseRandomPhasesBatch(const BatchItem* items, int count) const override;
+	// measures the plan of the parts
+	bool makeMeasuredPlan(FFTPlanningMode mode) const override { return subplan->makeMeasuredPlan(mode); }
+	// Number of parts to split the size into for the number of threads, 0 if it can't be split
+	static int getNumParts(FFTBackendType backend, int nsamples, int numthreads);
+	// Smaller sizes aren't split, the thread handoff would cost more than it saves
+	static constexpr int minsize = 131072;
+	const int numparts;
+private:
+	struct ScratchLayout;
+	ScratchLayout getScratchLayout(float* scratch) const;
+	template<typename F>
+	void forwardParts(const BatchItem* items, int count, F&& store) const;
+	void inverseParts(const BatchItem* items, int count, float scale) const;
+	void fillRandomSpectrum(const float* freq, RandomPhaseGenerator& phases, float* scratch) const;
+	std::shared_ptr<const FFTPlan> subplan;
+	FFTWorkerPool& workers;
+	const int partsize;
+	// W_N^k for k in 0..N/P/2, the other twiddles are powers of these
+	std::vector<float> twiddlecos, twiddlesin;
+	// W_P^(k mod P)
+	std::vector<float> partcos, partsin;
+};
+
+// FFTW wisdom, these do nothing and return false in builds without FFTW.
+// The FFTW planner isn't thread safe, so call these only while holding the registry's planner lock.
+bool importFFTWWisdom(const File& file);
+bool exportFFTWWisdom(const File& file);
@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: GPLv3-or-later WITH Appstore-exception
+
+#include "OnsetAnalysis.h"
+
+float OnsetCurve::getStrength(int64 position) const
+{
+	if (strengths.empty() || hop <= 0)
+		return 0.0f;
+	const int64 index = (position + hop / 2) / hop;
+	return strengths[(size_t)jlimit<int64>(0, (int64)strengths.size() - 1, index)];
+}
+
+OnsetAnalyzer::OnsetAnalyzer() : m_pool(jmax(1, SystemStats::getNumCpus() - 1))
+{
+}
+
+OnsetAnalyzer::~OnsetAnalyzer()
+{
+	// The pool waits for the running jobs, the cancelled ones return at their next hop
+	ScopedLock locker(m_cs);
+	for (auto& e : m_analyses)
+		e.second->cancelled = true;
+}
+
+std::shared_ptr<const OnsetCurve> OnsetAnalyzer::getCurve(const URL& file, int64 numsamples,
+	int numchannels, double samplerate, int bufsize, FFTWindow window)
+{
+	const File localfile = file.getLocalFile();
+	Source source;
+	source.numsamples = numsamples;
+	source.numchannels = numchannels;
+	source.samplerate = samplerate;
+	// The format manager of the caller may be gone before the chunks are done, so they have their own
+	source.read = [localfile](AudioBuffer<float>& dest, int destpos, int64 position, int num)
+	{
+		AudioFormatManager formatmanager;
+		formatmanager.registerBasicFormats();
+		std::unique_ptr<AudioFormatReader> reader(formatmanager.createReaderFor(localfile));
+		if (reader != nullptr)
+			reader->read(&dest, destpos, num, position, true, true);
+	};
+	// a file that was changed on disk gets analysed again
+	const String id = localfile.getFullPathName() + " " + String(localfile.getLastModificationTime().toMilliseconds());
+	return getCurve(Key(id, bufsize, window), source);
+}
+
+std::shared_ptr<const OnsetCurve> OnsetAnalyzer::getCurve(SharedBuffer buffer, const String& id, double samplerate,
+	int bufsize, FFTWindow window)
+{
+	jassert(buffer != nullptr);
+	Source source;
+	source.numsamples = buffer->getNumSamples();
+	source.numchannels = buffer->getNumChannels();
+	source.samplerate = samplerate;
+	source.read = [buffer](AudioBuffer<float>& dest, int destpos, int64 position, int num)
+	{
+		for (int ch = 0; ch < dest.getNumChannels() && ch < buffer->getNumChannels(); ++ch)
+			dest.copyFrom(ch, destpos, *buffer, ch, (int)position, num);
+	};
+	return getCurve(Key(id, bufsize, window), source);
+}
+
+int OnsetAnalyzer::getNumCurves()
+{
+	ScopedLock locker(m_cs);
+	return (int)m_analyses.size();
+}
+
+std::shared_ptr<const OnsetCurve> OnsetAnalyzer::getCurve(const Key& key, const Source& source)
+{
+	ScopedLock locker(m_cs);
+	std::shared_ptr<Analysis> analysis = m_analyses[key];
+	if (analysis == nullptr)
+	{
+		analysis = std::make_shared<Analysis>();
+		analysis->source = source;
+		analysis->window = std::get<2>(key);
+		auto curve = std::make_shared<OnsetCurve>();
+		curve->bufsize = std::get<1>(key);
+		curve->hop = jmax(1, curve->bufsize / 2);
+		curve->numsamples = source.numsamples;
+		curve->strengths.assign((size_t)(source.numsamples / curve->hop + 1), 0.0f);
+		analysis->curve = curve;
+		// chunks of about a million samples, each of them also computes the two spectra before its first hop.
+		// The input of a chunk is its hops and five more, so the largest sizes get a few hops per chunk.
+		const int64 numhops = (int64)curve->strengths.size();
+		const int hopsperchunk = jmax(1, (1 << 20) / curve->hop);
+		analysis->pendingchunks = (int)((numhops + hopsperchunk - 1) / hopsperchunk);
+		for (int64 first = 0; first < numhops; first += hopsperchunk)
+		{
+			const int num = (int)jmin<int64>(hopsperchunk, numhops - first);
+			m_pool.addJob([analysis, first, num]()
+			{
+				analyseChunk(*analysis, first, num);
+				--analysis->pendingchunks;
+			});
+		}
+		m_analyses[key] = analysis;
+	}
+	analysis->lastused = ++m_usecount;
+	trim();
+	if (analysis->pendingchunks.load() > 0)
+		return nullptr;
+	return analysis->curve;
+}
+
+void OnsetAnalyzer::analyseChunk(Analysis& analysis, int64 firsthop, int numhops)
+{
+	const Source& source = analysis.source;
+	const int bufsize = analysis.curve->bufsize;
+	const int hop = analysis.curve->hop;
+	const int fftsize = 2 * bufsize;
+	const int numchannels = jmax(1, source.numchannels);
+	// the input of the frames from two hops before the first one, the positions outside the input are silence
+	const int64 start = (firsthop - 2) * hop - fftsize;
+	const int64 end = (firsthop + numhops - 1) * hop;
+	AudioBuffer<float> input(numchannels, (int)(end - start));
+	input.clear();
+	const int64 readstart = jmax<int64>(0, start);
+	const int64 readend = jmin(end, source.numsamples);
+	if (readend > readstart)
+		source.read(input, (int)(readstart - start), readstart, (int)(readend - readstart));
+	FFT fft(fftsize, true);
+	FFT* fftptr = &fft;
+	// the spectra of the last three hops of each channel, the onset detection compares a frame to the one
+	// bufsize samples (two hops) earlier
+	std::vector<REALTYPE> spectra((size_t)3 * numchannels * bufsize);
+	for (int i = -2; i < numhops; ++i)
+	{
+		if (analysis.cancelled.load())
+			return;
+		float strength = 0.0f;
+		for (int ch = 0; ch < numchannels; ++ch)
+		{
+			const float* smps = input.getReadPointer(ch) + (i + 2) * hop;
+			fft.setWindowedInput(smps, fftsize, smps, analysis.window);
+			FFT::smp2freq(&fftptr, 1);
+			REALTYPE* spectrum = spectra.data() + ((size_t)((i + 3) % 3) * numchannels + ch) * bufsize;
+			FloatVectorOperations::copy(spectrum, fft.freq.data(), bufsize);
+			if (i >= 0)
+			{
+				const REALTYPE* previous = spectra.data() + ((size_t)((i + 1) % 3) * numchannels + ch) * bufsize;
+				strength = jmax(strength, Stretch::get_onset_strength(spectrum, previous, bufsize, (REALTYPE)source.samplerate));
+			}
+		}
+		if (i >= 0)
+			analysis.curve->strengths[(size_t)(firsthop + i)] = strength;
+	}
+}
+
+void OnsetAnalyzer::trim()
+{
+	// the least recently used ones go first, the running analyses of those stop
+	while ((int)m_analyses.size() > maxcurves)
+	{
+		auto oldest = m_analyses.begin();
+		for (auto it = m_analyses.begin(); it != m_analyses.end(); ++it)
+			if (it->second->lastused < oldest->second->lastused)
+				oldest = it;
+		oldest->second->cancelled = true;
+		m_analyses.erase(oldest);
+	}
+}
@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: GPLv3-or-later WITH Appstore-exception
+
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "Stretch.h"
+#include <map>
+#include <tuple>
+
+// The onset strengths of a whole input, of the frames whose input ends at every hop samples.
+// They don't depend on the sensitivity, Stretch::get_onset_from_strength gives the onset values.
+struct OnsetCurve
+{
+	int bufsize = 0;
+	int hop = 0;
+	int64 numsamples = 0;
+	// of the channel with the strongest onset
+	std::vector<float> strengths;
+	// the strength of the frame whose input has been read up to the position
+	float getStrength(int64 position) const;
+};
+
+// Computes the onset curves of whole files and audio buffers in chunks on a thread pool, so that the
+// playback doesn't need the input spectrum for the onset detection. The recently used curves are kept,
+// the analyzer is shared by all the StretchAudioSources of the process.
+class OnsetAnalyzer
+{
+public:
+	using SharedBuffer = std::shared_ptr<const AudioBuffer<float>>;
+	OnsetAnalyzer();
+	~OnsetAnalyzer();
+	// The curve for the FFT size and window, nullptr while it's being computed. The first call for
+	// them starts the analysis. The file is read with its own reader for each chunk.
+	std::shared_ptr<const OnsetCurve> getCurve(const URL& file, int64 numsamples,
+		int numchannels, double samplerate, int bufsize, FFTWindow window);
+	// The id tells the buffers apart, the buffer mustn't be changed after this
+	std::shared_ptr<const OnsetCurve> getCurve(SharedBuffer buffer, const String& id, double samplerate,
+		int bufsize, FFTWindow window);
+	int getNumCurves();
+private:
+	struct Source
+	{
+		int64 numsamples = 0;
+		int numchannels = 0;
+		double samplerate = 0.0;
+		// reads the samples from the position to the start of the buffer, on the pool threads
+		std::function<void(AudioBuffer<float>& dest, int destpos, int64 position, int numsamples)> read;
+	};
+	struct Analysis
+	{
+		Source source;
+		std::shared_ptr<OnsetCurve> curve;
+		FFTWindow window = W_HAMMING;
+		std::atomic<int> pendingchunks{ 0 };
+		std::atomic<bool> cancelled{ false };
+		int64 lastused = 0;
+	};
+	using Key = std::tuple<String, int, FFTWindow>;
+	std::shared_ptr<const OnsetCurve> getCurve(const Key& key, const Source& source);
+	static void analyseChunk(Analysis& analysis, int64 firsthop, int numhops);
+	void trim();
+	CriticalSection m_cs;
+	std::map<Key, std::shared_ptr<Analysis>> m_analyses;
+	int64 m_usecount = 0;
+	ThreadPool m_pool;
+	static const int maxcurves = 8;
+};
@@ -35,9 +35,32 @@ ProcessedStretch::~ProcessedStretch()
 void ProcessedStretch::set_parameters(ProcessParameters *ppar)
 {
 	pars=*ppar;
+	std::atomic_store(&m_plan, std::shared_ptr<const SpectralPlan>());
 	//update_free_filter();
 }
 
+void ProcessedStretch::setSpectralPlan(std::shared_ptr<const SpectralPlan> plan)
+{
+	std::atomic_store(&m_plan, std::move(plan));
+}
+
+void ProcessedStretch::pick_plan()
+{
+	auto plan = std::atomic_load(&m_plan);
+	if (plan == m_frame_plan)
+		return;
+	m_frame_plan = std::move(plan);
+	if (m_frame_plan != nullptr)
+		pars = m_frame_plan->pars;
+}
+
+const SpectralPlan* ProcessedStretch::get_plan() const
+{
+	if (m_frame_plan == nullptr || m_frame_plan->nfreq != nfreq || m_frame_plan->samplerate != samplerate)
+		return nullptr;
+	return m_frame_plan.get();
+}
+
 void ProcessedStretch::setFreeFilterEnvelope(shared_envelope env)
 {
 	m_free_filter_envelope = env;
@@ -47,33 +70,38 @@ void ProcessedStretch::setBufferSize(int sz)
 {
 	jassert(sz > 0);
 	Stretch::setBufferSize(sz);
-	//if (nfreq != sz)
-	{
-		nfreq = bufsize;
-		m_infreq = floatvector(nfreq);
-		m_sumfreq = floatvector(nfreq);
-		m_tmpfreq1 = floatvector(nfreq);
-		m_tmpfreq2 = floatvector(nfreq);
-		m_free_filter_freqs = floatvector(nfreq);
-		fill_container(m_free_filter_freqs, 1.0f);
-	}
+	nfreq = bufsize;
+	fill_container(m_free_filter_freqs, 1.0f);
+	m_harmonics_mask_pars.valid = false;
+	m_num_frozen_stages = 0;
+}
+
+void ProcessedStretch::addBuffers(BufferArena& arena)
+{
+	arena.add(m_infreq, bufsize);
+	arena.add(m_tmpfreq1, bufsize);
+	arena.add(m_tmpfreq2, bufsize);
+	arena.add(m_free_filter_freqs, bufsize);
+	arena.add(m_harmonics_mask, bufsize);
+	arena.add(m_frozen_output, bufsize);
+	arena.add(m_frozen_checkpoint, bufsize);
 }
 
 void ProcessedStretch::copy(REALTYPE* freq1, REALTYPE* freq2)
 {
-	for (int i = 0; i<nfreq; i++) freq2[i] = freq1[i];
+	SpectralKernels::copy(freq1, freq2, nfreq);
 };
 
 void ProcessedStretch::add(REALTYPE *freq2,REALTYPE *freq1,REALTYPE a){
-	for (int i=0;i<nfreq;i++) freq2[i]+=freq1[i]*a;
+	SpectralKernels::add(freq2, freq1, a, nfreq);
 };
 
 void ProcessedStretch::mul(REALTYPE *freq1,REALTYPE a){
-	for (int i=0;i<nfreq;i++) freq1[i]*=a;
+	SpectralKernels::multiply(freq1, a, nfreq);
 };
 
 void ProcessedStretch::zero(REALTYPE *freq1){
-	for (int i=0;i<nfreq;i++) freq1[i]=0.0;
+	SpectralKernels::zero(freq1, nfreq);
 };
 
 REALTYPE ProcessedStretch::get_stretch_multiplier(REALTYPE pos_percents){
@@ -98,30 +126,538 @@ REALTYPE ProcessedStretch::get_stretch_multiplier(REALTYPE pos_percents){
 
 void ProcessedStretch::process_spectrum(REALTYPE *freq)
 {
-	for (auto& e : m_spectrum_processes)
-    {
-		spectrum_copy(nfreq, freq, m_infreq.data());
-		if (e.m_index == SPT_Harmonics && *e.m_enabled == true)
-			spectrum_do_harmonics(pars, m_tmpfreq1, nfreq, samplerate, m_infreq.data(), freq);
-		if (e.m_index == SPT_TonalVsNoise && *e.m_enabled == true)
-			spectrum_do_tonal_vs_noise(pars,nfreq,samplerate,m_tmpfreq1, m_infreq.data(), freq);
-		if (e.m_index == SPT_FreqShift && *e.m_enabled == true)
-			spectrum_do_freq_shift(pars,nfreq,samplerate,m_infreq.data(), freq);
-		if (e.m_index == SPT_PitchShift && *e.m_enabled == true)
-			spectrum_do_pitch_shift(pars,nfreq,m_infreq.data(), freq, pow(2.0f, pars.pitch_shift.cents / 1200.0f));
-		if (e.m_index == SPT_RatioMix && *e.m_enabled == true)
-			spectrum_do_ratiomix(pars,nfreq,samplerate, m_sumfreq, m_tmpfreq1, m_infreq.data(), freq);
-		if (e.m_index == SPT_Spread && *e.m_enabled == true)
-			spectrum_spread(nfreq,samplerate,m_tmpfreq1,m_infreq.data(), freq, pars.spread.bandwidth);
-		if (e.m_index == SPT_Filter && *e.m_enabled == true)
-			spectrum_do_filter(pars,nfreq,samplerate,m_infreq.data(), freq);
-		if (e.m_index == SPT_Compressor && *e.m_enabled == true)
-			spectrum_do_compressor(pars,nfreq, m_infreq.data(), freq);
-		if (e.m_index == SPT_FreeFilter && *e.m_enabled == true)
-			spectrum_do_free_filter(m_free_filter_envelope, nfreq, samplerate, m_infreq.data(), freq);
+	pick_plan();
+	if (isFreezing())
+	{
+		process_frozen_spectrum(freq);
+		return;
+	}
+	m_num_frozen_stages = 0;
+	update_chain();
+	REALTYPE* cur = freq;
+	for (int i = 0; i < m_num_chain_kernels; ++i)
+	{
+		const ChainKernel& kernel = m_chain[i];
+		REALTYPE* dest = kernel.inplace ? cur : (cur == freq ? m_infreq.data() : freq);
+		run_kernel(kernel, cur, dest);
+		cur = dest;
 	}
+	if (cur != freq)
+		spectrum_copy(nfreq, cur, freq);
 };
 
+void ProcessedStretch::update_chain()
+{
+	std::array<SpectrumProcessType, 16> stages;
+	int numstages = 0;
+	for (auto& e : m_spectrum_processes)
+		if (*e.m_enabled == true && numstages < (int)stages.size())
+			stages[numstages++] = e.m_index;
+	if (numstages == m_num_chain_stages && std::equal(stages.begin(), stages.begin() + numstages, m_chain_stages.begin()))
+		return;
+	m_chain_stages = stages;
+	m_num_chain_stages = numstages;
+	auto iselementwise = [](SpectrumProcessType type)
+	{
+		return type == SPT_Filter || type == SPT_FreeFilter || type == SPT_Compressor;
+	};
+	m_num_chain_kernels = 0;
+	int numswaps = 0;
+	for (int i = 0; i < numstages; )
+	{
+		ChainKernel& kernel = m_chain[m_num_chain_kernels++];
+		kernel.type = stages[i];
+		kernel.firststage = i;
+		kernel.numstages = 1;
+		if (iselementwise(kernel.type))
+			while (i + kernel.numstages < numstages && iselementwise(stages[i + kernel.numstages]))
+				++kernel.numstages;
+		//the shifts and the ratio mixer read other bins than the one they write, the others can be run in place
+		kernel.inplace = kernel.type != SPT_FreqShift && kernel.type != SPT_PitchShift && kernel.type != SPT_RatioMix;
+		if (kernel.inplace == false)
+			++numswaps;
+		i += kernel.numstages;
+	}
+	//with an odd number of swaps the first in place kernel is made out of place, otherwise the output is copied to freq
+	for (int i = 0; i < m_num_chain_kernels && numswaps % 2 == 1; ++i)
+	{
+		if (m_chain[i].inplace)
+		{
+			m_chain[i].inplace = false;
+			++numswaps;
+		}
+	}
+}
+
+void ProcessedStretch::run_kernel(const ChainKernel& kernel, REALTYPE *freq1, REALTYPE *freq2)
+{
+	if (kernel.numstages > 1)
+		process_gain_stages(m_chain_stages.data() + kernel.firststage, kernel.numstages, freq1, freq2);
+	else
+		process_stage(kernel.type, freq1, freq2);
+}
+
+void ProcessedStretch::process_gain_stages(const SpectrumProcessType* types, int count, REALTYPE *freq1, REALTYPE *freq2)
+{
+	//the filters multiply their gains into the curve, the compressor scales it by its gain for the
+	//spectrum the stages before it give
+	REALTYPE* gain = m_tmpfreq2.data();
+	SpectralKernels::fill(gain, 1.0f, nfreq);
+	for (int i = 0; i < count; ++i)
+	{
+		if (types[i] == SPT_Filter && get_filter_gains() != nullptr)
+			SpectralKernels::multiplyBins(gain, get_filter_gains(), gain, nfreq);
+		else if (types[i] == SPT_Filter)
+			spectrum_do_filter(pars, nfreq, samplerate, gain, gain);
+		else if (types[i] == SPT_FreeFilter)
+			spectrum_do_free_filter(get_free_filter_gains(), nfreq, gain, gain);
+		else if (types[i] == SPT_Compressor)
+		{
+			REALTYPE sumsquares = SpectralKernels::sumOfSquaresOfProduct(freq1, gain, nfreq);
+			SpectralKernels::multiply(gain, spectrum_compressor_gain(pars, nfreq, sumsquares), nfreq);
+		}
+	}
+	SpectralKernels::multiplyBins(freq1, gain, freq2, nfreq);
+}
+
+int ProcessedStretch::begin_spectrum_steps()
+{
+	pick_plan();
+	//the cached frozen chain is quick, so it's done as one step
+	m_step_frozen = isFreezing();
+	if (m_step_frozen)
+		return 1;
+	m_num_frozen_stages = 0;
+	update_chain();
+	m_chain_cur = nullptr;
+	return m_num_chain_kernels;
+}
+
+void ProcessedStretch::process_spectrum_step(REALTYPE *freq, int step)
+{
+	if (m_step_frozen)
+	{
+		process_frozen_spectrum(freq);
+		return;
+	}
+	jassert(step >= 0 && step < m_num_chain_kernels);
+	if (step == 0)
+		m_chain_cur = freq;
+	const ChainKernel& kernel = m_chain[step];
+	REALTYPE* dest = kernel.inplace ? m_chain_cur : (m_chain_cur == freq ? m_infreq.data() : freq);
+	run_kernel(kernel, m_chain_cur, dest);
+	m_chain_cur = dest;
+	if (step == m_num_chain_kernels - 1 && m_chain_cur != freq)
+		spectrum_copy(nfreq, m_chain_cur, freq);
+}
+
+void ProcessedStretch::process_stage(SpectrumProcessType type, REALTYPE *freq1, REALTYPE *freq2)
+{
+	switch (type)
+	{
+	case SPT_Harmonics:
+		freq2[0] = freq1[0];
+		SpectralKernels::multiplyBins(freq1 + 1, get_harmonics_mask() + 1, freq2 + 1, nfreq - 1);
+		break;
+	case SPT_TonalVsNoise:
+		spectrum_do_tonal_vs_noise(pars,nfreq,get_spread_warp(),m_tmpfreq1.data(), freq1, freq2);
+		break;
+	case SPT_FreqShift:
+		spectrum_do_freq_shift(pars,nfreq,samplerate,freq1, freq2);
+		break;
+	case SPT_PitchShift:
+	{
+		const SpectralPlan* plan = get_plan();
+		spectrum_do_pitch_shift(get_pitch_shift_table(m_pitch_shift_table, plan != nullptr ? plan->pitchshift : nullptr,
+			pow(2.0f, pars.pitch_shift.cents / 1200.0f)), freq1, freq2);
+		break;
+	}
+	case SPT_RatioMix:
+	{
+		const SpectralPlan* plan = get_plan();
+		std::array<const PitchShiftTable*, 8> tables{};
+		for (int i = 0; i < (int)tables.size(); ++i)
+			if (pars.ratiomix.ratiolevels[i] > 1e-3 && pars.ratiomix.ratios[i] > 0.0)
+				tables[i] = &get_pitch_shift_table(m_ratiomix_tables[i], plan != nullptr ? plan->ratiomix[i] : nullptr,
+					(REALTYPE)pars.ratiomix.ratios[i]);
+		spectrum_do_ratiomix(pars,nfreq,tables.data(), freq1, freq2);
+		break;
+	}
+	case SPT_Spread:
+		spectrum_spread(nfreq,get_spread_warp(),m_tmpfreq1.data(),freq1, freq2, pars.spread.bandwidth);
+		break;
+	case SPT_Filter:
+		if (get_filter_gains() != nullptr)
+			SpectralKernels::multiplyBins(freq1, get_filter_gains(), freq2, nfreq);
+		else
+			spectrum_do_filter(pars,nfreq,samplerate,freq1, freq2);
+		break;
+	case SPT_Compressor:
+		spectrum_do_compressor(pars,nfreq, freq1, freq2);
+		break;
+	case SPT_FreeFilter:
+		spectrum_do_free_filter(get_free_filter_gains(), nfreq, freq1, freq2);
+		break;
+	default:
+		if (freq1 != freq2)
+			spectrum_copy(nfreq, freq1, freq2);
+		break;
+	}
+}
+
+const SpreadWarpTable& ProcessedStretch::get_spread_warp()
+{
+	const SpectralPlan* plan = get_plan();
+	if (plan != nullptr && plan->spreadwarp != nullptr)
+		return *plan->spreadwarp;
+	if (m_spreadwarp == nullptr || m_spreadwarp->nfreq != nfreq || m_spreadwarp->samplerate != samplerate)
+		m_spreadwarp = m_spread_warp_cache->getTable(nfreq, samplerate);
+	return *m_spreadwarp;
+}
+
+const PitchShiftTable& ProcessedStretch::get_pitch_shift_table(std::shared_ptr<const PitchShiftTable>& table,
+	const std::shared_ptr<const PitchShiftTable>& planned, REALTYPE ratio)
+{
+	if (table == nullptr || table->nfreq != nfreq || table->ratio != ratio)
+	{
+		if (planned != nullptr && planned->nfreq == nfreq && planned->ratio == ratio)
+			table = planned;
+		else
+			table = PitchShiftTable::make(nfreq, ratio);
+	}
+	return *table;
+}
+
+const REALTYPE* ProcessedStretch::get_filter_gains() const
+{
+	const SpectralPlan* plan = get_plan();
+	return plan != nullptr && plan->filtergains != nullptr ? plan->filtergains->data() : nullptr;
+}
+
+const REALTYPE* ProcessedStretch::get_harmonics_mask()
+{
+	const SpectralPlan* plan = get_plan();
+	if (plan != nullptr && plan->harmonicsmask != nullptr)
+		return plan->harmonicsmask->data();
+	auto& cached = m_harmonics_mask_pars;
+	if (cached.valid && cached.freq == pars.harmonics.freq && cached.bandwidth == pars.harmonics.bandwidth
+		&& cached.nharmonics == pars.harmonics.nharmonics && cached.gauss == pars.harmonics.gauss
+		&& cached.samplerate == samplerate)
+		return m_harmonics_mask.data();
+	spectrum_harmonics_mask(pars, nfreq, samplerate, m_harmonics_mask.data());
+	cached.valid = true;
+	cached.freq = pars.harmonics.freq;
+	cached.bandwidth = pars.harmonics.bandwidth;
+	cached.nharmonics = pars.harmonics.nharmonics;
+	cached.gauss = pars.harmonics.gauss;
+	cached.samplerate = samplerate;
+	return m_harmonics_mask.data();
+}
+
+void ProcessedStretch::process_frozen_spectrum(REALTYPE *freq)
+{
+	const bool freefilterenabled = std::any_of(m_spectrum_processes.begin(), m_spectrum_processes.end(),
+		[](const SpectrumProcess& e) { return e.m_index == SPT_FreeFilter && *e.m_enabled == true; });
+	if (freefilterenabled)
+		get_free_filter_gains();
+	//the kept stages are reused up to the first one that changed
+	int numkept = 0;
+	if (spectrum_input_unchanged && samplerate == m_frozen_samplerate)
+	{
+		for (auto& e : m_spectrum_processes)
+		{
+			if (*e.m_enabled == false)
+				continue;
+			if (numkept == m_num_frozen_stages || m_frozen_stage_types[numkept] != e.m_index)
+				break;
+			if (isFrozenStageUnchanged(e.m_index) == false)
+				break;
+			++numkept;
+		}
+	}
+	std::array<SpectrumProcessType, SPT_Compressor + 1> types;
+	int numstages = 0;
+	for (auto& e : m_spectrum_processes)
+		if (*e.m_enabled == true && numstages < (int)types.size())
+			types[numstages++] = e.m_index;
+	if (numkept == numstages && numkept == m_num_frozen_stages)
+	{
+		if (numstages > 0)
+			spectrum_copy(nfreq, m_frozen_output.data(), freq);
+		return;
+	}
+	//the stages from the checkpoint are run again when the ones before it haven't changed
+	if (m_frozen_checkpoint_stages > numkept)
+		m_frozen_checkpoint_stages = 0;
+	const int first = m_frozen_checkpoint_stages;
+	REALTYPE* cur = first > 0 ? m_frozen_checkpoint.data() : freq;
+	for (int i = first; i < numstages; ++i)
+	{
+		//the input of the first changed stage becomes the checkpoint, the stages don't change their input
+		REALTYPE* dest = cur == freq ? m_infreq.data() : freq;
+		if (i == numstages - 1)
+			dest = m_frozen_output.data();
+		else if (i == numkept - 1)
+			dest = m_frozen_checkpoint.data();
+		process_stage(types[i], cur, dest);
+		cur = dest;
+	}
+	if (numkept > first && numkept < numstages)
+		m_frozen_checkpoint_stages = numkept;
+	std::copy(types.begin(), types.begin() + numstages, m_frozen_stage_types.begin());
+	m_num_frozen_stages = numstages;
+	if (numstages > 0)
+		spectrum_copy(nfreq, m_frozen_output.data(), freq);
+	if (numkept < numstages)
+	{
+		m_frozen_pars = pars;
+		m_frozen_free_filter_gains = m_free_filter_gains;
+		m_frozen_samplerate = samplerate;
+	}
+}
+
+//whether the parameters the stage uses are the same, the free filter curve isn't compared
+static bool isSameStageParameters(SpectrumProcessType type, const ProcessParameters& a, const ProcessParameters& b)
+{
+	if (type == SPT_Harmonics)
+		return a.harmonics.freq == b.harmonics.freq && a.harmonics.bandwidth == b.harmonics.bandwidth
+			&& a.harmonics.nharmonics == b.harmonics.nharmonics && a.harmonics.gauss == b.harmonics.gauss;
+	if (type == SPT_TonalVsNoise)
+		return a.tonal_vs_noise.preserve == b.tonal_vs_noise.preserve && a.tonal_vs_noise.bandwidth == b.tonal_vs_noise.bandwidth;
+	if (type == SPT_FreqShift)
+		return a.freq_shift.Hz == b.freq_shift.Hz;
+	if (type == SPT_PitchShift)
+		return a.pitch_shift.cents == b.pitch_shift.cents;
+	if (type == SPT_RatioMix)
+		return a.ratiomix.ratios == b.ratiomix.ratios && a.ratiomix.ratiolevels == b.ratiomix.ratiolevels
+			&& a.ratiomix.interpolate == b.ratiomix.interpolate;
+	if (type == SPT_Spread)
+		return a.spread.bandwidth == b.spread.bandwidth;
+	if (type == SPT_Filter)
+		return a.filter.low == b.filter.low && a.filter.high == b.filter.high
+			&& a.filter.hdamp == b.filter.hdamp && a.filter.stop == b.filter.stop;
+	if (type == SPT_Compressor)
+		return a.compressor.power == b.compressor.power;
+	return true;
+}
+
+bool ProcessedStretch::isFrozenStageUnchanged(SpectrumProcessType type)
+{
+	if (type == SPT_FreeFilter)
+		return m_free_filter_gains == m_frozen_free_filter_gains; // a new version of the envelope makes a new curve
+	return isSameStageParameters(type, pars, m_frozen_pars);
+}
+
+const REALTYPE* ProcessedStretch::get_free_filter_gains()
+{
+	const SpectralPlan* plan = get_plan();
+	if (plan != nullptr && plan->freefiltergains != nullptr)
+		m_free_filter_gains = plan->freefiltergains;
+	else
+	{
+		jassert(m_free_filter_envelope != nullptr);
+		m_free_filter_gains = m_free_filter_gain_cache->getGains(m_free_filter_envelope, nfreq, samplerate);
+	}
+	return m_free_filter_gains->data();
+}
+
+int SpectralPlan::getEnabledStages(const std::vector<SpectrumProcess>& processes)
+{
+	int stages = 0;
+	for (auto& e : processes)
+		if (*e.m_enabled == true)
+			stages |= 1 << e.m_index;
+	return stages;
+}
+
+std::shared_ptr<const SpectralPlan> SpectralPlan::build(const ProcessParameters& pars, int nfreq, REALTYPE samplerate,
+	int enabledstages, std::shared_ptr<const FreeFilterGainCache::GainCurve> freefiltergains,
+	const SpectralPlan* previous)
+{
+	auto plan = std::make_shared<SpectralPlan>();
+	plan->pars = pars;
+	plan->nfreq = nfreq;
+	plan->samplerate = samplerate;
+	plan->enabledstages = enabledstages;
+	plan->freefiltergains = std::move(freefiltergains);
+	auto isenabled = [enabledstages](SpectrumProcessType type) { return (enabledstages & (1 << type)) != 0; };
+	auto isreused = [&](SpectrumProcessType type, const Gains& gains)
+	{
+		return previous != nullptr && gains != nullptr && previous->nfreq == nfreq && previous->samplerate == samplerate
+			&& isSameStageParameters(type, pars, previous->pars);
+	};
+	if (isenabled(SPT_Harmonics))
+	{
+		if (isreused(SPT_Harmonics, previous != nullptr ? previous->harmonicsmask : nullptr))
+			plan->harmonicsmask = previous->harmonicsmask;
+		else
+		{
+			auto mask = std::make_shared<std::vector<REALTYPE>>(nfreq);
+			spectrum_harmonics_mask(pars, nfreq, samplerate, mask->data());
+			plan->harmonicsmask = mask;
+		}
+	}
+	if (isenabled(SPT_Filter))
+	{
+		if (isreused(SPT_Filter, previous != nullptr ? previous->filtergains : nullptr))
+			plan->filtergains = previous->filtergains;
+		else
+		{
+			auto gains = std::make_shared<std::vector<REALTYPE>>(nfreq, 1.0f);
+			spectrum_do_filter(pars, nfreq, samplerate, gains->data(), gains->data());
+			plan->filtergains = gains;
+		}
+	}
+	if (isenabled(SPT_Spread) || isenabled(SPT_TonalVsNoise))
+		plan->spreadwarp = SharedResourcePointer<SpreadWarpTableCache>()->getTable(nfreq, samplerate);
+	//the pitch shift tables of the ratios the previous plan had are taken from it
+	auto getpitchshift = [&](REALTYPE ratio)
+	{
+		if (previous != nullptr)
+		{
+			if (previous->pitchshift != nullptr && previous->pitchshift->nfreq == nfreq && previous->pitchshift->ratio == ratio)
+				return previous->pitchshift;
+			for (auto& e : previous->ratiomix)
+				if (e != nullptr && e->nfreq == nfreq && e->ratio == ratio)
+					return e;
+		}
+		for (auto& e : plan->ratiomix)
+			if (e != nullptr && e->ratio == ratio)
+				return e;
+		return PitchShiftTable::make(nfreq, ratio);
+	};
+	if (isenabled(SPT_PitchShift))
+		plan->pitchshift = getpitchshift(pow(2.0f, pars.pitch_shift.cents / 1200.0f));
+	if (isenabled(SPT_RatioMix))
+	{
+		for (int i = 0; i < (int)plan->ratiomix.size(); ++i)
+			if (pars.ratiomix.ratiolevels[i] > 1e-3 && pars.ratiomix.ratios[i] > 0.0)
+				plan->ratiomix[i] = getpitchshift((REALTYPE)pars.ratiomix.ratios[i]);
+	}
+	return plan;
+}
+
+std::shared_ptr<const FreeFilterGainCache::GainCurve> FreeFilterGainCache::getGains(const shared_envelope& env, int nfreq, double samplerate)
+{
+	ScopedLock locker(m_cs);
+	for (auto it = m_entries.begin(); it != m_entries.end();)
+	{
+		if (it->second.envelope.expired() || it->second.gains.expired())
+			it = m_entries.erase(it);
+		else
+			++it;
+	}
+	Entry& entry = m_entries[std::make_tuple(env.get(), nfreq, samplerate)];
+	const int64 version = env->getVersion();
+	auto gains = entry.gains.lock();
+	if (gains == nullptr || entry.version != version || entry.envelope.lock() != env)
+	{
+		auto curve = std::make_shared<GainCurve>(nfreq);
+		spectrum_free_filter_gains(*env, nfreq, samplerate, curve->data());
+		gains = curve;
+		entry.envelope = env;
+		entry.version = version;
+		entry.gains = gains;
+	}
+	return gains;
+}
+
+std::shared_ptr<const SpreadWarpTable> SpreadWarpTableCache::getTable(int nfreq, double samplerate)
+{
+	ScopedLock locker(m_cs);
+	for (auto it = m_tables.begin(); it != m_tables.end();)
+	{
+		if (it->second.expired())
+			it = m_tables.erase(it);
+		else
+			++it;
+	}
+	auto key = std::make_tuple(nfreq, samplerate);
+	if (auto existing = m_tables[key].lock())
+		return existing;
+	auto table = std::make_shared<SpreadWarpTable>();
+	table->nfreq = nfreq;
+	table->samplerate = samplerate;
+	for (auto map : { &table->tolog, &table->fromlog })
+	{
+		map->index0.assign(nfreq, 0);
+		map->index1.assign(nfreq, 0);
+		map->weight0.assign(nfreq, 0.0f);
+		map->weight1.assign(nfreq, 0.0f);
+	}
+	//the same arithmetic spectrum_spread did for each frame
+	REALTYPE minfreq = 20.0f;
+	REALTYPE maxfreq = 0.5f*samplerate;
+	REALTYPE log_minfreq = log(minfreq);
+	REALTYPE log_maxfreq = log(maxfreq);
+	for (int i = 0; i<nfreq; i++) {
+		REALTYPE freqx = i / (REALTYPE)nfreq;
+		REALTYPE x = exp(log_minfreq + freqx * (log_maxfreq - log_minfreq)) / maxfreq * nfreq;
+		int x0 = (int)floor(x); if (x0 >= nfreq) x0 = nfreq - 1;
+		int x1 = x0 + 1; if (x1 >= nfreq) x1 = nfreq - 1;
+		REALTYPE xp = x - x0;
+		if (x<nfreq) {
+			table->tolog.index0[i] = x0;
+			table->tolog.index1[i] = x1;
+			table->tolog.weight0[i] = 1.0f - xp;
+			table->tolog.weight1[i] = xp;
+		};
+	};
+	REALTYPE log_maxfreq_d_minfreq = log(maxfreq / minfreq);
+	for (int i = 1; i<nfreq; i++) {
+		REALTYPE freqx = i / (REALTYPE)nfreq;
+		REALTYPE x = log((freqx*maxfreq) / minfreq) / log_maxfreq_d_minfreq * nfreq;
+		if ((x>0.0) && (x<nfreq)) {
+			int x0 = (int)floor(x); if (x0 >= nfreq) x0 = nfreq - 1;
+			int x1 = x0 + 1; if (x1 >= nfreq) x1 = nfreq - 1;
+			REALTYPE xp = x - x0;
+			table->fromlog.index0[i] = x0;
+			table->fromlog.index1[i] = x1;
+			table->fromlog.weight0[i] = 1.0f - xp;
+			table->fromlog.weight1[i] = xp;
+		};
+	};
+	m_tables[key] = table;
+	return table;
+}
+
+std::shared_ptr<const PitchShiftTable> PitchShiftTable::make(int nfreq, REALTYPE ratio)
+{
+	auto table = std::make_shared<PitchShiftTable>();
+	table->nfreq = nfreq;
+	table->ratio = ratio;
+	table->down = ratio < 1.0;
+	table->frac.resize(nfreq);
+	//the same float arithmetic spectrum_do_pitch_shift does, so the bins are the same
+	if (table->down)
+	{
+		//the input bins of an output bin are next to each other, as the position grows with i
+		table->index.resize(nfreq + 1);
+		int j = 0;
+		for (int i = 0; i < nfreq; i++) {
+			REALTYPE x = i * ratio;
+			int i2 = (int)x;
+			table->frac[i] = x - i2;
+			while (j <= i2 && j < nfreq)
+				table->index[j++] = i;
+		};
+		while (j <= nfreq)
+			table->index[j++] = nfreq;
+	}
+	else
+	{
+		table->index.resize(nfreq);
+		REALTYPE rap = 1.0f / ratio;
+		for (int i = 0; i < nfreq; i++) {
+			REALTYPE x = i * rap;
+			table->index[i] = (int)x;
+			table->frac[i] = x - table->index[i];
+		};
+	}
+	return table;
+}
+
+
 //void ProcessedStretch::process_output(REALTYPE *smps,int nsmps){
 //};
 
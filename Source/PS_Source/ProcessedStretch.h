@@ -20,6 +20,7 @@
 #pragma once
 
 #include "Stretch.h"
+#include "SpectralKernels.h"
 #include <array>
 #include "../jcdp_envelope.h"
 
@@ -30,6 +31,7 @@ struct ProcessParameters
 		pitch_shift.cents=0;
 
 		ratiomix.ratios = { 0.25,0.5,1.0,2.0,3.0,4.0,1.5,1.0/1.5 };
+		ratiomix.interpolate = false;
 
 		octave.om2=octave.om1=octave.o1=octave.o15=octave.o2=0.0f;
 		octave.o0=1.0f;
@@ -71,6 +73,7 @@ struct ProcessParameters
 	{
 		std::array<double, 8> ratios;
 		std::array<double, 8> ratiolevels;
+		bool interpolate; // between the two nearest bins instead of taking the bin the position is in
 	} ratiomix;
 
 	struct{
@@ -165,10 +168,52 @@ struct ProcessParameters
 			filter.low == other.filter.low &&
 			filter.stop == other.filter.stop &&
 			ratiomix.ratiolevels == other.ratiomix.ratiolevels &&
-			ratiomix.ratios == other.ratiomix.ratios;
+			ratiomix.ratios == other.ratiomix.ratios &&
+			ratiomix.interpolate == other.ratiomix.interpolate;
 	}
 };
 
+// The maps of spectrum_spread from the linear spectrum to the log frequency one and back.
+// Each output bin i is in[index0[i]]*weight0[i]+in[index1[i]]*weight1[i], the bins that
+// fall outside of the input have 0 weights.
+struct SpreadWarpTable
+{
+	struct Map
+	{
+		std::vector<int> index0, index1;
+		std::vector<REALTYPE> weight0, weight1;
+	};
+	int nfreq = 0;
+	double samplerate = 0.0;
+	Map tolog, fromlog;
+};
+
+// The warp tables per number of bins and sample rate, shared by the stretchers of all the
+// channels and released when none of them uses them
+class SpreadWarpTableCache
+{
+public:
+	std::shared_ptr<const SpreadWarpTable> getTable(int nfreq, double samplerate);
+private:
+	CriticalSection m_cs;
+	std::map<std::tuple<int, double>, std::weak_ptr<const SpreadWarpTable>> m_tables;
+};
+
+// The bins spectrum_do_pitch_shift moves for a ratio. Going up, output bin i is the input bin
+// index[i]. Going down, it's the sum of the input bins from index[i] up to index[i+1], the
+// table has nfreq+1 indices then. frac has the fractional parts of the positions the indices
+// were cut from, of the output bins going up and of the input bins going down.
+// The ratios are continuous, so these aren't cached, the spectral plan keeps the ones it uses.
+struct PitchShiftTable
+{
+	int nfreq = 0;
+	REALTYPE ratio = 0.0f;
+	bool down = false;
+	std::vector<int> index;
+	std::vector<REALTYPE> frac;
+	static std::shared_ptr<const PitchShiftTable> make(int nfreq, REALTYPE ratio);
+};
+
 inline REALTYPE profile(REALTYPE fi, REALTYPE bwi) {
 	REALTYPE x = fi / bwi;
 	x *= x;
@@ -179,35 +224,29 @@ inline REALTYPE profile(REALTYPE fi, REALTYPE bwi) {
 
 inline void spectrum_copy(int nfreq, REALTYPE* freq1, REALTYPE* freq2)
 {
-    //for (int i = 0; i<nfreq; i++) freq2[i] = freq1[i];
-    FloatVectorOperations::copy(freq2, freq1, nfreq);
+    SpectralKernels::copy(freq1, freq2, nfreq);
 
 };
 
 
-inline void spectrum_spread(int nfreq, double samplerate, 
-	std::vector<REALTYPE>& tmpfreq1,
+inline void spectrum_warp(int nfreq, const SpreadWarpTable::Map& map, const REALTYPE *freq1, REALTYPE *freq2)
+{
+	const int* index0 = map.index0.data();
+	const int* index1 = map.index1.data();
+	const REALTYPE* weight0 = map.weight0.data();
+	const REALTYPE* weight1 = map.weight1.data();
+	for (int i = 0; i<nfreq; i++)
+		freq2[i] = freq1[index0[i]] * weight0[i] + freq1[index1[i]] * weight1[i];
+};
+
+//the warp table is the one of SpreadWarpTableCache for nfreq and the sample rate
+inline void spectrum_spread(int nfreq, const SpreadWarpTable& warp,
+	REALTYPE* tmpfreq1,
 	REALTYPE *freq1, REALTYPE *freq2, REALTYPE spread_bandwidth) 
 {
+	jassert(warp.nfreq == nfreq);
 	//convert to log spectrum
-	REALTYPE minfreq = 20.0f;
-	REALTYPE maxfreq = 0.5f*samplerate;
-
-	REALTYPE log_minfreq = log(minfreq);
-	REALTYPE log_maxfreq = log(maxfreq);
-
-	for (int i = 0; i<nfreq; i++) {
-		REALTYPE freqx = i / (REALTYPE)nfreq;
-		REALTYPE x = exp(log_minfreq + freqx * (log_maxfreq - log_minfreq)) / maxfreq * nfreq;
-		REALTYPE y = 0.0f;
-		int x0 = (int)floor(x); if (x0 >= nfreq) x0 = nfreq - 1;
-		int x1 = x0 + 1; if (x1 >= nfreq) x1 = nfreq - 1;
-		REALTYPE xp = x - x0;
-		if (x<nfreq) {
-			y = freq1[x0] * (1.0f - xp) + freq1[x1] * xp;
-		};
-		tmpfreq1[i] = y;
-	};
+	spectrum_warp(nfreq, warp.tolog, freq1, tmpfreq1);
 
 	//increase the bandwidth of each harmonic (by smoothing the log spectrum)
 	int n = 2;
@@ -226,80 +265,54 @@ inline void spectrum_spread(int nfreq, double samplerate,
 		};
 	};
 
-	freq2[0] = 0;
-	REALTYPE log_maxfreq_d_minfreq = log(maxfreq / minfreq);
-	for (int i = 1; i<nfreq; i++) {
-		REALTYPE freqx = i / (REALTYPE)nfreq;
-		REALTYPE x = log((freqx*maxfreq) / minfreq) / log_maxfreq_d_minfreq * nfreq;
-		REALTYPE y = 0.0;
-		if ((x>0.0) && (x<nfreq)) {
-			int x0 = (int)floor(x); if (x0 >= nfreq) x0 = nfreq - 1;
-			int x1 = x0 + 1; if (x1 >= nfreq) x1 = nfreq - 1;
-			REALTYPE xp = x - x0;
-			y = tmpfreq1[x0] * (1.0f - xp) + tmpfreq1[x1] * xp;
-		};
-		freq2[i] = y;
-	};
+	spectrum_warp(nfreq, warp.fromlog, tmpfreq1, freq2);
+};
 
 
+//the gain of the compressor for the sum of the squares of the spectrum
+inline REALTYPE spectrum_compressor_gain(const ProcessParameters& pars, int nfreq, REALTYPE sumsquares) {
+	REALTYPE rms = sqrt(sumsquares / nfreq)*0.1f;
+	if (rms<1e-3f) rms = 1e-3f;
+	return pow(rms, -pars.compressor.power);
 };
 
-
 inline void spectrum_do_compressor(const ProcessParameters& pars, int nfreq, REALTYPE *freq1, REALTYPE *freq2) {
-	REALTYPE rms = 0.0;
-	for (int i = 0; i<nfreq; i++) rms += freq1[i] * freq1[i];
-	rms = sqrt(rms / nfreq)*0.1f;
-	if (rms<1e-3f) rms = 1e-3f;
+	REALTYPE rms = SpectralKernels::sumOfSquares(freq1, nfreq);
 
-	REALTYPE _rap = pow(rms, -pars.compressor.power);
-	for (int i = 0; i<nfreq; i++) freq2[i] = freq1[i] * _rap;
+	REALTYPE _rap = spectrum_compressor_gain(pars, nfreq, rms);
+	SpectralKernels::multiplyTo(freq1, _rap, freq2, nfreq);
 };
 
-inline void spectrum_do_tonal_vs_noise(const ProcessParameters& pars, int nfreq, double samplerate,
-	std::vector<REALTYPE>& tmpfreq1,
+inline void spectrum_do_tonal_vs_noise(const ProcessParameters& pars, int nfreq, const SpreadWarpTable& warp,
+	REALTYPE* tmpfreq1,
 	REALTYPE *freq1, REALTYPE *freq2) {
-	spectrum_spread(nfreq, samplerate, tmpfreq1, freq1, tmpfreq1.data(), pars.tonal_vs_noise.bandwidth);
+	spectrum_spread(nfreq, warp, tmpfreq1, freq1, tmpfreq1, pars.tonal_vs_noise.bandwidth);
 
 	if (pars.tonal_vs_noise.preserve >= 0.0) {
 		REALTYPE mul = (pow(10.0f, pars.tonal_vs_noise.preserve) - 1.0f);
-		for (int i = 0; i<nfreq; i++) {
-			REALTYPE x = freq1[i];
-			REALTYPE smooth_x = tmpfreq1[i] + 1e-6f;
-
-			REALTYPE result = 0.0f;
-			result = x - smooth_x * mul;
-			if (result<0.0f) result = 0.0f;
-			freq2[i] = result;
-		};
+		SpectralKernels::preserveTonal(freq1, tmpfreq1, mul, freq2, nfreq);
 	}
 	else {
 		REALTYPE mul = (pow(5.0f, 1.0f + pars.tonal_vs_noise.preserve) - 1.0f);
-		for (int i = 0; i<nfreq; i++) {
-			REALTYPE x = freq1[i];
-			REALTYPE smooth_x = tmpfreq1[i] + 1e-6f;
-
-			REALTYPE result = 0.0f;
-			result = x - smooth_x * mul + 0.1f*mul;
-			if (result<0.0f) result = x;
-			else result = 0.0f;
-
-			freq2[i] = result;
-		};
+		SpectralKernels::preserveNoise(freq1, tmpfreq1, mul, freq2, nfreq);
 	};
 
 };
 
-inline void spectrum_do_harmonics(const ProcessParameters& pars, std::vector<REALTYPE>& tmpfreq1, 
-	int nfreq, double samplerate, REALTYPE *freq1, REALTYPE *freq2) {
+//the gains of the harmonics process for the bins from 1, mask[0] isn't used
+inline void spectrum_harmonics_mask(const ProcessParameters& pars, int nfreq, double samplerate, REALTYPE *mask) {
 	REALTYPE freq = pars.harmonics.freq;
 	REALTYPE bandwidth = pars.harmonics.bandwidth;
 	int nharmonics = pars.harmonics.nharmonics;
 
 	if (freq<10.0) freq = 10.0;
 
-	REALTYPE *amp = tmpfreq1.data();
-	for (int i = 0; i<nfreq; i++) amp[i] = 0.0;
+	REALTYPE *amp = mask;
+	SpectralKernels::zero(amp, nfreq);
 
+	//the profile is 0 from sqrt(14.71280603) bandwidths away from the harmonic, so only the bins
+	//closer than that (and one more on each side for the rounding) are evaluated
+	const REALTYPE support = sqrt(14.71280603f);
 	for (int nh = 1; nh <= nharmonics; nh++) {//for each harmonic
 		REALTYPE bw_Hz;//bandwidth of the current harmonic measured in Hz
 		REALTYPE bwi;
@@ -312,14 +325,10 @@ inline void spectrum_do_harmonics(const ProcessParameters& pars, std::vector<REA
 		bwi = bw_Hz / (2.0f*samplerate);
 		fi = f / samplerate;
 
-		REALTYPE sum = 0.0f;
-		REALTYPE max = 0.0f;
-		for (int i = 1; i<nfreq; i++) {//todo: optimize here
-			REALTYPE hprofile;
-			hprofile = profile((i / (REALTYPE)nfreq*0.5f) - fi, bwi);
-			amp[i] += hprofile;
-			if (max<hprofile) max = hprofile;
-			sum += hprofile;
+		int ilow = jmax(1, (int)floor((fi - bwi * support)*2.0f*nfreq) - 1);
+		int ihigh = jmin(nfreq - 1, (int)ceil((fi + bwi * support)*2.0f*nfreq) + 1);
+		for (int i = ilow; i <= ihigh; i++) {
+			amp[i] += profile((i / (REALTYPE)nfreq*0.5f) - fi, bwi);
 		};
 	};
 
@@ -330,20 +339,25 @@ inline void spectrum_do_harmonics(const ProcessParameters& pars, std::vector<REA
 	if (max<1e-8f) max = 1e-8f;
 
 	for (int i = 1; i<nfreq; i++) {
-		//REALTYPE c,s;
 		REALTYPE a = amp[i] / max;
 		if (!pars.harmonics.gauss) a = (a<0.368f ? 0.0f : 1.0f);
-		freq2[i] = freq1[i] * a;
+		mask[i] = a;
 	};
+};
 
+inline void spectrum_do_harmonics(const ProcessParameters& pars, REALTYPE* tmpfreq1, 
+	int nfreq, double samplerate, REALTYPE *freq1, REALTYPE *freq2) {
+	spectrum_harmonics_mask(pars, nfreq, samplerate, tmpfreq1);
+	freq2[0] = freq1[0];
+	SpectralKernels::multiplyBins(freq1 + 1, tmpfreq1 + 1, freq2 + 1, nfreq - 1);
 };
 
 inline void spectrum_add(int nfreq, REALTYPE *freq2, REALTYPE *freq1, REALTYPE a) {
-	for (int i = 0; i<nfreq; i++) freq2[i] += freq1[i] * a;
+	SpectralKernels::add(freq2, freq1, a, nfreq);
 };
 
 inline void spectrum_zero(int nfreq,REALTYPE *freq1) {
-	for (int i = 0; i<nfreq; i++) freq1[i] = 0.0;
+	SpectralKernels::zero(freq1, nfreq);
 };
 
 inline void spectrum_do_freq_shift(const ProcessParameters& pars, int nfreq, double samplerate, 
@@ -375,32 +389,32 @@ inline void spectrum_do_pitch_shift(const ProcessParameters& pars, int nfreq, RE
 };
 
 inline void spectrum_do_octave(const ProcessParameters& pars, int nfreq, double /*samplerate*/, 
-	std::vector<REALTYPE>& sumfreq, 
-	std::vector<REALTYPE>& tmpfreq1,
+	REALTYPE* sumfreq, 
+	REALTYPE* tmpfreq1,
 	REALTYPE *freq1, REALTYPE *freq2) {
-	spectrum_zero(nfreq,sumfreq.data());
+	spectrum_zero(nfreq,sumfreq);
 	if (pars.octave.om2>1e-3) {
-		spectrum_do_pitch_shift(pars,nfreq, freq1, tmpfreq1.data(), 0.25);
-		spectrum_add(nfreq, sumfreq.data(), tmpfreq1.data(), pars.octave.om2);
+		spectrum_do_pitch_shift(pars,nfreq, freq1, tmpfreq1, 0.25);
+		spectrum_add(nfreq, sumfreq, tmpfreq1, pars.octave.om2);
 	};
 	if (pars.octave.om1>1e-3) {
-		spectrum_do_pitch_shift(pars,nfreq, freq1, tmpfreq1.data(), 0.5);
-		spectrum_add(nfreq,sumfreq.data(), tmpfreq1.data(), pars.octave.om1);
+		spectrum_do_pitch_shift(pars,nfreq, freq1, tmpfreq1, 0.5);
+		spectrum_add(nfreq,sumfreq, tmpfreq1, pars.octave.om1);
 	};
 	if (pars.octave.o0>1e-3) {
-		spectrum_add(nfreq,sumfreq.data(), freq1, pars.octave.o0);
+		spectrum_add(nfreq,sumfreq, freq1, pars.octave.o0);
 	};
 	if (pars.octave.o1>1e-3) {
-		spectrum_do_pitch_shift(pars,nfreq, freq1, tmpfreq1.data(), 2.0);
-		spectrum_add(nfreq,sumfreq.data(), tmpfreq1.data(), pars.octave.o1);
+		spectrum_do_pitch_shift(pars,nfreq, freq1, tmpfreq1, 2.0);
+		spectrum_add(nfreq,sumfreq, tmpfreq1, pars.octave.o1);
 	};
 	if (pars.octave.o15>1e-3) {
-		spectrum_do_pitch_shift(pars,nfreq, freq1, tmpfreq1.data(), 3.0);
-		spectrum_add(nfreq,sumfreq.data(), tmpfreq1.data(), pars.octave.o15);
+		spectrum_do_pitch_shift(pars,nfreq, freq1, tmpfreq1, 3.0);
+		spectrum_add(nfreq,sumfreq, tmpfreq1, pars.octave.o15);
 	};
 	if (pars.octave.o2>1e-3) {
-		spectrum_do_pitch_shift(pars, nfreq, freq1, tmpfreq1.data(), 4.0);
-		spectrum_add(nfreq,sumfreq.data(), tmpfreq1.data(), pars.octave.o2);
+		spectrum_do_pitch_shift(pars, nfreq, freq1, tmpfreq1, 4.0);
+		spectrum_add(nfreq,sumfreq, tmpfreq1, pars.octave.o2);
 	};
 
 	REALTYPE sum = 0.01f + pars.octave.om2 + pars.octave.om1 + pars.octave.o0 + pars.octave.o1 + pars.octave.o15 + pars.octave.o2;
@@ -408,28 +422,95 @@ inline void spectrum_do_octave(const ProcessParameters& pars, int nfreq, double
 	for (int i = 0; i<nfreq; i++) freq2[i] = sumfreq[i] / sum;
 };
 
-inline void spectrum_do_ratiomix(const ProcessParameters& pars, int nfreq, double /*samplerate*/,
-	std::vector<REALTYPE>& sumfreq,
-	std::vector<REALTYPE>& tmpfreq1,
-	REALTYPE *freq1, REALTYPE *freq2) 
+//the same output as spectrum_do_pitch_shift for the ratio of the table
+inline void spectrum_do_pitch_shift(const PitchShiftTable& table, const REALTYPE *freq1, REALTYPE *freq2) {
+	const int* index = table.index.data();
+	if (table.down == false) {
+		for (int i = 0; i < table.nfreq; i++) freq2[i] = freq1[index[i]];
+		return;
+	};
+	for (int i = 0; i < table.nfreq; i++) {
+		REALTYPE sum = 0.0f;
+		for (int k = index[i]; k < index[i + 1]; k++) sum += freq1[k];
+		freq2[i] = sum;
+	};
+};
+
+//adds the bins from begin to end of the pitch shift of the table, multiplied by a, to sum
+inline void spectrum_add_pitch_shift(const PitchShiftTable& table, const REALTYPE *freq1,
+	int begin, int end, REALTYPE a, bool interpolate, REALTYPE *sum) {
+	const int* index = table.index.data();
+	const REALTYPE* frac = table.frac.data();
+	const int last = table.nfreq - 1;
+	if (table.down == false) {
+		if (table.ratio == 1.0f) {
+			for (int i = begin; i < end; i++) sum[i - begin] += freq1[i] * a;
+			return;
+		};
+		if (interpolate == false) {
+			for (int i = begin; i < end; i++) sum[i - begin] += freq1[index[i]] * a;
+			return;
+		};
+		for (int i = begin; i < end; i++) {
+			int i1 = index[i];
+			int i2 = i1 < last ? i1 + 1 : last;
+			sum[i - begin] += (freq1[i1] * (1.0f - frac[i]) + freq1[i2] * frac[i]) * a;
+		};
+		return;
+	};
+	if (interpolate == false) {
+		int k = index[begin];
+		for (int i = begin; i < end; i++) {
+			const int kend = index[i + 1];
+			REALTYPE x = 0.0f;
+			for (; k < kend; k++) x += freq1[k];
+			sum[i - begin] += x * a;
+		};
+		return;
+	};
+	for (int i = begin; i < end; i++) {
+		REALTYPE x = 0.0f;
+		{
+			//each input bin is split between the bin its position is in and the next one
+			if (i > 0)
+				for (int k = index[i - 1]; k < index[i]; k++) x += freq1[k] * frac[k];
+			for (int k = index[i]; k < index[i + 1]; k++) x += freq1[k] * (1.0f - frac[k]);
+		};
+		sum[i - begin] += x * a;
+	};
+};
+
+//tables has the pitch shift table of each ratio that is mixed in, the others can be nullptr.
+//The output is made a block of bins at a time, with the sums of the block kept in the cache,
+//so the spectrum is written once. freq1 and freq2 can't be the same buffer.
+inline void spectrum_do_ratiomix(const ProcessParameters& pars, int nfreq,
+	const PitchShiftTable* const* tables,
+	const REALTYPE *freq1, REALTYPE *freq2)
 {
-	spectrum_zero(nfreq, sumfreq.data());
 	double ratiolevelsum = 0.01;
 	for (int i = 0; i < pars.ratiomix.ratios.size(); ++i)
+		ratiolevelsum += pars.ratiomix.ratiolevels[i];
+	if (ratiolevelsum<0.5f) 
+		ratiolevelsum = 0.5f;
+	const int blocksize = 256;
+	REALTYPE sumfreq[blocksize];
+	for (int begin = 0; begin < nfreq; begin += blocksize)
 	{
-		double ratiolevel = pars.ratiomix.ratiolevels[i];
-		double ratio = pars.ratiomix.ratios[i];
-		ratiolevelsum += ratiolevel;
-		if (ratiolevel > 1e-3 && ratio > 0.0)
+		const int end = std::min(begin + blocksize, nfreq);
+		std::fill(sumfreq, sumfreq + (end - begin), 0.0f);
+		for (int i = 0; i < pars.ratiomix.ratios.size(); ++i)
 		{
-			spectrum_do_pitch_shift(pars, nfreq, freq1, tmpfreq1.data(), ratio);
-			spectrum_add(nfreq, sumfreq.data(), tmpfreq1.data(), ratiolevel);
+			double ratiolevel = pars.ratiomix.ratiolevels[i];
+			double ratio = pars.ratiomix.ratios[i];
+			if (ratiolevel > 1e-3 && ratio > 0.0)
+			{
+				jassert(tables[i] != nullptr && tables[i]->nfreq == nfreq);
+				spectrum_add_pitch_shift(*tables[i], freq1, begin, end, (REALTYPE)ratiolevel, pars.ratiomix.interpolate, sumfreq);
+			}
 		}
+		for (int i = begin; i < end; i++)
+			freq2[i] = sumfreq[i - begin] / ratiolevelsum;
 	}
-	if (ratiolevelsum<0.5f) 
-		ratiolevelsum = 0.5f;
-	for (int i = 0; i<nfreq; i++) 
-		freq2[i] = sumfreq[i] / ratiolevelsum;
 };
 
 inline void spectrum_do_filter(const ProcessParameters& pars, int nfreq, double samplerate, REALTYPE *freq1, REALTYPE *freq2) {
@@ -444,35 +525,51 @@ inline void spectrum_do_filter(const ProcessParameters& pars, int nfreq, double
 	};
 	int ilow = (int)(low / samplerate * nfreq*2.0f);
 	int ihigh = (int)(high / samplerate * nfreq*2.0f);
-	REALTYPE dmp = 1.0;
 	REALTYPE dmprap = 1.0f - pow(pars.filter.hdamp*0.5f, 4.0f);
-	for (int i = 0; i<nfreq; i++) {
-		REALTYPE a = 0.0f;
-		if ((i >= ilow) && (i<ihigh)) a = 1.0f;
-		if (pars.filter.stop) a = 1.0f - a;
-		freq2[i] = freq1[i] * a*dmp;
-		dmp *= dmprap + 1e-8f;
-	};
+	SpectralKernels::filter(freq1, freq2, nfreq, ilow, ihigh, pars.filter.stop, dmprap + 1e-8f);
 };
 
-inline void spectrum_do_free_filter(shared_envelope& env, int nfreq, double samplerate,
-	REALTYPE *freq1, REALTYPE *freq2) 
+inline void spectrum_free_filter_gains(breakpoint_envelope& env, int nfreq, double samplerate, REALTYPE *gains)
 {
-	jassert(env != nullptr);
 	for (int i = 0; i<nfreq; i++) 
 	{
 		double binhz = (samplerate / 2.0) / nfreq * i;
 		if (binhz >= 30.0)
 		{
 			double norm = 0.150542*log(0.0333333*binhz);
-			double db = jmap<double>(env->getTransformedValue(norm), 0.0, 1.0, -48.0, 12.0);
-			freq2[i] = freq1[i] * Decibels::decibelsToGain(db);
+			double db = jmap<double>(env.getTransformedValue(norm), 0.0, 1.0, -48.0, 12.0);
+			gains[i] = (REALTYPE)Decibels::decibelsToGain(db);
 		}
 		else
-			freq2[i] = freq1[i];
+			gains[i] = 1.0f;
 	};
 };
 
+//the gains are the ones of FreeFilterGainCache
+inline void spectrum_do_free_filter(const REALTYPE *gains, int nfreq, REALTYPE *freq1, REALTYPE *freq2) 
+{
+	SpectralKernels::multiplyBins(freq1, gains, freq2, nfreq);
+};
+
+// The gains of the free filter for each bin, per envelope, number of bins and sample rate, shared by
+// the stretchers of all the channels. A curve is made again when the version of its envelope changes,
+// the curves are released when no stretcher uses them.
+class FreeFilterGainCache
+{
+public:
+	using GainCurve = std::vector<REALTYPE>;
+	std::shared_ptr<const GainCurve> getGains(const shared_envelope& env, int nfreq, double samplerate);
+private:
+	struct Entry
+	{
+		std::weak_ptr<breakpoint_envelope> envelope;
+		int64 version = -1;
+		std::weak_ptr<const GainCurve> gains;
+	};
+	CriticalSection m_cs;
+	std::map<std::tuple<const breakpoint_envelope*, int, double>, Entry> m_entries;
+};
+
 enum SpectrumProcessType
 {
 	SPT_Harmonics = 0,
@@ -510,6 +607,30 @@ inline void swapSpectrumProcesses(SpectrumProcess& a, SpectrumProcess& b)
 	*b.m_enabled = benab;
 }
 
+// The tables the spectrum processes derive from the parameters, for one nfreq and sample rate.
+// StretchAudioSource builds a plan once for all its stretchers when the parameters change and
+// they take it with std::atomic_load, a plan isn't changed after it has been built. The tables
+// of the stages that weren't enabled are nullptr.
+struct SpectralPlan
+{
+	using Gains = std::shared_ptr<const std::vector<REALTYPE>>;
+	ProcessParameters pars;
+	int nfreq = 0;
+	REALTYPE samplerate = 0.0f;
+	int enabledstages = 0; // 1 << SpectrumProcessType of each enabled stage
+	Gains harmonicsmask;
+	Gains filtergains;
+	std::shared_ptr<const FreeFilterGainCache::GainCurve> freefiltergains;
+	std::shared_ptr<const SpreadWarpTable> spreadwarp;
+	std::shared_ptr<const PitchShiftTable> pitchshift;
+	std::array<std::shared_ptr<const PitchShiftTable>, 8> ratiomix;
+	// The tables of the previous plan whose parameters didn't change are shared with it
+	static std::shared_ptr<const SpectralPlan> build(const ProcessParameters& pars, int nfreq, REALTYPE samplerate,
+		int enabledstages, std::shared_ptr<const FreeFilterGainCache::GainCurve> freefiltergains,
+		const SpectralPlan* previous);
+	static int getEnabledStages(const std::vector<SpectrumProcess>& processes);
+};
+
 class ProcessedStretch final : public Stretch
 {
 public:
@@ -517,7 +638,10 @@ public:
     //stereo_mode: 0=mono,1=left,2=right
     ProcessedStretch(REALTYPE rap_,int in_bufsize_,FFTWindow w=W_HAMMING,bool bypass_=false,REALTYPE samplerate_=44100.0f,int stereo_mode=0);
     ~ProcessedStretch();
+    // drops the plan, the stretcher then derives its tables itself
     void set_parameters(ProcessParameters *ppar);
+	// Can be called from another thread, the next frame uses the parameters and tables of the plan
+	void setSpectralPlan(std::shared_ptr<const SpectralPlan> plan);
 	void setFreeFilterEnvelope(shared_envelope env);
 	std::vector<SpectrumProcess> m_spectrum_processes;
 	void setBufferSize(int sz) override;
@@ -526,7 +650,85 @@ private:
     REALTYPE get_stretch_multiplier(REALTYPE pos_percents) override;
 //		void process_output(REALTYPE *smps,int nsmps);
     void process_spectrum(REALTYPE *freq) override;
+	void addBuffers(BufferArena& arena) override;
+	void process_frozen_spectrum(REALTYPE *freq);
+	int begin_spectrum_steps() override;
+	void process_spectrum_step(REALTYPE *freq, int step) override;
+	// runs one spectrum process from freq1 into freq2
+	void process_stage(SpectrumProcessType type, REALTYPE *freq1, REALTYPE *freq2);
+
+	// The enabled stages are compiled into kernels when the order or the enabled ones change. The
+	// element-wise stages next to each other are fused into one kernel, and the kernels alternate
+	// between freq and m_infreq, so the spectrum isn't copied for each stage.
+	struct ChainKernel
+	{
+		SpectrumProcessType type = SPT_Unknown; // of the first stage
+		int firststage = 0;
+		int numstages = 1;
+		bool inplace = true; // otherwise writes to the other buffer
+	};
+	void update_chain();
+	// from freq1 into freq2, which are the same buffer for the kernels run in place
+	void run_kernel(const ChainKernel& kernel, REALTYPE *freq1, REALTYPE *freq2);
+	// the filter, free filter and compressor stages as one gain curve applied in one pass
+	void process_gain_stages(const SpectrumProcessType* types, int count, REALTYPE *freq1, REALTYPE *freq2);
+	std::array<SpectrumProcessType, 16> m_chain_stages;
+	int m_num_chain_stages = -1;
+	std::array<ChainKernel, 16> m_chain;
+	int m_num_chain_kernels = 0;
+	REALTYPE* m_chain_cur = nullptr; // the buffer with the output of the last kernel while stepping
+	// whether the stage would give the same output from the same input as when the frozen spectrum was made
+	bool isFrozenStageUnchanged(SpectrumProcessType type);
 	shared_envelope m_free_filter_envelope;
+	// the gain curve of the envelope for nfreq and the sample rate, updated from the cache
+	const REALTYPE* get_free_filter_gains();
+	SharedResourcePointer<FreeFilterGainCache> m_free_filter_gain_cache;
+	std::shared_ptr<const FreeFilterGainCache::GainCurve> m_free_filter_gains;
+
+	// While freezing the output of the enabled stages is kept, and so is the input of the last stage
+	// whose parameters changed, so that usually no stage or only the stages from the one being
+	// adjusted have to be run again
+	std::array<SpectrumProcessType, SPT_Compressor + 1> m_frozen_stage_types;
+	int m_num_frozen_stages = 0; // the stages whose output is in m_frozen_output
+	int m_frozen_checkpoint_stages = 0; // the stages whose output is in m_frozen_checkpoint
+	ArenaBuffer m_frozen_output, m_frozen_checkpoint;
+	ProcessParameters m_frozen_pars;
+	std::shared_ptr<const FreeFilterGainCache::GainCurve> m_frozen_free_filter_gains;
+	REALTYPE m_frozen_samplerate = 0.0f;
+	bool m_step_frozen = false;
+
+	std::shared_ptr<const SpectralPlan> m_plan; // set from other threads with std::atomic_store
+	std::shared_ptr<const SpectralPlan> m_frame_plan; // the one the current frame uses
+	// takes the plan that was set last at the start of a frame
+	void pick_plan();
+	// the plan of the frame if it's for nfreq and the sample rate
+	const SpectralPlan* get_plan() const;
+
+	// the gains of the harmonics process, from the plan or made again when its parameters or the
+	// sample rate change
+	const REALTYPE* get_harmonics_mask();
+	// the gains of the filter process from the plan, nullptr when the plan doesn't have them
+	const REALTYPE* get_filter_gains() const;
+	// the warp maps of the spread and tonal vs noise processes for nfreq and the sample rate
+	const SpreadWarpTable& get_spread_warp();
+	SharedResourcePointer<SpreadWarpTableCache> m_spread_warp_cache;
+	std::shared_ptr<const SpreadWarpTable> m_spreadwarp;
+	// the bin tables of the pitch shift and of each ratio of the ratio mixer, taken again from the
+	// plan or made again when the ratio or nfreq change
+	const PitchShiftTable& get_pitch_shift_table(std::shared_ptr<const PitchShiftTable>& table,
+		const std::shared_ptr<const PitchShiftTable>& planned, REALTYPE ratio);
+	std::shared_ptr<const PitchShiftTable> m_pitch_shift_table;
+	std::array<std::shared_ptr<const PitchShiftTable>, 8> m_ratiomix_tables;
+	ArenaBuffer m_harmonics_mask;
+	struct
+	{
+		bool valid = false;
+		REALTYPE freq = 0.0f;
+		REALTYPE bandwidth = 0.0f;
+		int nharmonics = 0;
+		bool gauss = false;
+		REALTYPE samplerate = 0.0f;
+	} m_harmonics_mask_pars;
 
     void copy(REALTYPE* freq1, REALTYPE* freq2);
     void add(REALTYPE *freq2,REALTYPE *freq1,REALTYPE a=1.0);
@@ -537,10 +739,10 @@ private:
     void update_free_filter();
     int nfreq=0;
 
-    std::vector<REALTYPE> m_free_filter_freqs;
+    ArenaBuffer m_free_filter_freqs;
     ProcessParameters pars;
     
-    std::vector<REALTYPE> m_infreq,m_sumfreq,m_tmpfreq1,m_tmpfreq2;
+    ArenaBuffer m_infreq,m_tmpfreq1,m_tmpfreq2; // m_tmpfreq2 has the gains of the fused stages
     
 		//REALTYPE *fbfreq;
 };
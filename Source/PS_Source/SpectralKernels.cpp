@@ -0,0 +1,356 @@
+// SPDX-License-Identifier: GPLv3-or-later WITH Appstore-exception
+
+#include "SpectralKernels.h"
+#include "../JuceLibraryCode/JuceHeader.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PS_KERNELS_SSE 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && (defined(__aarch64__) || defined(_M_ARM64))
+#define PS_KERNELS_NEON 1
+#include <arm_neon.h>
+#endif
+
+using namespace SpectralKernels;
+
+// The loops as the spectrum processes had them
+
+static void zeroReference(float* dest, int n)
+{
+	for (int i = 0; i < n; i++) dest[i] = 0.0f;
+}
+
+static void fillReference(float* dest, float value, int n)
+{
+	for (int i = 0; i < n; i++) dest[i] = value;
+}
+
+static void copyReference(const float* src, float* dest, int n)
+{
+	for (int i = 0; i < n; i++) dest[i] = src[i];
+}
+
+static void addReference(float* dest, const float* src, float a, int n)
+{
+	for (int i = 0; i < n; i++) dest[i] += src[i] * a;
+}
+
+static void multiplyReference(float* dest, float a, int n)
+{
+	for (int i = 0; i < n; i++) dest[i] *= a;
+}
+
+static void multiplyToReference(const float* src, float a, float* dest, int n)
+{
+	for (int i = 0; i < n; i++) dest[i] = src[i] * a;
+}
+
+static void multiplyBinsReference(const float* src1, const float* src2, float* dest, int n)
+{
+	for (int i = 0; i < n; i++) dest[i] = src1[i] * src2[i];
+}
+
+static float sumOfSquaresReference(const float* src, int n)
+{
+	float sum = 0.0f;
+	for (int i = 0; i < n; i++) sum += src[i] * src[i];
+	return sum;
+}
+
+static float sumOfSquaresOfProductReference(const float* src, const float* gains, int n)
+{
+	float sum = 0.0f;
+	for (int i = 0; i < n; i++)
+	{
+		float x = src[i] * gains[i];
+		sum += x * x;
+	}
+	return sum;
+}
+
+static void filterReference(const float* src, float* dest, int n, int low, int high, bool stop, float damping)
+{
+	float dmp = 1.0f;
+	for (int i = 0; i < n; i++)
+	{
+		float a = 0.0f;
+		if ((i >= low) && (i < high)) a = 1.0f;
+		if (stop) a = 1.0f - a;
+		dest[i] = src[i] * a * dmp;
+		dmp *= damping;
+	}
+}
+
+static void preserveTonalReference(const float* x, const float* smooth, float mul, float* dest, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		float smooth_x = smooth[i] + 1e-6f;
+		float result = x[i] - smooth_x * mul;
+		if (result < 0.0f) result = 0.0f;
+		dest[i] = result;
+	}
+}
+
+static void preserveNoiseReference(const float* x, const float* smooth, float mul, float* dest, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		float smooth_x = smooth[i] + 1e-6f;
+		float result = x[i] - smooth_x * mul + 0.1f * mul;
+		if (result < 0.0f) result = x[i];
+		else result = 0.0f;
+		dest[i] = result;
+	}
+}
+
+const Table& SpectralKernels::getReferenceTable()
+{
+	static const Table table{ "scalar", zeroReference, fillReference, copyReference, addReference,
+		multiplyReference, multiplyToReference, multiplyBinsReference, sumOfSquaresReference,
+		sumOfSquaresOfProductReference, filterReference, preserveTonalReference, preserveNoiseReference };
+	return table;
+}
+
+#if PS_KERNELS_SSE || PS_KERNELS_NEON
+
+// 4 float wide kernels, the same code for SSE2 and NEON through these
+#if PS_KERNELS_SSE
+using vfloat = __m128;
+static inline vfloat vload(const float* p) { return _mm_loadu_ps(p); }
+static inline void vstore(float* p, vfloat v) { _mm_storeu_ps(p, v); }
+static inline vfloat vset(float x) { return _mm_set1_ps(x); }
+static inline vfloat vadd(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+static inline vfloat vsub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+static inline vfloat vmul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+static inline vfloat vmax(vfloat a, vfloat b) { return _mm_max_ps(a, b); }
+// all the bits set in the lanes where a < b
+using vmask = __m128;
+static inline vmask vless(vfloat a, vfloat b) { return _mm_cmplt_ps(a, b); }
+static inline vmask vmaskand(vmask a, vmask b) { return _mm_and_ps(a, b); }
+static inline vmask vmasknot(vmask a) { return _mm_xor_ps(a, _mm_castsi128_ps(_mm_set1_epi32(-1))); }
+// the lanes of x where the mask is set, 0 in the others
+static inline vfloat vselect(vmask m, vfloat x) { return _mm_and_ps(m, x); }
+static inline float vsum(vfloat v)
+{
+	alignas(16) float lanes[4];
+	_mm_store_ps(lanes, v);
+	return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+#else
+using vfloat = float32x4_t;
+static inline vfloat vload(const float* p) { return vld1q_f32(p); }
+static inline void vstore(float* p, vfloat v) { vst1q_f32(p, v); }
+static inline vfloat vset(float x) { return vdupq_n_f32(x); }
+static inline vfloat vadd(vfloat a, vfloat b) { return vaddq_f32(a, b); }
+static inline vfloat vsub(vfloat a, vfloat b) { return vsubq_f32(a, b); }
+static inline vfloat vmul(vfloat a, vfloat b) { return vmulq_f32(a, b); }
+static inline vfloat vmax(vfloat a, vfloat b) { return vmaxq_f32(a, b); }
+using vmask = uint32x4_t;
+static inline vmask vless(vfloat a, vfloat b) { return vcltq_f32(a, b); }
+static inline vmask vmaskand(vmask a, vmask b) { return vandq_u32(a, b); }
+static inline vmask vmasknot(vmask a) { return vmvnq_u32(a); }
+static inline vfloat vselect(vmask m, vfloat x) { return vreinterpretq_f32_u32(vandq_u32(m, vreinterpretq_u32_f32(x))); }
+static inline float vsum(vfloat v)
+{
+	return (vgetq_lane_f32(v, 0) + vgetq_lane_f32(v, 1)) + (vgetq_lane_f32(v, 2) + vgetq_lane_f32(v, 3));
+}
+#endif
+
+static void zeroSIMD(float* dest, int n)
+{
+	int i = 0;
+	const vfloat z = vset(0.0f);
+	for (; i + 4 <= n; i += 4) vstore(dest + i, z);
+	for (; i < n; i++) dest[i] = 0.0f;
+}
+
+static void fillSIMD(float* dest, float value, int n)
+{
+	int i = 0;
+	const vfloat v = vset(value);
+	for (; i + 4 <= n; i += 4) vstore(dest + i, v);
+	for (; i < n; i++) dest[i] = value;
+}
+
+static void copySIMD(const float* src, float* dest, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4) vstore(dest + i, vload(src + i));
+	for (; i < n; i++) dest[i] = src[i];
+}
+
+static void addSIMD(float* dest, const float* src, float a, int n)
+{
+	int i = 0;
+	const vfloat va = vset(a);
+	for (; i + 4 <= n; i += 4) vstore(dest + i, vadd(vload(dest + i), vmul(vload(src + i), va)));
+	for (; i < n; i++) dest[i] += src[i] * a;
+}
+
+static void multiplySIMD(float* dest, float a, int n)
+{
+	int i = 0;
+	const vfloat va = vset(a);
+	for (; i + 4 <= n; i += 4) vstore(dest + i, vmul(vload(dest + i), va));
+	for (; i < n; i++) dest[i] *= a;
+}
+
+static void multiplyToSIMD(const float* src, float a, float* dest, int n)
+{
+	int i = 0;
+	const vfloat va = vset(a);
+	for (; i + 4 <= n; i += 4) vstore(dest + i, vmul(vload(src + i), va));
+	for (; i < n; i++) dest[i] = src[i] * a;
+}
+
+static void multiplyBinsSIMD(const float* src1, const float* src2, float* dest, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4) vstore(dest + i, vmul(vload(src1 + i), vload(src2 + i)));
+	for (; i < n; i++) dest[i] = src1[i] * src2[i];
+}
+
+static float sumOfSquaresSIMD(const float* src, int n)
+{
+	int i = 0;
+	vfloat acc0 = vset(0.0f), acc1 = vset(0.0f);
+	for (; i + 8 <= n; i += 8)
+	{
+		vfloat x0 = vload(src + i), x1 = vload(src + i + 4);
+		acc0 = vadd(acc0, vmul(x0, x0));
+		acc1 = vadd(acc1, vmul(x1, x1));
+	}
+	float sum = vsum(vadd(acc0, acc1));
+	for (; i < n; i++) sum += src[i] * src[i];
+	return sum;
+}
+
+static float sumOfSquaresOfProductSIMD(const float* src, const float* gains, int n)
+{
+	int i = 0;
+	vfloat acc0 = vset(0.0f), acc1 = vset(0.0f);
+	for (; i + 8 <= n; i += 8)
+	{
+		vfloat x0 = vmul(vload(src + i), vload(gains + i));
+		vfloat x1 = vmul(vload(src + i + 4), vload(gains + i + 4));
+		acc0 = vadd(acc0, vmul(x0, x0));
+		acc1 = vadd(acc1, vmul(x1, x1));
+	}
+	float sum = vsum(vadd(acc0, acc1));
+	for (; i < n; i++)
+	{
+		float x = src[i] * gains[i];
+		sum += x * x;
+	}
+	return sum;
+}
+
+static void filterSIMD(const float* src, float* dest, int n, int low, int high, bool stop, float damping)
+{
+	int i = 0;
+	float dmp = 1.0f;
+	if (n >= 4)
+	{
+		//each lane steps its damping by 4 bins
+		alignas(16) float lanes[4];
+		for (int k = 0; k < 4; k++)
+		{
+			lanes[k] = dmp;
+			dmp *= damping;
+		}
+		vfloat vdmp = vload(lanes);
+		const vfloat step = vset(dmp);
+		alignas(16) float positions[4] = { 0.0f, 1.0f, 2.0f, 3.0f };
+		vfloat pos = vload(positions);
+		const vfloat vlow = vset((float)low - 0.5f), vhigh = vset((float)high - 0.5f), four = vset(4.0f);
+		for (; i + 4 <= n; i += 4)
+		{
+			//the bins in the band are the ones between low-0.5 and high-0.5, the positions are exact
+			vmask inband = vmaskand(vless(vlow, pos), vless(pos, vhigh));
+			if (stop)
+				inband = vmasknot(inband);
+			vstore(dest + i, vselect(inband, vmul(vload(src + i), vdmp)));
+			vdmp = vmul(vdmp, step);
+			pos = vadd(pos, four);
+		}
+		vstore(lanes, vdmp);
+		dmp = lanes[0];
+	}
+	for (; i < n; i++)
+	{
+		float a = 0.0f;
+		if ((i >= low) && (i < high)) a = 1.0f;
+		if (stop) a = 1.0f - a;
+		dest[i] = src[i] * a * dmp;
+		dmp *= damping;
+	}
+}
+
+static void preserveTonalSIMD(const float* x, const float* smooth, float mul, float* dest, int n)
+{
+	int i = 0;
+	const vfloat vmulv = vset(mul), offset = vset(1e-6f), z = vset(0.0f);
+	for (; i + 4 <= n; i += 4)
+	{
+		vfloat result = vsub(vload(x + i), vmul(vadd(vload(smooth + i), offset), vmulv));
+		vstore(dest + i, vmax(result, z));
+	}
+	for (; i < n; i++)
+	{
+		float result = x[i] - (smooth[i] + 1e-6f) * mul;
+		dest[i] = result < 0.0f ? 0.0f : result;
+	}
+}
+
+static void preserveNoiseSIMD(const float* x, const float* smooth, float mul, float* dest, int n)
+{
+	int i = 0;
+	const vfloat vmulv = vset(mul), offset = vset(1e-6f), bias = vset(0.1f * mul), z = vset(0.0f);
+	for (; i + 4 <= n; i += 4)
+	{
+		vfloat vx = vload(x + i);
+		vfloat result = vadd(vsub(vx, vmul(vadd(vload(smooth + i), offset), vmulv)), bias);
+		vstore(dest + i, vselect(vless(result, z), vx));
+	}
+	for (; i < n; i++)
+	{
+		float result = x[i] - (smooth[i] + 1e-6f) * mul + 0.1f * mul;
+		dest[i] = result < 0.0f ? x[i] : 0.0f;
+	}
+}
+
+const Table& SpectralKernels::getBaselineTable()
+{
+#if PS_KERNELS_SSE
+	const char* name = "SSE2";
+#else
+	const char* name = "NEON";
+#endif
+	static const Table table{ name, zeroSIMD, fillSIMD, copySIMD, addSIMD,
+		multiplySIMD, multiplyToSIMD, multiplyBinsSIMD, sumOfSquaresSIMD,
+		sumOfSquaresOfProductSIMD, filterSIMD, preserveTonalSIMD, preserveNoiseSIMD };
+	return table;
+}
+
+#else
+
+const Table& SpectralKernels::getBaselineTable()
+{
+	return getReferenceTable();
+}
+
+#endif
+
+const Table& SpectralKernels::getTable()
+{
+	static const Table& table = []() -> const Table&
+	{
+#if PS_SPECTRAL_AVX2
+		if (SystemStats::hasAVX2())
+			return getAVX2Table();
+#endif
+		return getBaselineTable();
+	}();
+	return table;
+}
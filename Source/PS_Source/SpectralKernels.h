@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: GPLv3-or-later WITH Appstore-exception
+
+#pragma once
+
+// The element-wise loops of the spectrum processes over the bins of a spectrum. The kernels are
+// picked once at runtime from the CPU features: AVX2 when the build has it and the CPU can run
+// it, otherwise SSE2 or NEON, otherwise the scalar reference versions.
+//
+// The element-wise kernels give the same results as the reference ones. The sums are done in
+// several lanes, and the filter steps its damping in each lane, so those differ from the
+// reference in the last bits.
+//
+// This header is also included by the translation unit compiled with the AVX2 flags, so it
+// must not include JUCE or define anything that could be compiled with those flags into the
+// code the other CPUs run.
+
+// The AVX2 kernels are linked in, set by the build system on x86-64
+#ifndef PS_SPECTRAL_AVX2
+#define PS_SPECTRAL_AVX2 0
+#endif
+
+namespace SpectralKernels
+{
+	struct Table
+	{
+		const char* name;
+		// dest = 0
+		void (*zero)(float* dest, int n);
+		// dest = value
+		void (*fill)(float* dest, float value, int n);
+		// dest = src
+		void (*copy)(const float* src, float* dest, int n);
+		// dest += src * a
+		void (*add)(float* dest, const float* src, float a, int n);
+		// dest *= a
+		void (*multiply)(float* dest, float a, int n);
+		// dest = src * a
+		void (*multiplyTo)(const float* src, float a, float* dest, int n);
+		// dest = src1 * src2, dest can be one of the sources
+		void (*multiplyBins)(const float* src1, const float* src2, float* dest, int n);
+		// the sum of src * src
+		float (*sumOfSquares)(const float* src, int n);
+		// the sum of (src * gains)^2
+		float (*sumOfSquaresOfProduct)(const float* src, const float* gains, int n);
+		// dest = src * dmp in the bins from low to high, 0 in the others, or the other way around
+		// with stop. dmp is 1 at bin 0 and is multiplied by damping for each bin.
+		void (*filter)(const float* src, float* dest, int n, int low, int high, bool stop, float damping);
+		// dest = max(x - (smooth + 1e-6) * mul, 0)
+		void (*preserveTonal)(const float* x, const float* smooth, float mul, float* dest, int n);
+		// dest = x where x - (smooth + 1e-6) * mul + 0.1 * mul is below 0, otherwise 0
+		void (*preserveNoise)(const float* x, const float* smooth, float mul, float* dest, int n);
+	};
+
+	// The kernels for this CPU, chosen the first time this is called
+	const Table& getTable();
+	// The scalar loops the processes had before the kernels, to check the others against
+	const Table& getReferenceTable();
+	// The SIMD kernels of the baseline instruction set of the build, the reference ones if it hasn't got any
+	const Table& getBaselineTable();
+#if PS_SPECTRAL_AVX2
+	const Table& getAVX2Table();
+#endif
+
+	inline void zero(float* dest, int n) { getTable().zero(dest, n); }
+	inline void fill(float* dest, float value, int n) { getTable().fill(dest, value, n); }
+	inline void copy(const float* src, float* dest, int n) { getTable().copy(src, dest, n); }
+	inline void add(float* dest, const float* src, float a, int n) { getTable().add(dest, src, a, n); }
+	inline void multiply(float* dest, float a, int n) { getTable().multiply(dest, a, n); }
+	inline void multiplyTo(const float* src, float a, float* dest, int n) { getTable().multiplyTo(src, a, dest, n); }
+	inline void multiplyBins(const float* src1, const float* src2, float* dest, int n) { getTable().multiplyBins(src1, src2, dest, n); }
+	inline float sumOfSquares(const float* src, int n) { return getTable().sumOfSquares(src, n); }
+	inline float sumOfSquaresOfProduct(const float* src, const float* gains, int n) { return getTable().sumOfSquaresOfProduct(src, gains, n); }
+	inline void filter(const float* src, float* dest, int n, int low, int high, bool stop, float damping)
+	{
+		getTable().filter(src, dest, n, low, high, stop, damping);
+	}
+	inline void preserveTonal(const float* x, const float* smooth, float mul, float* dest, int n) { getTable().preserveTonal(x, smooth, mul, dest, n); }
+	inline void preserveNoise(const float* x, const float* smooth, float mul, float* dest, int n) { getTable().preserveNoise(x, smooth, mul, dest, n); }
+}
@@ -0,0 +1,196 @@
+// SPDX-License-Identifier: GPLv3-or-later WITH Appstore-exception
+
+// Compiled with the AVX2 flags, only called when SystemStats::hasAVX2 is true. Nothing but the
+// kernels may be compiled here, so this doesn't include JUCE or the other headers of the project.
+
+#include "SpectralKernels.h"
+
+#if PS_SPECTRAL_AVX2
+
+#include <immintrin.h>
+
+using namespace SpectralKernels;
+
+static void zeroAVX2(float* dest, int n)
+{
+	int i = 0;
+	const __m256 z = _mm256_setzero_ps();
+	for (; i + 8 <= n; i += 8) _mm256_storeu_ps(dest + i, z);
+	for (; i < n; i++) dest[i] = 0.0f;
+}
+
+static void fillAVX2(float* dest, float value, int n)
+{
+	int i = 0;
+	const __m256 v = _mm256_set1_ps(value);
+	for (; i + 8 <= n; i += 8) _mm256_storeu_ps(dest + i, v);
+	for (; i < n; i++) dest[i] = value;
+}
+
+static void copyAVX2(const float* src, float* dest, int n)
+{
+	int i = 0;
+	for (; i + 8 <= n; i += 8) _mm256_storeu_ps(dest + i, _mm256_loadu_ps(src + i));
+	for (; i < n; i++) dest[i] = src[i];
+}
+
+static void addAVX2(float* dest, const float* src, float a, int n)
+{
+	int i = 0;
+	const __m256 va = _mm256_set1_ps(a);
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(dest + i, _mm256_add_ps(_mm256_loadu_ps(dest + i), _mm256_mul_ps(_mm256_loadu_ps(src + i), va)));
+	for (; i < n; i++) dest[i] += src[i] * a;
+}
+
+static void multiplyAVX2(float* dest, float a, int n)
+{
+	int i = 0;
+	const __m256 va = _mm256_set1_ps(a);
+	for (; i + 8 <= n; i += 8) _mm256_storeu_ps(dest + i, _mm256_mul_ps(_mm256_loadu_ps(dest + i), va));
+	for (; i < n; i++) dest[i] *= a;
+}
+
+static void multiplyToAVX2(const float* src, float a, float* dest, int n)
+{
+	int i = 0;
+	const __m256 va = _mm256_set1_ps(a);
+	for (; i + 8 <= n; i += 8) _mm256_storeu_ps(dest + i, _mm256_mul_ps(_mm256_loadu_ps(src + i), va));
+	for (; i < n; i++) dest[i] = src[i] * a;
+}
+
+static void multiplyBinsAVX2(const float* src1, const float* src2, float* dest, int n)
+{
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(dest + i, _mm256_mul_ps(_mm256_loadu_ps(src1 + i), _mm256_loadu_ps(src2 + i)));
+	for (; i < n; i++) dest[i] = src1[i] * src2[i];
+}
+
+static float sum8(__m256 v)
+{
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+static float sumOfSquaresAVX2(const float* src, int n)
+{
+	int i = 0;
+	__m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+	for (; i + 16 <= n; i += 16)
+	{
+		__m256 x0 = _mm256_loadu_ps(src + i), x1 = _mm256_loadu_ps(src + i + 8);
+		acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(x0, x0));
+		acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(x1, x1));
+	}
+	float sum = sum8(_mm256_add_ps(acc0, acc1));
+	for (; i < n; i++) sum += src[i] * src[i];
+	return sum;
+}
+
+static float sumOfSquaresOfProductAVX2(const float* src, const float* gains, int n)
+{
+	int i = 0;
+	__m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+	for (; i + 16 <= n; i += 16)
+	{
+		__m256 x0 = _mm256_mul_ps(_mm256_loadu_ps(src + i), _mm256_loadu_ps(gains + i));
+		__m256 x1 = _mm256_mul_ps(_mm256_loadu_ps(src + i + 8), _mm256_loadu_ps(gains + i + 8));
+		acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(x0, x0));
+		acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(x1, x1));
+	}
+	float sum = sum8(_mm256_add_ps(acc0, acc1));
+	for (; i < n; i++)
+	{
+		float x = src[i] * gains[i];
+		sum += x * x;
+	}
+	return sum;
+}
+
+static void filterAVX2(const float* src, float* dest, int n, int low, int high, bool stop, float damping)
+{
+	int i = 0;
+	float dmp = 1.0f;
+	if (n >= 8)
+	{
+		//each lane steps its damping by 8 bins
+		alignas(32) float lanes[8];
+		for (int k = 0; k < 8; k++)
+		{
+			lanes[k] = dmp;
+			dmp *= damping;
+		}
+		__m256 vdmp = _mm256_load_ps(lanes);
+		const __m256 step = _mm256_set1_ps(dmp);
+		__m256i pos = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m256i vlow = _mm256_set1_epi32(low - 1), vhigh = _mm256_set1_epi32(high), eight = _mm256_set1_epi32(8);
+		const __m256i invert = _mm256_set1_epi32(stop ? -1 : 0);
+		for (; i + 8 <= n; i += 8)
+		{
+			__m256i inband = _mm256_and_si256(_mm256_cmpgt_epi32(pos, vlow), _mm256_cmpgt_epi32(vhigh, pos));
+			inband = _mm256_xor_si256(inband, invert);
+			__m256 x = _mm256_mul_ps(_mm256_loadu_ps(src + i), vdmp);
+			_mm256_storeu_ps(dest + i, _mm256_and_ps(_mm256_castsi256_ps(inband), x));
+			vdmp = _mm256_mul_ps(vdmp, step);
+			pos = _mm256_add_epi32(pos, eight);
+		}
+		dmp = _mm256_cvtss_f32(vdmp);
+	}
+	for (; i < n; i++)
+	{
+		float a = 0.0f;
+		if ((i >= low) && (i < high)) a = 1.0f;
+		if (stop) a = 1.0f - a;
+		dest[i] = src[i] * a * dmp;
+		dmp *= damping;
+	}
+}
+
+static void preserveTonalAVX2(const float* x, const float* smooth, float mul, float* dest, int n)
+{
+	int i = 0;
+	const __m256 vmul = _mm256_set1_ps(mul), offset = _mm256_set1_ps(1e-6f), z = _mm256_setzero_ps();
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 smooth_x = _mm256_add_ps(_mm256_loadu_ps(smooth + i), offset);
+		__m256 result = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_mul_ps(smooth_x, vmul));
+		_mm256_storeu_ps(dest + i, _mm256_max_ps(result, z));
+	}
+	for (; i < n; i++)
+	{
+		float result = x[i] - (smooth[i] + 1e-6f) * mul;
+		dest[i] = result < 0.0f ? 0.0f : result;
+	}
+}
+
+static void preserveNoiseAVX2(const float* x, const float* smooth, float mul, float* dest, int n)
+{
+	int i = 0;
+	const __m256 vmul = _mm256_set1_ps(mul), offset = _mm256_set1_ps(1e-6f), bias = _mm256_set1_ps(0.1f * mul);
+	const __m256 z = _mm256_setzero_ps();
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 vx = _mm256_loadu_ps(x + i);
+		__m256 smooth_x = _mm256_add_ps(_mm256_loadu_ps(smooth + i), offset);
+		__m256 result = _mm256_add_ps(_mm256_sub_ps(vx, _mm256_mul_ps(smooth_x, vmul)), bias);
+		_mm256_storeu_ps(dest + i, _mm256_and_ps(_mm256_cmp_ps(result, z, _CMP_LT_OQ), vx));
+	}
+	for (; i < n; i++)
+	{
+		float result = x[i] - (smooth[i] + 1e-6f) * mul + 0.1f * mul;
+		dest[i] = result < 0.0f ? x[i] : 0.0f;
+	}
+}
+
+const Table& SpectralKernels::getAVX2Table()
+{
+	static const Table table{ "AVX2", zeroAVX2, fillAVX2, copyAVX2, addAVX2,
+		multiplyAVX2, multiplyToAVX2, multiplyBinsAVX2, sumOfSquaresAVX2,
+		sumOfSquaresOfProductAVX2, filterAVX2, preserveTonalAVX2, preserveNoiseAVX2 };
+	return table;
+}
+
+#endif
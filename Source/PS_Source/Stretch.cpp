@@ -16,279 +16,723 @@
 	Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
 */
 
-#if PS_USE_VDSP_FFT
-#define VIMAGE_H // crazy hack needed
-#include <Accelerate/Accelerate.h>
-//#include <vForce.h>
-#endif
-
 #include "Stretch.h"
 #include <stdlib.h>
 #include <math.h>
+#include <atomic>
 
-
-FFT::FFT(int nsamples_, bool no_inverse)
+// the FFT objects are made on several threads, each one gets its own seed
+static uint32_t nextFFTSeed()
 {
-    nsamples=nsamples_;
-	if (nsamples%2!=0) {
-		nsamples+=1;
-		Logger::writeToLog("WARNING: Odd sample size on FFT::FFT() "+String(nsamples));
-	};
-	smp.resize(nsamples);
-	for (int i = 0; i < nsamples; i++) 
-		smp[i] = 0.0;
-	freq.resize(nsamples/2+1);
-	for (int i=0;i<nsamples/2+1;i++) 
-		freq[i]=0.0;
-	window.data.resize(nsamples);
-	for (int i=0;i<nsamples;i++) 
-		window.data[i]=0.707f;
-	window.type=W_RECTANGULAR;
-
-	data.resize(nsamples,true);
-	bool allow_long_planning = false; // g_propsfile->getBoolValue("fftw_allow_long_planning", false);
-    //double t0 = Time::getMillisecondCounterHiRes();
-#if PS_USE_VDSP_FFT
-    int maxlog2N = 1;
-    while ((1 << maxlog2N) < nsamples)
-        ++maxlog2N;
-    log2N = maxlog2N;
-    planfft = vDSP_create_fftsetup(maxlog2N, kFFTRadix2);
-
-    m_workReal.resize(nsamples,false);
-    m_workImag.resize(nsamples,false);
-
-    //Logger::writeToLog("fftsize: "  + String(nsamples) + " log2N: " + String(log2N));
-#elif PS_USE_PFFFT
-
-    planpffft = pffft_new_setup(nsamples, PFFFT_REAL);
-
-    m_work.resize(2*nsamples,false);
-
-    //Logger::writeToLog("fftsize: "  + String(nsamples) + " log2N: " + String(log2N));
-
-#else
-    if (allow_long_planning)
-    {
-        //fftwf_plan_with_nthreads(2);
-        planfftw=fftwf_plan_r2r_1d(nsamples,data.data(),data.data(),FFTW_R2HC,FFTW_MEASURE);
-        if (no_inverse == false)
-			planifftw=fftwf_plan_r2r_1d(nsamples,data.data(),data.data(),FFTW_HC2R,FFTW_MEASURE);
-    } else
-    {
-        //fftwf_plan_with_nthreads(2);
-        planfftw=fftwf_plan_r2r_1d(nsamples,data.data(),data.data(),FFTW_R2HC,FFTW_ESTIMATE);
-        //fftwf_plan_with_nthreads(2);
-        if (no_inverse == false)
-			planifftw=fftwf_plan_r2r_1d(nsamples,data.data(),data.data(),FFTW_HC2R,FFTW_ESTIMATE);
-    }
-#endif
-
-    //double t1 = Time::getMillisecondCounterHiRes();
-    //Logger::writeToLog("Creating FFTW3 plans took "+String(t1-t0)+ "ms");
-	static int seed = 0;
-	m_randgen = std::mt19937(seed);
-	++seed;
-};
+	static std::atomic<uint32_t> seed{ 0 };
+	return seed.fetch_add(1);
+}
 
-FFT::~FFT()
+template<typename Map>
+static void removeExpiredEntries(Map& m)
 {
-#if PS_USE_VDSP_FFT
-    vDSP_destroy_fftsetup((FFTSetup)planfft);
-#elif PS_USE_PFFFT
-    if (planpffft) {
-        pffft_destroy_setup(planpffft);
-    }
-#else
-    fftwf_destroy_plan(planfftw);
-	if (planifftw!=nullptr)
-		fftwf_destroy_plan(planifftw);
-#endif
-};
+	for (auto it = m.begin(); it != m.end();)
+	{
+		if (it->second.expired())
+			it = m.erase(it);
+		else
+			++it;
+	}
+}
 
-void FFT::smp2freq()
+FFTPlanRegistry::FFTPlanRegistry() : Thread("PaulXFFTPlanner")
 {
-#if PS_USE_VDSP_FFT
-
-    const int halfsamples = nsamples / 2;
-
-    COMPLEX_SPLIT A;
-    A.realp = m_workReal.data();
-    A.imagp = m_workImag.data();
-
-    // apply window
-    //vDSP_vmul(gInFIFO, 1, mWindow, 1, gFFTworksp, 1, fftFrameSize);
-
-    //convert real input to even-odd
-
-    vDSP_ctoz((COMPLEX*)smp.data(), 2, &A, 1, halfsamples);
-    //memset(ioData->mBuffers[0].mData, 0, ioData->mBuffers[0].mDataByteSize);
-
-    // forward fft
-    vDSP_fft_zrip((FFTSetup)planfft, &A, 1, log2N, FFT_FORWARD);
-
-    // result is in split packed complex A.realp[0] is DC, A.imagp[0] is NY, so we zero NY before doing mag^2
-    A.imagp[0] = 0.0f;
-
-    //DebugLogC("post fft: %g %g\n", A.realp[fftFrameSize/4], A.imagp[fftFrameSize/4 + 1]);
+}
 
-    // forward scale
-    const float scale = 0.5f;
-    vDSP_vsmul(A.realp, 1, &scale, A.realp, 1, halfsamples);
-    vDSP_vsmul(A.imagp, 1, &scale, A.imagp, 1, halfsamples);
+FFTPlanRegistry::~FFTPlanRegistry()
+{
+	// Measurements are bounded by the FFTW time limit, so this shouldn't need to wait long
+	stopThread(10000);
+	{
+		ScopedLock plannerlocker(m_plannercs);
+		destroyRetiredPlans();
+	}
+	saveWisdom();
+}
 
-    // Absolute square (equivalent to mag^2)
-    vDSP_zvmags(&A, 1, freq.data(), 1, halfsamples);
+void FFTPlanRegistry::wakePlannerThread()
+{
+	if (isThreadRunning() == false)
+		startThread(Priority::background);
+	notify();
+}
 
-    // take square root
-    //vvsqrtf(freq.data(), freq.data(), &halfsamples);
+void FFTPlanRegistry::setPlanningMode(FFTPlanningMode mode, File wisdomfile)
+{
+	m_planningmode = mode;
+	if (FFTPlan::isBackendAvailable(FFTBackendType::FFTW) == false)
+		return;
+	{
+		ScopedLock plannerlocker(m_plannercs);
+		m_wisdomfile = wisdomfile;
+		if (m_wisdomloaded == false && m_wisdomfile.existsAsFile())
+		{
+			m_wisdomloaded = true;
+			if (importFFTWWisdom(m_wisdomfile) == false)
+				Logger::writeToLog("Could not load FFTW wisdom from " + m_wisdomfile.getFullPathName());
+		}
+	}
+	if (mode != FFTPlanningMode::Estimate)
+	{
+		// Plans that were made before the mode was switched on get measured too
+		ScopedLock locker(m_cs);
+		removeExpiredEntries(m_plans);
+		for (auto& e : m_plans)
+			m_pendingmeasurements.push_back(e.second);
+		wakePlannerThread();
+	}
+}
 
-    for (int i=1; i < halfsamples;i++)
-    {
-        freq[i]=sqrt(freq[i]);
-    }
+int FFTPlanRegistry::getNumPendingMeasurements()
+{
+	ScopedLock locker(m_cs);
+	return (int)m_pendingmeasurements.size();
+}
 
-    freq[0] = 0.0;
+void FFTPlanRegistry::run()
+{
+	while (threadShouldExit() == false)
+	{
+		{
+			ScopedLock plannerlocker(m_plannercs);
+			destroyRetiredPlans();
+		}
+		std::shared_ptr<const FFTPlan> plan;
+		int autotunesize = 0;
+		int timingsize = 0;
+		bool autotunefinished = false;
+		bool measurespeedup = false;
+		{
+			ScopedLock locker(m_cs);
+			while (plan == nullptr && m_pendingmeasurements.empty() == false)
+			{
+				plan = m_pendingmeasurements.front().lock();
+				m_pendingmeasurements.erase(m_pendingmeasurements.begin());
+			}
+			// Measurements go first, they speed up the plans that are in use right now
+			if (plan == nullptr && m_speedupmeasurementpending)
+			{
+				measurespeedup = true;
+				m_speedupmeasurementpending = false;
+			}
+			else if (plan == nullptr && m_autotunecompletion)
+			{
+				if (m_autotunesizes.empty() == false)
+				{
+					autotunesize = m_autotunesizes.front();
+					m_autotunesizes.erase(m_autotunesizes.begin());
+				}
+				else
+					autotunefinished = true;
+			}
+			else if (plan == nullptr && m_sizetimingqueue.empty() == false)
+			{
+				timingsize = m_sizetimingqueue.front();
+				m_sizetimingqueue.erase(m_sizetimingqueue.begin());
+			}
+		}
+		if (plan != nullptr)
+		{
+			bool measured = false;
+			{
+				ScopedLock plannerlocker(m_plannercs);
+				measured = plan->makeMeasuredPlan(m_planningmode.load());
+			}
+			if (measured)
+				m_wisdomchanged = true;
+			// If the FFTs were deleted during the measurement, the plan gets destroyed on this thread
+			plan = nullptr;
+		}
+		else if (measurespeedup)
+		{
+			measureParallelSpeedup();
+		}
+		else if (autotunesize > 0)
+		{
+			autotuneSize(autotunesize);
+		}
+		else if (autotunefinished)
+		{
+			std::function<void(const BackendTable&)> completion;
+			BackendTable results;
+			{
+				ScopedLock locker(m_cs);
+				std::swap(completion, m_autotunecompletion);
+				results = m_autotuneresults;
+				for (auto& e : results)
+					m_backendtable[e.first] = e.second;
+			}
+			completion(results);
+		}
+		else if (timingsize > 0)
+		{
+			timeSize(timingsize);
+		}
+		else
+			wait(1000);
+	}
+}
 
-#elif PS_USE_PFFFT
-    const int halfsamples = nsamples / 2;
-    auto * databuf = data.data();
+void FFTPlanRegistry::saveWisdom()
+{
+	ScopedLock plannerlocker(m_plannercs);
+	if (m_wisdomchanged == false || m_wisdomfile == File())
+		return;
+	m_wisdomfile.getParentDirectory().createDirectory();
+	if (exportFFTWWisdom(m_wisdomfile) == false)
+		Logger::writeToLog("Could not save FFTW wisdom to " + m_wisdomfile.getFullPathName());
+	m_wisdomchanged = false;
+}
 
-    pffft_transform_ordered(planpffft, smp.data(), databuf, m_work.data(), PFFFT_FORWARD);
+FFTBackendType FFTPlanRegistry::getBackendForSize(int nsamples)
+{
+	{
+		ScopedLock locker(m_cs);
+		auto it = m_backendtable.find(nsamples);
+		if (it != m_backendtable.end() && FFTPlan::isSizeSupported(it->second, nsamples))
+			return it->second;
+	}
+	for (auto backend : FFTPlan::getAvailableBackends())
+		if (FFTPlan::isSizeSupported(backend, nsamples))
+			return backend;
+	jassertfalse;
+	return FFTBackendType::PFFFT;
+}
 
-    data[1] = 0.0f;
+void FFTPlanRegistry::setBackendTable(const BackendTable& table)
+{
+	ScopedLock locker(m_cs);
+	m_backendtable = table;
+}
 
-    // compute magnitude
+FFTPlanRegistry::BackendTable FFTPlanRegistry::getBackendTable()
+{
+	ScopedLock locker(m_cs);
+	return m_backendtable;
+}
 
-    FloatVectorOperations::multiply(databuf, databuf, nsamples);
-    
-    for (int k=1, l=2; k < halfsamples; ++k, l+=2) {
-        freq[k] = sqrt(databuf[l] + databuf[l+1]);
-    }
+String FFTPlanRegistry::backendTableToString(const BackendTable& table)
+{
+	String result;
+	for (auto& e : table)
+		result << String(e.first) << ":" << FFTPlan::getBackendName(e.second) << " ";
+	return result.trimEnd();
+}
 
-    freq[0] = 0.0;
+FFTPlanRegistry::BackendTable FFTPlanRegistry::backendTableFromString(const String& str)
+{
+	BackendTable result;
+	auto tokens = StringArray::fromTokens(str, " ", "");
+	for (auto& token : tokens)
+	{
+		int size = token.upToFirstOccurrenceOf(":", false, false).getIntValue();
+		FFTBackendType backend;
+		if (size > 0 && FFTPlan::getBackendFromName(token.fromFirstOccurrenceOf(":", false, false), backend))
+			result[size] = backend;
+	}
+	return result;
+}
 
-#else
+void FFTPlanRegistry::startBackendAutotune(std::vector<int> sizes, std::function<void(const BackendTable&)> completion)
+{
+	ScopedLock locker(m_cs);
+	m_autotunesizes.clear();
+	for (int size : sizes)
+	{
+		int numsupporting = 0;
+		for (auto backend : FFTPlan::getAvailableBackends())
+			if (FFTPlan::isSizeSupported(backend, size))
+				++numsupporting;
+		if (numsupporting > 1)
+			m_autotunesizes.push_back(size);
+	}
+	m_autotuneresults.clear();
+	m_autotunecompletion = std::move(completion);
+	wakePlannerThread();
+}
 
-    for (int i=0;i<nsamples;i++)
-        data[i]=smp[i];
-    fftwf_execute(planfftw);
+bool FFTPlanRegistry::isAutotuneRunning()
+{
+	ScopedLock locker(m_cs);
+	return (bool)m_autotunecompletion;
+}
 
+// Best time in milliseconds of a few rounds of forward and inverse transforms
+static double timeTransforms(const FFTPlan& forward, const FFTPlan& inverse)
+{
+	const int nsamples = forward.nsamples;
+	FFTWBuffer<REALTYPE> smp, freq, scratch;
+	smp.resize(nsamples, true);
+	freq.resize(nsamples / 2 + 1, true);
+	scratch.resize(std::max(forward.getScratchSize(), inverse.getScratchSize()), true);
+	RandomPhaseGenerator phases(0);
+	for (int i = 0; i < nsamples; ++i)
+		smp[i] = (float)sin(i * 0.1);
+	double besttime = 0.0;
+	double totaltime = 0.0;
+	for (int round = 0; round < 3 || (round < 100 && totaltime < 20.0); ++round)
+	{
+		double t0 = Time::getMillisecondCounterHiRes();
+		forward.forwardMagnitudes(smp.data(), freq.data(), scratch.data());
+		inverse.inverseRandomPhases(freq.data(), phases, smp.data(), scratch.data());
+		double elapsed = Time::getMillisecondCounterHiRes() - t0;
+		totaltime += elapsed;
+		if (round == 0 || elapsed < besttime)
+			besttime = elapsed;
+	}
+	return besttime;
+}
 
-    for (int i=1;i<nsamples/2;i++)
-    {
+void FFTPlanRegistry::autotuneSize(int nsamples)
+{
+	double besttime = 0.0;
+	FFTBackendType bestbackend = getBackendForSize(nsamples);
+	for (auto backend : FFTPlan::getAvailableBackends())
+	{
+		if (FFTPlan::isSizeSupported(backend, nsamples) == false)
+			continue;
+		std::unique_ptr<FFTPlan> forwardplan, inverseplan;
+		{
+			// Time the plans that getPlan would give, measured ones if the planning mode asks for that
+			ScopedLock plannerlocker(m_plannercs);
+			forwardplan = FFTPlan::create(backend, nsamples, FFTDirection::Forward);
+			if (FFTPlan::hasSeparateInversePlans(backend))
+				inverseplan = FFTPlan::create(backend, nsamples, FFTDirection::Inverse);
+			if (forwardplan->makeMeasuredPlan(m_planningmode.load()))
+				m_wisdomchanged = true;
+			if (inverseplan != nullptr && inverseplan->makeMeasuredPlan(m_planningmode.load()))
+				m_wisdomchanged = true;
+		}
+		const FFTPlan* inverse = inverseplan != nullptr ? inverseplan.get() : forwardplan.get();
+		const double backendtime = timeTransforms(*forwardplan, *inverse);
+		if (besttime == 0.0 || backendtime < besttime)
+		{
+			besttime = backendtime;
+			bestbackend = backend;
+		}
+		ScopedLock plannerlocker(m_plannercs);
+		forwardplan = nullptr;
+		inverseplan = nullptr;
+	}
+	ScopedLock locker(m_cs);
+	m_autotuneresults[nsamples] = bestbackend;
+}
 
-        REALTYPE c=data[i];
-        REALTYPE s=data[nsamples-i];
+void FFTPlanRegistry::setSizeTimings(const SizeTimingTable& table, std::function<void(const SizeTimingTable&)> changed)
+{
+	ScopedLock locker(m_cs);
+	// the sizes this process has already timed are kept
+	for (auto& e : table)
+		m_sizetimings.insert(e);
+	m_sizetimingschanged = std::move(changed);
+	++m_sizetimingsversion;
+}
 
-        freq[i]=sqrt(c*c+s*s);
-    };
-    freq[0]=0.0;
+FFTPlanRegistry::SizeTimingTable FFTPlanRegistry::getSizeTimings()
+{
+	ScopedLock locker(m_cs);
+	return m_sizetimings;
+}
 
-#endif
-};
+String FFTPlanRegistry::sizeTimingsToString(const SizeTimingTable& table)
+{
+	String result;
+	for (auto& e : table)
+		result << String(e.first) << ":" << String(e.second, 4) << " ";
+	return result.trimEnd();
+}
 
-void FFT::freq2smp()
+FFTPlanRegistry::SizeTimingTable FFTPlanRegistry::sizeTimingsFromString(const String& str)
 {
-	const REALTYPE inv_2p15_2pi=1.0f/16384.0f*(float)c_PI;
+	SizeTimingTable result;
+	auto tokens = StringArray::fromTokens(str, " ", "");
+	for (auto& token : tokens)
+	{
+		int size = token.upToFirstOccurrenceOf(":", false, false).getIntValue();
+		float time = token.fromFirstOccurrenceOf(":", false, false).getFloatValue();
+		if (size > 0 && time > 0.0f)
+			result[size] = time;
+	}
+	return result;
+}
 
-#if PS_USE_VDSP_FFT
-    const int halfsamples = nsamples / 2;
+int FFTPlanRegistry::getFastestSize(const std::vector<int>& sizes)
+{
+	ScopedLock locker(m_cs);
+	int result = 0;
+	double besttime = 0.0;
+	bool untimed = false;
+	for (int size : sizes)
+	{
+		auto it = m_sizetimings.find(size);
+		if (it == m_sizetimings.end())
+		{
+			if (std::find(m_sizetimingqueue.begin(), m_sizetimingqueue.end(), size) == m_sizetimingqueue.end())
+				m_sizetimingqueue.push_back(size);
+			untimed = true;
+			continue;
+		}
+		// a frame of a larger size also produces more output, so the sizes are compared per sample
+		const double timepersample = it->second / size;
+		if (result == 0 || timepersample < besttime)
+		{
+			besttime = timepersample;
+			result = size;
+		}
+	}
+	if (untimed == false)
+		return result;
+	wakePlannerThread();
+	return 0;
+}
 
-    COMPLEX_SPLIT A;
-    A.realp = m_workReal.data();
-    A.imagp = m_workImag.data();
+void FFTPlanRegistry::timeSize(int nsamples)
+{
+	// The plans getPlan gives, split over the FFT threads for the largest sizes, and measured now
+	// if the planning mode asks for that so that the timing is the one the stretchers will see
+	auto forwardplan = getPlan(nsamples, FFTDirection::Forward);
+	auto inverseplan = getPlan(nsamples, FFTDirection::Inverse);
+	if (m_planningmode.load() != FFTPlanningMode::Estimate)
+	{
+		ScopedLock plannerlocker(m_plannercs);
+		for (auto& plan : { forwardplan, inverseplan })
+			if (plan->makeMeasuredPlan(m_planningmode.load()))
+				m_wisdomchanged = true;
+	}
+	const double time = timeTransforms(*forwardplan, *inverseplan);
+	forwardplan = nullptr;
+	inverseplan = nullptr;
+	std::function<void(const SizeTimingTable&)> changed;
+	SizeTimingTable table;
+	{
+		ScopedLock locker(m_cs);
+		m_sizetimings[nsamples] = jmax(1.0e-6f, (float)time);
+		if (m_sizetimingqueue.empty() == false)
+			return;
+		++m_sizetimingsversion;
+		changed = m_sizetimingschanged;
+		table = m_sizetimings;
+	}
+	if (changed)
+		changed(table);
+}
 
+void FFTPlanRegistry::setNumFFTThreads(int numthreads)
+{
+	if (numthreads == m_workers.getNumThreads())
+		return;
+	m_workers.setNumThreads(numthreads);
+	ScopedLock locker(m_cs);
+	m_parallelspeedup = 0.0f;
+	m_speedupmeasurementpending = m_workers.getNumThreads() > 1;
+	if (m_speedupmeasurementpending)
+		wakePlannerThread();
+}
 
-    for (int i=1;i<nsamples/2;i++)
-    {
-        unsigned int rand = m_randdist(m_randgen);
-        REALTYPE phase = rand*inv_2p15_2pi;
-        m_workReal[i] = freq[i]*cos(phase);
-        m_workImag[i] = freq[i]*sin(phase);
+void FFTPlanRegistry::measureParallelSpeedup()
+{
+	const int nsamples = getParallelSpeedupSize();
+	const auto backend = getBackendForSize(nsamples);
+	const int numparts = ParallelFFTPlan::getNumParts(backend, nsamples, m_workers.getNumThreads());
+	if (numparts == 0)
+		return;
+	// The cached plans, so that the timings use the measured FFTW plans when there are any
+	auto forward = getPlan(nsamples, FFTDirection::Forward, backend, 0);
+	auto inverse = getPlan(nsamples, FFTDirection::Inverse, backend, 0);
+	auto splitforward = getPlan(nsamples, FFTDirection::Forward, backend, numparts);
+	auto splitinverse = getPlan(nsamples, FFTDirection::Inverse, backend, numparts);
+	const double singletime = timeTransforms(*forward, *inverse);
+	const double splittime = timeTransforms(*splitforward, *splitinverse);
+	if (splittime > 0.0)
+		m_parallelspeedup = (float)(singletime / splittime);
+}
 
-    };
-    m_workReal[0] = m_workImag[0] = 0.0;
+std::shared_ptr<const FFTPlan> FFTPlanRegistry::getPlan(int nsamples, FFTDirection direction)
+{
+	return getPlan(nsamples, direction, getBackendForSize(nsamples));
+}
 
-    // inverse fft
-    vDSP_fft_zrip((FFTSetup)planfft, &A, 1, log2N, FFT_INVERSE);
+std::shared_ptr<const FFTPlan> FFTPlanRegistry::getPlan(int nsamples, FFTDirection direction, FFTBackendType backend)
+{
+	return getPlan(nsamples, direction, backend, ParallelFFTPlan::getNumParts(backend, nsamples, m_workers.getNumThreads()));
+}
 
-    // unpack
-    vDSP_ztoc(&A, 1, (COMPLEX*)data.data(), 2, halfsamples);
+std::shared_ptr<const FFTPlan> FFTPlanRegistry::getPlan(int nsamples, FFTDirection direction, FFTBackendType backend, int numparts)
+{
+	if (FFTPlan::hasSeparateInversePlans(backend) == false)
+		direction = FFTDirection::Forward;
+	auto key = std::make_tuple(nsamples, backend, direction, numparts);
+	{
+		ScopedLock locker(m_cs);
+		removeExpiredEntries(m_plans);
+		if (auto existing = m_plans[key].lock())
+			return existing;
+	}
+	// The new plan is made without m_cs, so that the threads looking up the existing plans don't
+	// wait for the FFTW planner lock while the planner thread is measuring
+	std::shared_ptr<const FFTPlan> result;
+	if (numparts > 0)
+	{
+		// The parts are ordinary cached plans, so they get shared and measured like the others
+		auto subplan = getPlan(nsamples / numparts, direction, backend, 0);
+		result = std::make_shared<const ParallelFFTPlan>(nsamples, direction, subplan, m_workers);
+	}
+	else if (backend == FFTBackendType::FFTW)
+	{
+		// The estimated plan is quick to make (and uses any measured wisdom available), measuring
+		// is left to the planner thread so that it never happens on the audio or buffering threads
+		ScopedLock plannerlocker(m_plannercs);
+		destroyRetiredPlans();
+		result = std::shared_ptr<const FFTPlan>(FFTPlan::create(backend, nsamples, direction).release(),
+			[this](const FFTPlan* plan) { retirePlan(plan); });
+	}
+	else
+		result = FFTPlan::create(backend, nsamples, direction);
+	ScopedLock locker(m_cs);
+	// another thread may have made the same plan meanwhile, the one that was cached first is used
+	if (auto existing = m_plans[key].lock())
+		return existing;
+	m_plans[key] = result;
+	if (numparts == 0 && backend == FFTBackendType::FFTW && m_planningmode != FFTPlanningMode::Estimate)
+	{
+		m_pendingmeasurements.push_back(result);
+		notify();
+	}
+	return result;
+}
 
-    // scale
-    float scale = 1.f / nsamples;
-    vDSP_vsmul(data.data(), 1, &scale, smp.data(), 1, nsamples);
+void FFTPlanRegistry::retirePlan(const FFTPlan* plan)
+{
+	if (m_plannercs.tryEnter())
+	{
+		delete plan;
+		m_plannercs.exit();
+		return;
+	}
+	{
+		ScopedLock locker(m_cs);
+		m_retiredplans.push_back(plan);
+	}
+	notify();
+}
 
+void FFTPlanRegistry::destroyRetiredPlans()
+{
+	std::vector<const FFTPlan*> plans;
+	{
+		ScopedLock locker(m_cs);
+		std::swap(plans, m_retiredplans);
+	}
+	for (auto plan : plans)
+		delete plan;
+}
 
-#elif PS_USE_PFFFT
-    const int halfsamples = nsamples / 2;
-    auto * databuf = data.data();
+static void fillWindowTable(std::vector<REALTYPE>& table, FFTWindow type)
+{
+	const int nsamples = (int)table.size();
+	switch (type){
+		case W_RECTANGULAR:
+			for (int i=0;i<nsamples;i++) table[i]=0.707f;
+			break;
+		case W_HAMMING:
+			for (int i=0;i<nsamples;i++) table[i]=(float)(0.53836-0.46164*cos(2.0*c_PI*i/(nsamples+1.0)));
+			break;
+		case W_HANN:
+			for (int i=0;i<nsamples;i++) table[i]=(float)(0.5*(1.0-cos(2*c_PI*i/(nsamples-1.0))));
+			break;
+		case W_BLACKMAN:
+			for (int i=0;i<nsamples;i++) table[i]=(float)(0.42-0.5*cos(2*c_PI*i/(nsamples-1.0))+0.08*cos(4*c_PI*i/(nsamples-1.0)));
+			break;
+		case W_BLACKMAN_HARRIS:
+			for (int i=0;i<nsamples;i++) table[i]=(float)(0.35875-0.48829*cos(2*c_PI*i/(nsamples-1.0))+0.14128*cos(4*c_PI*i/(nsamples-1.0))-0.01168*cos(6*c_PI*i/(nsamples-1.0)));
+			break;
+	};
+}
 
-    for (int i=1; i < halfsamples; ++i)
-    {
-        unsigned int rand = m_randdist(m_randgen);
-        REALTYPE phase=rand*inv_2p15_2pi;
-        data[i*2] = freq[i]*cos(phase);
-        data[i*2+1] = freq[i]*sin(phase);
+std::shared_ptr<const FFTPlanRegistry::WindowTable> FFTPlanRegistry::getWindow(int nsamples, FFTWindow type)
+{
+	ScopedLock locker(m_cs);
+	removeExpiredEntries(m_windows);
+	auto key = std::make_tuple(nsamples, type);
+	if (auto existing = m_windows[key].lock())
+		return existing;
+	auto table = std::make_shared<WindowTable>(nsamples);
+	fillWindowTable(*table, type);
+	m_windows[key] = table;
+	return table;
+}
 
-    };
-    data[0] = data[1] = 0.0;
+int FFTPlanRegistry::getNumPlans()
+{
+	ScopedLock locker(m_cs);
+	removeExpiredEntries(m_plans);
+	return (int)m_plans.size();
+}
 
-    pffft_transform_ordered(planpffft, databuf, smp.data(), m_work.data(), PFFFT_BACKWARD);
+int FFTPlanRegistry::getNumWindows()
+{
+	ScopedLock locker(m_cs);
+	removeExpiredEntries(m_windows);
+	return (int)m_windows.size();
+}
 
-    // post scale
-    float scale = 1.f / nsamples;
-    FloatVectorOperations::multiply(smp.data(), scale, nsamples);
+std::shared_ptr<const OverlapAddTableCache::Table> OverlapAddTableCache::getTable(int bufsize)
+{
+	ScopedLock locker(m_cs);
+	removeExpiredEntries(m_tables);
+	if (auto existing = m_tables[bufsize].lock())
+		return existing;
+	auto table = std::make_shared<Table>();
+	table->newgain.resize(bufsize);
+	table->oldgain.resize(bufsize);
+	const double tmp = 1.0 / bufsize * c_PI;
+	const double hinv_sqrt2 = 0.853553390593;//(1.0+1.0/sqrt(2))*0.5;
+	const double ampfactor = 2.0;
+	for (int i = 0; i < bufsize; ++i)
+	{
+		// crossfade between the frames and removal of the amplitude modulation caused by the
+		// interference of the N and N+1 windowed buffers
+		const double a = 0.5 + 0.5 * cos(i * tmp);
+		const double demod = (hinv_sqrt2 - (1.0 - hinv_sqrt2) * cos(i * 2.0 * tmp)) * ampfactor;
+		table->newgain[i] = (float)((1.0 - a) * demod);
+		table->oldgain[i] = (float)(a * demod);
+	}
+	m_tables[bufsize] = table;
+	return table;
+}
 
-#else
+FFT::FFT(int nsamples_, bool no_inverse) : m_phasegen(nextFFTSeed())
+{
+	init(nsamples_, no_inverse, m_ownarena);
+	m_ownarena.allocate();
+};
 
+FFT::FFT(int nsamples_, BufferArena& arena, bool no_inverse) : m_phasegen(nextFFTSeed())
+{
+	init(nsamples_, no_inverse, arena);
+};
 
-    for (int i=1;i<nsamples/2;i++)
-    {
-        unsigned int rand = m_randdist(m_randgen);
-        REALTYPE phase=rand*inv_2p15_2pi;
-        data[i]=freq[i]*cos(phase);
-        data[nsamples-i]=freq[i]*sin(phase);
+void FFT::init(int nsamples_, bool no_inverse, BufferArena& arena)
+{
+    nsamples=nsamples_;
+	if (nsamples%2!=0) {
+		nsamples+=1;
+		Logger::writeToLog("WARNING: Odd sample size on FFT::FFT() "+String(nsamples));
+	};
+	window.type=W_RECTANGULAR;
+	window.data=m_planregistry->getWindow(nsamples,window.type);
 
-    };
-    data[0]=data[nsamples/2+1]=data[nsamples/2]=0.0;
+	// the inverse plan has to be of the same backend as the forward one, the
+	// spectrum layout of the scratch data differs between them
+	m_plan = m_planregistry->getPlan(nsamples, FFTDirection::Forward);
+	int scratchsize = m_plan->getScratchSize();
+	if (no_inverse == false)
+	{
+		m_inverseplan = m_planregistry->getPlan(nsamples, FFTDirection::Inverse, m_plan->getBackend());
+		scratchsize = std::max(scratchsize, m_inverseplan->getScratchSize());
+	}
+	arena.add(smp, nsamples);
+	arena.add(freq, nsamples/2+1);
+	arena.add(data, std::max(scratchsize, 1));
+}
 
-    fftwf_execute(planifftw);
+FFT::~FFT()
+{
+};
 
-    // post scale
-    float scale = 1.f / nsamples;
-    FloatVectorOperations::multiply(smp.data(), data.data(), scale, nsamples);
+void FFT::smp2freq()
+{
+	m_plan->forwardMagnitudes(smp.data(), freq.data(), data.data());
+};
 
-#endif
+void FFT::freq2smp()
+{
+	jassert(m_inverseplan != nullptr);
+	m_inverseplan->inverseRandomPhases(freq.data(), m_phasegen, smp.data(), data.data());
 };
 
-void FFT::applywindow(FFTWindow type)
+void FFT::setWindowType(FFTWindow type)
 {
 	if (window.type!=type){
 		window.type=type;
-		switch (type){
-			case W_RECTANGULAR:
-				for (int i=0;i<nsamples;i++) window.data[i]=0.707f;
-				break;
-			case W_HAMMING:
-				for (int i=0;i<nsamples;i++) window.data[i]=(float)(0.53836-0.46164*cos(2.0*c_PI*i/(nsamples+1.0)));
-				break;
-			case W_HANN:
-				for (int i=0;i<nsamples;i++) window.data[i]=(float)(0.5*(1.0-cos(2*c_PI*i/(nsamples-1.0))));
-				break;
-			case W_BLACKMAN:
-				for (int i=0;i<nsamples;i++) window.data[i]=(float)(0.42-0.5*cos(2*c_PI*i/(nsamples-1.0))+0.08*cos(4*c_PI*i/(nsamples-1.0)));
-				break;
-			case W_BLACKMAN_HARRIS:
-				for (int i=0;i<nsamples;i++) window.data[i]=(float)(0.35875-0.48829*cos(2*c_PI*i/(nsamples-1.0))+0.14128*cos(4*c_PI*i/(nsamples-1.0))-0.01168*cos(6*c_PI*i/(nsamples-1.0)));
-				break;
-
-		};
+		window.data=m_planregistry->getWindow(nsamples,type);
 	};
+}
 
+void FFT::applywindow(FFTWindow type)
+{
+	setWindowType(type);
     //for (int i=0;i<nsamples;i++) smp[i]*=window.data[i];
-    FloatVectorOperations::multiply(smp.data(), window.data.data(), nsamples);
+    FloatVectorOperations::multiply(smp.data(), window.data->data(), nsamples);
+}
+
+void FFT::setWindowedInput(const REALTYPE* first, int numfirst, const REALTYPE* rest, FFTWindow type)
+{
+	jassert(numfirst >= 0 && numfirst <= nsamples);
+	setWindowType(type);
+	const REALTYPE* w = window.data->data();
+	FloatVectorOperations::multiply(smp.data(), first, w, numfirst);
+	FloatVectorOperations::multiply(smp.data() + numfirst, rest, w + numfirst, nsamples - numfirst);
+}
+
+// Windowing goes through the batch in blocks of this many samples, small enough for the L1 cache
+static const int windowblocksize = 2048;
+
+void FFT::smp2freq(FFT* const* ffts, int count, FFTWindow type)
+{
+	const int n = ffts[0]->nsamples;
+	for (int i = 0; i < count; ++i)
+	{
+		jassert(ffts[i]->nsamples == n);
+		ffts[i]->setWindowType(type);
+	}
+	for (int start = 0; start < n; start += windowblocksize)
+	{
+		const int len = std::min(windowblocksize, n - start);
+		for (int i = 0; i < count; ++i)
+			FloatVectorOperations::multiply(ffts[i]->smp.data() + start, ffts[i]->window.data->data() + start, len);
+	}
+	smp2freq(ffts, count);
+}
+
+void FFT::smp2freq(FFT* const* ffts, int count)
+{
+	// Runs of FFTs with the same plan go to the plan as one batch, FFTs made before the
+	// number of FFT threads was changed may have a different one
+	FFTPlan::BatchItem items[maxbatchsize];
+	for (int first = 0; first < count;)
+	{
+		int num = 0;
+		for (; first + num < count && num < maxbatchsize && ffts[first + num]->m_plan == ffts[first]->m_plan; ++num)
+		{
+			FFT* fft = ffts[first + num];
+			items[num] = { fft->smp.data(), fft->freq.data(), fft->data.data(), &fft->m_phasegen };
+		}
+		ffts[first]->m_plan->forwardMagnitudesBatch(items, num);
+		first += num;
+	}
+}
+
+void FFT::freq2smp(FFT* const* ffts, int count)
+{
+	FFTPlan::BatchItem items[maxbatchsize];
+	for (int first = 0; first < count;)
+	{
+		int num = 0;
+		for (; first + num < count && num < maxbatchsize && ffts[first + num]->m_inverseplan == ffts[first]->m_inverseplan; ++num)
+		{
+			FFT* fft = ffts[first + num];
+			jassert(fft->m_inverseplan != nullptr);
+			items[num] = { fft->smp.data(), fft->freq.data(), fft->data.data(), &fft->m_phasegen };
+		}
+		ffts[first]->m_inverseplan->inverseRandomPhasesBatch(items, num);
+		first += num;
+	}
 }
 
 Stretch::Stretch(REALTYPE rap_,int /*bufsize_*/,FFTWindow w,bool bypass_,REALTYPE samplerate_,int /*stereo_mode_*/)
@@ -318,60 +762,53 @@ void Stretch::set_rap(REALTYPE newrap){
 };
 		
 void Stretch::do_analyse_inbuf(REALTYPE *smps){
-	//get the frequencies
-
-    FloatVectorOperations::copy(infft->smp.data(), old_smps.data(), bufsize);
-    FloatVectorOperations::copy(infft->smp.data()+bufsize, smps, bufsize);
+	//get the frequencies (the transform of infft is done by processBatch)
+	infft->setWindowedInput(get_inbuf_block(1), bufsize, smps, window_type);
     FloatVectorOperations::copy(old_freq.data(), infft->freq.data(), bufsize);
-    /*
-    for (int i=0;i<bufsize;i++) {
-		infft->smp[i]=old_smps[i];
-		infft->smp[i+bufsize]=smps[i];
-
-		old_freq[i]=infft->freq[i];
-	};
-     */
+};
 
-	infft->applywindow(window_type);
-	infft->smp2freq();
+void Stretch::do_analyse_previous_inbuf(){
+	//the input the last do_analyse_inbuf call would have had, before the block was added
+	infft->setWindowedInput(get_inbuf_block(0), bufsize, get_inbuf_block(2), window_type);
 };
 
 void Stretch::do_next_inbuf_smps(REALTYPE *smps){
-    FloatVectorOperations::copy(very_old_smps.data(), old_smps.data(), bufsize);
-    FloatVectorOperations::copy(old_smps.data(), new_smps.data(), bufsize);
-    FloatVectorOperations::copy(new_smps.data(), smps, bufsize);
-
-    /*
-    for (int i=0;i<bufsize;i++) {
-		very_old_smps[i]=old_smps[i];
-		old_smps[i]=new_smps[i];
-		new_smps[i]=smps[i];
-	};
-     */
+	//the new block replaces the oldest one
+	FloatVectorOperations::copy(inring.data() + inring_first * bufsize, smps, bufsize);
+	inring_first = (inring_first + 1) % 3;
 };
 
 REALTYPE Stretch::do_detect_onset(){
-	REALTYPE result=0.0;
-	if (onset_detection_sensitivity>1e-3){
-		REALTYPE os=0.0,osinc=0.0;
-		REALTYPE osincold=1e-5f;
-		int maxk=1+(int)(bufsize*500.0/(samplerate*0.5));
-		int k=0;
-		for (int i=0;i<bufsize;i++) {
-			osinc+=infft->freq[i]-old_freq[i];
-			osincold+=old_freq[i];
-			if (k>=maxk) {
-				k=0;
-				os+=osinc/osincold;
-				osinc=0;
-			};
-			k++;
+	if (onset_detection_sensitivity>1e-3)
+		return get_onset_from_strength(get_onset_strength(infft->freq.data(),old_freq.data(),bufsize,samplerate),onset_detection_sensitivity);
+	return 0.0;
+};
+
+REALTYPE Stretch::get_onset_strength(const REALTYPE *freq, const REALTYPE *old_freq, int bufsize, REALTYPE samplerate){
+	REALTYPE os=0.0,osinc=0.0;
+	REALTYPE osincold=1e-5f;
+	int maxk=1+(int)(bufsize*500.0/(samplerate*0.5));
+	int k=0;
+	for (int i=0;i<bufsize;i++) {
+		osinc+=freq[i]-old_freq[i];
+		osincold+=old_freq[i];
+		if (k>=maxk) {
+			k=0;
+			os+=osinc/osincold;
+			osinc=0;
 		};
-		os+=osinc;
-		if (os<0.0) os=0.0;
-		//if (os>1.0) os=1.0;
+		k++;
+	};
+	os+=osinc;
+	if (os<0.0) os=0.0;
+	//if (os>1.0) os=1.0;
+	return os;
+};
 
-		REALTYPE os_strength=(float)(pow(20.0,1.0-onset_detection_sensitivity)-1.0);
+REALTYPE Stretch::get_onset_from_strength(REALTYPE os, REALTYPE detection_sensitivity){
+	REALTYPE result=0.0;
+	if (detection_sensitivity>1e-3){
+		REALTYPE os_strength=(float)(pow(20.0,1.0-detection_sensitivity)-1.0);
 		REALTYPE os_strength_h=os_strength*0.75f;
 		if (os>os_strength_h){
 			result=(os-os_strength_h)/(os_strength-os_strength_h);
@@ -391,113 +828,275 @@ void Stretch::setBufferSize(int bufsize_)
 
 		if (bufsize < 8) bufsize = 8;
 
-		out_buf = floatvector(bufsize);
-		old_freq = floatvector(bufsize);
-
-		very_old_smps = floatvector(bufsize);
-		new_smps = floatvector(bufsize);
-		old_smps = floatvector(bufsize);
-
-		old_out_smps = floatvector(bufsize * 2);
-		infft = std::make_unique<FFT>(bufsize * 2);
-		fft = std::make_unique<FFT>(bufsize * 2);
-		outfft = std::make_unique<FFT>(bufsize * 2);
+		//lay out all the buffers and make the one allocation for them
+		BufferArena arena;
+		arena.add(out_buf, bufsize);
+		arena.add(old_freq, bufsize);
+		arena.add(inring, 3 * bufsize);
+		arena.add(old_out_smps, bufsize);
+		infft = std::make_unique<FFT>(bufsize * 2, arena);
+		fft = std::make_unique<FFT>(bufsize * 2, arena);
+		outfft = std::make_unique<FFT>(bufsize * 2, arena);
+		addBuffers(arena);
+		arena.allocate();
+		m_arena = std::move(arena);
 	}
+	else
+		m_arena.clear();
 	jassert(infft != nullptr && fft != nullptr && outfft != nullptr);
-	fill_container(outfft->smp, 0.0f);
-	for (int i = 0; i<bufsize * 2; i++) {
-		old_out_smps[i] = 0.0;
-	};
-	for (int i = 0; i<bufsize; i++) {
-		old_freq[i] = 0.0f;
-		new_smps[i] = 0.0f;
-		old_smps[i] = 0.0f;
-		very_old_smps[i] = 0.0f;
-	};
+	inring_first = 0;
+	m_overlapadd = m_overlapaddcache->getTable(bufsize);
+	inbuf_analysed = false;
+	frozen_spectrum_valid = false;
+	frame.step = FrameStep::Idle;
 }
 
 REALTYPE Stretch::process(REALTYPE *smps,int nsmps)
 {
+	Stretch* self = this;
+	REALTYPE onset = 0.0;
+	processBatch(&self, &smps, 1, nsmps, &onset);
+	return onset;
+};
+
+bool Stretch::canBatchWith(const Stretch& other) const
+{
+	return bufsize == other.bufsize && window_type == other.window_type && bypass == other.bypass;
+}
+
+void Stretch::processBatch(Stretch* const* stretchers, REALTYPE* const* smps, int count, int nsmps, REALTYPE* onsets)
+{
+	if (count > FFT::maxbatchsize)
+	{
+		processBatch(stretchers, smps, FFT::maxbatchsize, nsmps, onsets);
+		processBatch(stretchers + FFT::maxbatchsize, smps + FFT::maxbatchsize, count - FFT::maxbatchsize, nsmps, onsets + FFT::maxbatchsize);
+		return;
+	}
+	Stretch* const first = stretchers[0];
+	for (int i = 1; i < count; ++i)
+	{
+		if (first->canBatchWith(*stretchers[i]) == false || (smps[i] == NULL) != (smps[0] == NULL))
+		{
+			for (int j = 0; j < count; ++j)
+				onsets[j] = stretchers[j]->process(smps[j], nsmps);
+			return;
+		}
+	}
+	const int bufsize = first->bufsize;
 	jassert(bufsize > 0);
-	REALTYPE onset=0.0;
-	if (bypass){
-        //for (int i=0;i<bufsize;i++) out_buf[i]=smps[i];
-        FloatVectorOperations::copy(out_buf.data(), smps, bufsize);
-		return 0.0;
+	for (int i = 0; i < count; ++i)
+		onsets[i] = 0.0;
+	if (first->bypass){
+		for (int i = 0; i < count; ++i)
+			FloatVectorOperations::copy(stretchers[i]->out_buf.data(), smps[i], bufsize);
+		return;
 	};
 
-	if (smps!=NULL){
-		if ((nsmps!=0)&&(nsmps!=bufsize)&&(nsmps!=get_max_bufsize())){
+	FFT* ffts[FFT::maxbatchsize];
+	if (smps[0]!=NULL){
+		if ((nsmps!=0)&&(nsmps!=bufsize)&&(nsmps!=first->get_max_bufsize())){
 			printf("Warning wrong nsmps on Stretch::process() %d,%d\n",nsmps,bufsize);
-			return 0.0;
+			return;
 		};
 		if (nsmps!=0){//new data arrived: update the frequency components
-			do_analyse_inbuf(smps);		
-			if (nsmps==get_max_bufsize()) {
-				for (int k=bufsize;k<get_max_bufsize();k+=bufsize) do_analyse_inbuf(smps+k);
-			};
-			if (onset_detection_sensitivity>1e-3) onset=do_detect_onset();
-		};
-
-
-		//move the buffers	
-		if (nsmps!=0){//new data arrived: update the frequency components
-			do_next_inbuf_smps(smps);		
-			if (nsmps==get_max_bufsize()) {
-				for (int k=bufsize;k<get_max_bufsize();k+=bufsize) do_next_inbuf_smps(smps+k);
+			do_analyse_batch(stretchers, smps, count, nsmps, onsets);
 
-			};
+			//move the buffers	
+			for (int i = 0; i < count; ++i)
+				for (int k = 0; k < nsmps; k += bufsize)
+					stretchers[i]->do_next_inbuf_smps(smps[i] + k);
 		};
-	
-		//construct the input fft
-		int start_pos=(int)(floor(remained_samples*bufsize));	
-		if (start_pos>=bufsize) start_pos=bufsize-1;
-
-        FloatVectorOperations::copy(fft->smp.data(), very_old_smps.data() + start_pos, bufsize-start_pos);
-        FloatVectorOperations::copy(fft->smp.data() + (bufsize - start_pos), old_smps.data() , bufsize);
-        FloatVectorOperations::copy(fft->smp.data() + (2*bufsize - start_pos), new_smps.data() , start_pos);
-
-        /*
-		for (int i=0;i<bufsize-start_pos;i++) fft->smp[i]=very_old_smps[i+start_pos];
-		for (int i=0;i<bufsize;i++) fft->smp[i+bufsize-start_pos]=old_smps[i];
-		for (int i=0;i<start_pos;i++) fft->smp[i+2*bufsize-start_pos]=new_smps[i];
-         */
 
 		//compute the output spectrum
-		fft->applywindow(window_type);
-		fft->smp2freq();
-
-        //for (int i=0;i<bufsize;i++) outfft->freq[i]=fft->freq[i];
-        FloatVectorOperations::copy(outfft->freq.data(), fft->freq.data(), bufsize);
-
-
-
-		//for (int i=0;i<bufsize;i++) outfft->freq[i]=infft->freq[i]*remained_samples+old_freq[i]*(1.0-remained_samples);
-
+		int numforward = 0;
+		for (int i = 0; i < count; ++i)
+			if (stretchers[i]->do_prepare_fft_input(nsmps))
+				ffts[numforward++] = stretchers[i]->fft.get();
+		if (numforward > 0)
+			FFT::smp2freq(ffts, numforward);
+
+		for (int i = 0; i < count; ++i)
+		{
+			Stretch* s = stretchers[i];
+			//for (int i=0;i<bufsize;i++) outfft->freq[i]=fft->freq[i];
+			FloatVectorOperations::copy(s->outfft->freq.data(), s->fft->freq.data(), bufsize);
+
+			//for (int i=0;i<bufsize;i++) outfft->freq[i]=infft->freq[i]*remained_samples+old_freq[i]*(1.0-remained_samples);
+
+			s->process_spectrum(s->outfft->freq.data());
+			ffts[i] = s->outfft.get();
+		}
+		FFT::freq2smp(ffts, count);
+
+		for (int i = 0; i < count; ++i)
+			stretchers[i]->do_make_out_buf();
+	};
 
-		process_spectrum(outfft->freq.data());
+	for (int i = 0; i < count; ++i)
+		stretchers[i]->do_advance_position();
+}
 
-		outfft->freq2smp();
+void Stretch::do_analyse_batch(Stretch* const* stretchers, REALTYPE* const* smps, int count, int nsmps, REALTYPE* onsets)
+{
+	//the spectrum of the input is only used by the onset detection, so it's computed only while that is on
+	int analysed[FFT::maxbatchsize];
+	int numanalysed = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		if (stretchers[i]->onset_detection_sensitivity>1e-3)
+			analysed[numanalysed++] = i;
+		else
+			stretchers[i]->inbuf_analysed = false;
+	}
+	if (numanalysed == 0)
+		return;
+	const int bufsize = stretchers[0]->bufsize;
+	const int numchunks = (nsmps + bufsize - 1) / bufsize;
+	FFT* ffts[FFT::maxbatchsize];
+	if (numchunks == 1)
+	{
+		//the onset detection was just switched on: redo the analysis of the previous input first
+		int numwarmups = 0;
+		for (int j = 0; j < numanalysed; ++j)
+		{
+			Stretch* s = stretchers[analysed[j]];
+			if (s->inbuf_analysed == false)
+			{
+				s->do_analyse_previous_inbuf();
+				ffts[numwarmups++] = s->infft.get();
+			}
+		}
+		if (numwarmups > 0)
+			FFT::smp2freq(ffts, numwarmups);
+	}
+	//only the last two spectra get compared, so the earlier chunks of a larger fill can be skipped
+	for (int k = jmax(0, numchunks - 2) * bufsize; k < nsmps; k += bufsize)
+	{
+		for (int j = 0; j < numanalysed; ++j)
+		{
+			Stretch* s = stretchers[analysed[j]];
+			s->do_analyse_inbuf(smps[analysed[j]] + k);
+			ffts[j] = s->infft.get();
+		}
+		FFT::smp2freq(ffts, numanalysed);
+	}
+	for (int j = 0; j < numanalysed; ++j)
+	{
+		Stretch* s = stretchers[analysed[j]];
+		s->inbuf_analysed = true;
+		onsets[analysed[j]] = s->do_detect_onset();
+	}
+}
 
-		//make the output buffer
-		REALTYPE tmp=(float)(1.0/(float) bufsize*c_PI);
-		REALTYPE hinv_sqrt2=0.853553390593f;//(1.0+1.0/sqrt(2))*0.5;
+bool Stretch::do_prepare_fft_input(int nsmps)
+{
+	//while freezing the input doesn't change, so its spectrum is kept
+	spectrum_input_unchanged = freezing && frozen_spectrum_valid && nsmps == 0 && frozen_window == window_type;
+	frozen_spectrum_valid = freezing;
+	frozen_window = window_type;
+	if (spectrum_input_unchanged)
+		return false;
+	do_construct_fft_input();
+	return true;
+}
 
-		REALTYPE ampfactor=2.0f;
+void Stretch::beginFrame(REALTYPE *smps, int nsmps)
+{
+	frame.smps = smps;
+	frame.nsmps = nsmps;
+	frame.onset = 0.0;
+	frame.step = FrameStep::Input;
+}
 
-		//remove the resulted unwanted amplitude modulation (caused by the interference of N and N+1 windowed buffer and compute the output buffer
-		for (int i=0;i<bufsize;i++) {
-			REALTYPE a=(float)((0.5+0.5*cos(i*tmp)));
-			REALTYPE out=(float)(outfft->smp[i+bufsize]*(1.0-a)+old_out_smps[i]*a);
-			out_buf[i]=(float)(out*(hinv_sqrt2-(1.0-hinv_sqrt2)*cos(i*2.0*tmp))*ampfactor);
+bool Stretch::runFrameStep()
+{
+	Stretch* self = this;
+	FFT* fftptr = nullptr;
+	switch (frame.step)
+	{
+	case FrameStep::Input:
+		if (bypass){
+			FloatVectorOperations::copy(out_buf.data(), frame.smps, bufsize);
+			frame.step = FrameStep::Idle;
+			return true;
+		};
+		if (frame.smps == NULL){
+			frame.step = FrameStep::Output;
+			return false;
+		};
+		if ((frame.nsmps!=0)&&(frame.nsmps!=bufsize)&&(frame.nsmps!=get_max_bufsize())){
+			printf("Warning wrong nsmps on Stretch::process() %d,%d\n",frame.nsmps,bufsize);
+			frame.step = FrameStep::Idle;
+			return true;
 		};
+		if (frame.nsmps!=0){
+			do_analyse_batch(&self, &frame.smps, 1, frame.nsmps, &frame.onset);
+			for (int k = 0; k < frame.nsmps; k += bufsize)
+				do_next_inbuf_smps(frame.smps + k);
+		};
+		frame.step = FrameStep::Forward;
+		return false;
+	case FrameStep::Forward:
+		if (do_prepare_fft_input(frame.nsmps)){
+			fftptr = fft.get();
+			FFT::smp2freq(&fftptr, 1);
+		};
+		FloatVectorOperations::copy(outfft->freq.data(), fft->freq.data(), bufsize);
+		frame.spectrumstep = 0;
+		frame.numspectrumsteps = begin_spectrum_steps();
+		frame.step = frame.numspectrumsteps > 0 ? FrameStep::Spectrum : FrameStep::Inverse;
+		return false;
+	case FrameStep::Spectrum:
+		process_spectrum_step(outfft->freq.data(), frame.spectrumstep);
+		if (++frame.spectrumstep == frame.numspectrumsteps)
+			frame.step = FrameStep::Inverse;
+		return false;
+	case FrameStep::Inverse:
+		fftptr = outfft.get();
+		FFT::freq2smp(&fftptr, 1);
+		do_make_out_buf();
+		frame.step = FrameStep::Output;
+		return false;
+	case FrameStep::Output:
+		do_advance_position();
+		frame.step = FrameStep::Idle;
+		return true;
+	case FrameStep::Idle:
+		break;
+	}
+	return true;
+}
 
-		//copy the current output buffer to old buffer
-        //for (int i=0;i<bufsize*2;i++) old_out_smps[i]=outfft->smp[i];
-        FloatVectorOperations::copy(old_out_smps.data(), outfft->smp.data(), 2*bufsize);
+void Stretch::do_construct_fft_input()
+{
+	//construct the input fft
+	int start_pos=(int)(floor(remained_samples*bufsize));	
+	if (start_pos>=bufsize) start_pos=bufsize-1;
+
+	//the 2*bufsize samples from start_pos of the oldest block, which wrap around the end of the ring at most once
+	const int ringsize = 3 * bufsize;
+	const int first = (inring_first * bufsize + start_pos) % ringsize;
+	const int numfirst = std::min(2 * bufsize, ringsize - first);
+	fft->setWindowedInput(inring.data() + first, numfirst, inring.data(), window_type);
+}
 
-	};
+void Stretch::do_make_out_buf()
+{
+	//make the output buffer: crossfade with the previous frame, de-modulation and gain in one pass
+	const REALTYPE* newgain = m_overlapadd->newgain.data();
+	const REALTYPE* oldgain = m_overlapadd->oldgain.data();
+	const REALTYPE* newsmps = outfft->smp.data() + bufsize;
+	const REALTYPE* oldsmps = old_out_smps.data();
+	REALTYPE* out = out_buf.data();
+	for (int i=0;i<bufsize;i++)
+		out[i]=newsmps[i]*newgain[i]+oldsmps[i]*oldgain[i];
+
+	//copy the current output buffer to old buffer, only its first half gets used
+	FloatVectorOperations::copy(old_out_smps.data(), outfft->smp.data(), bufsize);
+}
 
+void Stretch::do_advance_position()
+{
 	if (!freezing){
 		long double used_rap=rap*get_stretch_multiplier(c_pos_percents);	
 
@@ -522,8 +1121,7 @@ REALTYPE Stretch::process(REALTYPE *smps,int nsmps)
 	};
 //	long double rf_test=remained_samples-old_remained_samples_test;//this value should be almost like "rf" (for most of the time with the exception of changing the "ri" value) for extremely long stretches (otherwise the shown stretch value is not accurate)
 	//for stretch up to 10^18x "long double" must have at least 64 bits in the fraction part (true for gcc compiler on x86 and macosx)
-	return onset;	
-};
+}
 
 void Stretch::set_onset_detection_sensitivity(REALTYPE detection_sensitivity) 
 {
@@ -21,177 +21,181 @@
 #pragma once
 
 #include "globals.h"
+#include "FFTBackend.h"
+#include <map>
+#include <tuple>
 
-#ifndef PS_USE_VDSP_FFT
-#define PS_USE_VDSP_FFT 0
-#endif
 
-#ifndef PS_USE_PFFFT
-#define PS_USE_PFFFT 0
-#endif
-
-#if PS_USE_VDSP_FFT
-#elif PS_USE_PFFFT
-#include "../pffft/pffft.h"
-#else
-#include "fftw3.h"
-#endif
-
-
-
-#include "../JuceLibraryCode/JuceHeader.h"
-#include <random>
-#include <type_traits>
+enum FFTWindow{W_RECTANGULAR,W_HAMMING,W_HANN,W_BLACKMAN,W_BLACKMAN_HARRIS};
 
+// Process wide cache of FFT plans, keyed by (size, backend, direction), and of window tables,
+// keyed by (size, window type). Entries are reference counted, they stay alive as long as some
+// FFT object uses them and get released when the last user goes away. All the Stretch
+// instances of all the plugin instances (and the offline render) share the same copies.
+// With FFTW, new plans are first made with FFTW_ESTIMATE and in the Measure/Patient modes
+// a background thread then makes a measured plan and swaps it in. The accumulated FFTW
+// wisdom is loaded from and saved to the wisdom file, so measuring a size is only done once.
+// A measurement holds the FFTW planner lock for seconds, so getPlan, which makes new plans
+// with that lock, is only called off the audio thread, and the FFTW plans nobody uses
+// anymore are left to the planner thread to destroy while it's measuring.
+// When more than one backend is available, the backend for each size comes from the backend
+// table, which the autotuner fills by timing the backends against each other.
+// With more than one FFT thread, the transforms of the largest sizes are split into parts
+// that run on the worker threads at the same time (see ParallelFFTPlan).
+class FFTPlanRegistry : private Thread
+{
+public:
+	using WindowTable = std::vector<REALTYPE>;
+	using BackendTable = std::map<int, FFTBackendType>;
+	// Milliseconds a forward and an inverse transform of each size take with its backend
+	using SizeTimingTable = std::map<int, float>;
+	FFTPlanRegistry();
+	~FFTPlanRegistry();
+	// Making a new FFTW plan can wait for a measurement, see above
+	std::shared_ptr<const FFTPlan> getPlan(int nsamples, FFTDirection direction);
+	std::shared_ptr<const FFTPlan> getPlan(int nsamples, FFTDirection direction, FFTBackendType backend);
+	std::shared_ptr<const WindowTable> getWindow(int nsamples, FFTWindow type);
+	int getNumPlans();
+	int getNumWindows();
+	// The wisdom file is loaded the first time a file is set, an empty File disables the loading and saving
+	void setPlanningMode(FFTPlanningMode mode, File wisdomfile);
+	FFTPlanningMode getPlanningMode() const { return m_planningmode; }
+	int getNumPendingMeasurements();
+
+	FFTBackendType getBackendForSize(int nsamples);
+	// Sizes missing from the table use the first available backend that supports them,
+	// in the order FFTW, vDSP, pffft
+	void setBackendTable(const BackendTable& table);
+	BackendTable getBackendTable();
+	static String backendTableToString(const BackendTable& table);
+	static BackendTable backendTableFromString(const String& str);
+	// Times the available backends at the sizes that more than one backend supports, on the
+	// planner thread. The completion is called there when all the sizes have been done, the
+	// results are put into the backend table before that.
+	void startBackendAutotune(std::vector<int> sizes, std::function<void(const BackendTable&)> completion);
+	bool isAutotuneRunning();
+
+	// Adds the timings of the table to the ones there are. The changed function is called on the
+	// planner thread with the whole table, after the sizes that getFastestSize asked for have been timed.
+	void setSizeTimings(const SizeTimingTable& table, std::function<void(const SizeTimingTable&)> changed);
+	SizeTimingTable getSizeTimings();
+	static String sizeTimingsToString(const SizeTimingTable& table);
+	static SizeTimingTable sizeTimingsFromString(const String& str);
+	// The size with the lowest time per sample, 0 when some of the sizes haven't been timed yet.
+	// Those are timed on the planner thread, and getSizeTimingsVersion changes when that's done.
+	// It can start the planner thread, so don't call it on the audio thread.
+	int getFastestSize(const std::vector<int>& sizes);
+	int getSizeTimingsVersion() const { return m_sizetimingsversion.load(); }
+
+	// Threads that the largest transforms are split over, 1 doesn't split them. Only the plans
+	// made after this use the new number of parts, the existing ones keep working with theirs.
+	void setNumFFTThreads(int numthreads);
+	int getNumFFTThreads() const { return m_workers.getNumThreads(); }
+	// How many times faster a split transform of getParallelSpeedupSize() samples is than a
+	// single threaded one. Timed on the planner thread after the number of threads changes,
+	// 0 until that's done or when the transforms aren't split.
+	float getParallelSpeedup() const { return m_parallelspeedup.load(); }
+	static int getParallelSpeedupSize() { return 1 << 20; }
+private:
+	void run() override;
+	void saveWisdom();
+	void wakePlannerThread();
+	void autotuneSize(int nsamples);
+	void timeSize(int nsamples);
+	void measureParallelSpeedup();
+	std::shared_ptr<const FFTPlan> getPlan(int nsamples, FFTDirection direction, FFTBackendType backend, int numparts);
+	// the deleter of the FFTW plans, never waits for the planner lock
+	void retirePlan(const FFTPlan* plan);
+	// call with m_plannercs held
+	void destroyRetiredPlans();
+	BackendTable m_backendtable;
+	std::vector<int> m_autotunesizes;
+	BackendTable m_autotuneresults;
+	std::function<void(const BackendTable&)> m_autotunecompletion;
+	SizeTimingTable m_sizetimings;
+	std::vector<int> m_sizetimingqueue;
+	std::function<void(const SizeTimingTable&)> m_sizetimingschanged;
+	std::atomic<int> m_sizetimingsversion{ 0 };
+	CriticalSection m_cs;
+	// FFTW planner calls aren't thread safe, all of them are done with this held. It's never
+	// waited for with m_cs held.
+	CriticalSection m_plannercs;
+	// the FFTW plans that were released while m_plannercs was held, destroyed by the planner thread
+	std::vector<const FFTPlan*> m_retiredplans;
+	std::atomic<FFTPlanningMode> m_planningmode{ FFTPlanningMode::Estimate };
+	File m_wisdomfile;
+	bool m_wisdomloaded = false;
+	std::atomic<bool> m_wisdomchanged{ false };
+	std::vector<std::weak_ptr<const FFTPlan>> m_pendingmeasurements;
+	FFTWorkerPool m_workers;
+	std::atomic<float> m_parallelspeedup{ 0.0f };
+	bool m_speedupmeasurementpending = false;
+	// the last key is the number of parts the transform is split into, 0 when it isn't
+	std::map<std::tuple<int, FFTBackendType, FFTDirection, int>, std::weak_ptr<const FFTPlan>> m_plans;
+	std::map<std::tuple<int, FFTWindow>, std::weak_ptr<const WindowTable>> m_windows;
+};
 
-template<typename T>
-class FFTWBuffer
+// The gains of the new and the previous frame in the overlap-add of Stretch::process, with the
+// de-modulation and the output gain folded in, one table per buffer size shared by all the
+// stretchers. The tables are released when no stretcher uses them.
+class OverlapAddTableCache
 {
 public:
-    FFTWBuffer()
-    {
-        static_assert(std::is_floating_point<T>::value,"FFTWBuffer only works with floating point types");
-    }
-    ~FFTWBuffer()
-    {
-        freeimpl(m_buf);
-    }
-    void resize(int size, bool clear)
-    {
-        // come on, zero size doesn't make sense!
-        jassert(size>0);
-        if (size==m_size && clear==false)
-            return;
-        if (m_buf)
-            freeimpl(m_buf);
-        mallocimpl(m_buf,size);
-        
-        if (clear)
-            for (int i=0;i<size;++i)
-                m_buf[i]=T();
-        m_size = size;
-    }
-	
-	T& operator[](int index) 
-	{ 
-		jassert(index >= 0 && index < m_size); 
-		return m_buf[index]; 
-	}
-	const T& operator[](int index) const 
-	{ 
-		jassert(index >= 0 && index < m_size); 
-		return m_buf[index];
-	}
-	
-    T* data()
-    {
-        // callers to this will likely just blow themselves up if they get a nullptr back
-        jassert(m_buf!=nullptr);
-        return m_buf;
-    }
-    int getSize() { return m_size; }
-    FFTWBuffer(FFTWBuffer&& other) : m_buf(other.m_buf), m_size(other.m_size) 
+	struct Table
 	{
-		other.m_buf = nullptr;
-		other.m_size = 0;
-	}
-	FFTWBuffer& operator = (FFTWBuffer&& other)
-	{
-		std::swap(other.m_buf, m_buf);
-		std::swap(other.m_size, m_size);
-		return *this;
-	}
-	// These buffers probably shouldn't be copied anywhere, so just disallow that for now
-	FFTWBuffer(const FFTWBuffer&) = delete;
-	FFTWBuffer& operator = (const FFTWBuffer&) = delete;
+		std::vector<REALTYPE> newgain, oldgain;
+	};
+	std::shared_ptr<const Table> getTable(int bufsize);
 private:
-    T* m_buf = nullptr;
-    int m_size = 0;
-    void mallocimpl(T*& buf,int size)
-    {
-#if PS_USE_VDSP_FFT
-        // malloc aligns properly on vdsp platforms
-        if constexpr (std::is_same<T,float>::value)
-            buf = (float*)malloc(size*sizeof(float));
-        else
-            buf = (double*)malloc(size * sizeof(double));
-#elif PS_USE_PFFFT
-        if constexpr (std::is_same<T,float>::value)
-            buf = (float*)pffft_aligned_malloc(size*sizeof(float));
-        else
-            buf = (double*)pffft_aligned_malloc(size * sizeof(double));
-#else
-        if constexpr (std::is_same<T,float>::value)
-			buf = (float*)fftwf_malloc(size*sizeof(float));
-		else
-			buf = (double*)fftw_malloc(size * sizeof(double));
-#endif
-    }
-	void freeimpl(T*& buf)
-    {
-        if (buf!=nullptr)
-        {
-#if PS_USE_VDSP_FFT
-			if constexpr (std::is_same<T, float>::value)
-				free(buf);
-			else
-				free(buf);
-#elif PS_USE_PFFFT
-            if constexpr (std::is_same<T, float>::value)
-                pffft_aligned_free(buf);
-            else
-                pffft_aligned_free(buf);
-#else
-            if constexpr (std::is_same<T, float>::value)
-                fftwf_free(buf);
-            else
-                fftw_free(buf);
-#endif
-			buf = nullptr;
-        }
-    }
+	CriticalSection m_cs;
+	std::map<int, std::weak_ptr<const Table>> m_tables;
 };
 
-enum FFTWindow{W_RECTANGULAR,W_HAMMING,W_HANN,W_BLACKMAN,W_BLACKMAN_HARRIS};
-
 class FFT
 {//FFT class that considers phases as random
 	public:
 		FFT(int nsamples_, bool no_inverse=false);//samples must be even
+		// The buffers are added to the arena, which the caller allocates after this
+		FFT(int nsamples_, BufferArena& arena, bool no_inverse=false);
 		~FFT();
 		void smp2freq();//input is smp, output is freq (phases are discarded)
 		void freq2smp();//input is freq,output is smp (phases are random)
 		void applywindow(FFTWindow type);
-		std::vector<REALTYPE> smp;//size of samples/2
-		std::vector<REALTYPE> freq;//size of samples
+		// Puts the window applied to the samples of first followed by those of rest into smp,
+		// in one pass. rest has the nsamples - numfirst samples after the first ones.
+		void setWindowedInput(const REALTYPE* first, int numfirst, const REALTYPE* rest, FFTWindow type);
+		// smp2freq and freq2smp of several FFTs of the same size as batches. The window is applied
+		// to all of them a block at a time, so that the window table is read once for the batch.
+		static void smp2freq(FFT* const* ffts, int count, FFTWindow type);
+		// smp2freq of FFTs that got their windowed input from setWindowedInput
+		static void smp2freq(FFT* const* ffts, int count);
+		static void freq2smp(FFT* const* ffts, int count);
+		static constexpr int maxbatchsize = 32;
+		// smp and freq are SIMD aligned, the FFT backends read and write them directly
+		ArenaBuffer smp;//size of samples
+		ArenaBuffer freq;//size of samples/2+1
 		
 		
 		int nsamples=0;
 
-		
+		FFTBackendType getBackend() const { return m_plan->getBackend(); }
 
 	private:
-
-#if PS_USE_VDSP_FFT
-        void * planfft;
-        int log2N;
-        FFTWBuffer<REALTYPE> m_workReal;
-        FFTWBuffer<REALTYPE> m_workImag;
-#elif PS_USE_PFFFT
-        PFFFT_Setup *planpffft = nullptr;
-        FFTWBuffer<REALTYPE> m_work;
-#else
-        fftwf_plan planfftw,planifftw;
-#endif
-        FFTWBuffer<REALTYPE> data;
+		void init(int nsamples_, bool no_inverse, BufferArena& arena);
+		void setWindowType(FFTWindow type);
+		SharedResourcePointer<FFTPlanRegistry> m_planregistry;
+		std::shared_ptr<const FFTPlan> m_plan, m_inverseplan;
+		// work area of the plans
+        ArenaBuffer data;
+		// the memory of the buffers when the FFT isn't in an arena of its owner
+		BufferArena m_ownarena;
 		
 		struct{
-			std::vector<REALTYPE> data;
+			std::shared_ptr<const FFTPlanRegistry::WindowTable> data;
 			FFTWindow type;
 		}window;
 
-        std::mt19937 m_randgen;
-        std::uniform_int_distribution<unsigned int> m_randdist{0,32767};
+        RandomPhaseGenerator m_phasegen;
     
 		
 };
@@ -210,17 +214,28 @@ class Stretch
 			return bufsize;
 		};
 		virtual void setBufferSize(int sz);
+		// bytes of the working buffers
+		int64 getMemoryUsage() const { return (int64)m_arena.getSize() * (int64)sizeof(REALTYPE); }
 		REALTYPE get_onset_detection_sensitivity(){
 			return onset_detection_sensitivity;
 		};
 
 		REALTYPE process(REALTYPE *smps,int nsmps);//returns the onset value
+		// process of each of the stretchers with smps[i] and onsets[i], with the FFTs of all of
+		// them done as batches when they have the same buffer size and window
+		static void processBatch(Stretch* const* stretchers, REALTYPE* const* smps, int count, int nsmps, REALTYPE* onsets);
+		// process split into steps, to spread the work of a frame over several calls. beginFrame
+		// takes the arguments of process and smps has to stay valid until the frame is done.
+		void beginFrame(REALTYPE *smps, int nsmps);
+		// runs the next step of the frame, returns true when the frame is done
+		bool runFrameStep();
+		REALTYPE getFrameOnset() const { return frame.onset; }
 		void set_freezing(bool new_freezing){
 			freezing=new_freezing;
 		};
 		bool isFreezing() { return freezing; }
 		
-		std::vector<REALTYPE> out_buf;//pot sa pun o variabila "max_out_bufsize" si asta sa fie marimea lui out_buf si pe out_bufsize sa il folosesc ca marime adaptiva
+		ArenaBuffer out_buf;//pot sa pun o variabila "max_out_bufsize" si asta sa fie marimea lui out_buf si pe out_bufsize sa il folosesc ca marime adaptiva
 
 		int get_nsamples(REALTYPE current_pos_percents);//how many samples are required 
 		int get_nsamples_for_fill();//how many samples are required to be added for a complete buffer refill (at start of the song or after seek)
@@ -230,6 +245,10 @@ class Stretch
 
 		void set_onset_detection_sensitivity(REALTYPE detection_sensitivity);;
 		void here_is_onset(REALTYPE onset);
+		// The onset detection in two parts: how much the spectrum of the input grew from old_freq to
+		// freq, and the onset value for here_is_onset that gives with the sensitivity
+		static REALTYPE get_onset_strength(const REALTYPE *freq, const REALTYPE *old_freq, int bufsize, REALTYPE samplerate);
+		static REALTYPE get_onset_from_strength(REALTYPE strength, REALTYPE detection_sensitivity);
 		virtual void setSampleRate(REALTYPE sr) { samplerate = jlimit(1000.0f, 384000.0f, sr); }
 		REALTYPE getSampleRate() { return samplerate; }
 		FFTWindow window_type;
@@ -237,29 +256,72 @@ class Stretch
 		int bufsize=0;
 
 		virtual void process_spectrum(REALTYPE *){};
+		// the spectrum processing as steps for runFrameStep: begin_spectrum_steps returns the
+		// number of steps, which process_spectrum_step then does one at a time on the same freq
+		virtual int begin_spectrum_steps() { return 1; }
+		virtual void process_spectrum_step(REALTYPE *freq, int /*step*/) { process_spectrum(freq); }
+		// adds the buffers of the derived class to the arena of the stretcher, they are cleared
+		// on every setBufferSize
+		virtual void addBuffers(BufferArena&) {}
 		virtual REALTYPE get_stretch_multiplier(REALTYPE pos_percents);
 		REALTYPE samplerate=0.0f;
+		SharedResourcePointer<FFTPlanRegistry> m_planregistry;
+		// true when process_spectrum gets the same input spectrum as in the previous call, which
+		// happens while freezing, when the forward FFT of the unchanging input is skipped
+		bool spectrum_input_unchanged=false;
 		
 	private:
 
 		void do_analyse_inbuf(REALTYPE *smps);
+		void do_analyse_previous_inbuf();
 		void do_next_inbuf_smps(REALTYPE *smps);
 		REALTYPE do_detect_onset();
+		// the steps of process between the batched FFTs
+		bool canBatchWith(const Stretch& other) const;
+		static void do_analyse_batch(Stretch* const* stretchers, REALTYPE* const* smps, int count, int nsmps, REALTYPE* onsets);
+		// returns false when the spectrum of the frozen input is still in fft->freq
+		bool do_prepare_fft_input(int nsmps);
+		void do_construct_fft_input();
+		void do_make_out_buf();
+		void do_advance_position();
 
 //		REALTYPE *in_pool;//de marimea in_bufsize
 		REALTYPE rap,onset_detection_sensitivity;
-		std::vector<REALTYPE> old_out_smps;
-		std::vector<REALTYPE> old_freq;
-		std::vector<REALTYPE> new_smps,old_smps,very_old_smps;
+		// all the working buffers, including those of the FFTs, are in one allocation
+		BufferArena m_arena;
+		ArenaBuffer old_out_smps;
+		ArenaBuffer old_freq;
+		// infft->freq holds the spectrum of the last input, false while the onset detection is off
+		bool inbuf_analysed = false;
+		// fft->freq holds the spectrum of the frozen input, made with frozen_window
+		bool frozen_spectrum_valid = false;
+		FFTWindow frozen_window = W_RECTANGULAR;
+		// the last three blocks of input, the oldest one starts at block inring_first
+		ArenaBuffer inring;
+		int inring_first = 0;
+		// age 0 is the oldest block, 2 the newest
+		const REALTYPE* get_inbuf_block(int age) const { return inring.data() + ((inring_first + age) % 3) * bufsize; }
 
 		std::unique_ptr<FFT> infft,outfft;
 		std::unique_ptr<FFT> fft;
+		SharedResourcePointer<OverlapAddTableCache> m_overlapaddcache;
+		std::shared_ptr<const OverlapAddTableCache::Table> m_overlapadd;
 		long double remained_samples;//0..1
 		long double extra_onset_time_credit;
 		REALTYPE c_pos_percents;
 		int skip_samples;
 		bool require_new_buffer;
 		bool bypass,freezing;
+		enum class FrameStep { Idle, Input, Forward, Spectrum, Inverse, Output };
+		struct
+		{
+			REALTYPE *smps = nullptr;
+			int nsmps = 0;
+			REALTYPE onset = 0.0f;
+			FrameStep step = FrameStep::Idle;
+			int spectrumstep = 0;
+			int numspectrumsteps = 0;
+		} frame;
 	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(Stretch)
 };
 
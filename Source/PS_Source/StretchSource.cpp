@@ -19,6 +19,47 @@ std::vector<SpectrumProcessType> g_specorderpresets[3] = {
 	{SPT_RatioMix,SPT_PitchShift,SPT_Harmonics,SPT_FreqShift,SPT_Spread,SPT_TonalVsNoise,SPT_Filter,SPT_FreeFilter,SPT_Compressor}
 };
 
+class StretchAudioSource::FrameWorker : public Thread
+{
+public:
+	FrameWorker(StretchAudioSource& owner_) : Thread("PaulXFrameWorker"), owner(owner_) {}
+	void run() override
+	{
+		while (threadShouldExit() == false)
+		{
+			// the callbacks notify when they take a frame out of the queue
+			if (owner.computeQueuedFrame() == false)
+				wait(50);
+		}
+	}
+private:
+	StretchAudioSource& owner;
+};
+
+class StretchAudioSource::EngineBuilder : public Thread
+{
+public:
+	EngineBuilder(StretchAudioSource& owner_) : Thread("PaulXEngineBuilder"), owner(owner_) {}
+	void run() override
+	{
+		while (threadShouldExit() == false)
+		{
+			// notified when an FFT size is requested, when the callbacks hand an engine back and when the
+			// parameters change, the free filter envelope is edited without notifying so it's polled
+			bool worked = owner.buildRequestedEngine();
+			if (owner.updateSpectralPlan())
+				worked = true;
+			if (worked == false)
+			{
+				auto plan = std::atomic_load(&owner.m_spectralplan);
+				wait(plan != nullptr && plan->freefiltergains != nullptr ? 20 : 100);
+			}
+		}
+	}
+private:
+	StretchAudioSource& owner;
+};
+
 StretchAudioSource::StretchAudioSource(int initialnumoutchans, 
 	AudioFormatManager* afm,
 	std::array<AudioParameterBool*,9>& enab_pars) : m_afm(afm)
@@ -34,12 +75,17 @@ StretchAudioSource::StretchAudioSource(int initialnumoutchans,
 	setNumOutChannels(initialnumoutchans);
 	m_xfadetask.buffer.setSize(8, 65536);
 	m_xfadetask.buffer.clear();
-
+	m_enginebuilder = std::make_unique<EngineBuilder>(*this);
+	m_enginebuilder->startThread(Thread::Priority::low);
 }
 
 StretchAudioSource::~StretchAudioSource()
 {
-	
+	if (m_frameworker != nullptr)
+		m_frameworker->stopThread(1000);
+	// waits for the engine it may be building, which can wait for an FFTW measurement
+	if (m_enginebuilder != nullptr)
+		m_enginebuilder->stopThread(-1);
 }
 
 void StretchAudioSource::prepareToPlay(int samplesPerBlockExpected, double sampleRate)
@@ -93,12 +139,17 @@ void StretchAudioSource::setSpectrumProcessOrder(std::vector<SpectrumProcess> or
 {
 	ScopedLock locker(m_cs);
 	m_specproc_order = order;
+	++m_param_change_count;
+	requestSpectralPlan();
 	/*
 	Logger::writeToLog("<**");
 	for (auto& e : m_specproc_order)
 		Logger::writeToLog(e.m_enabled->name + " " + String(e.m_index));
 	Logger::writeToLog("**>");
 	*/
+	//with the worker running, the stretchers take the parameters at the start of its next frame
+	if (m_frameworker != nullptr)
+		return;
 	for (int i = 0; i < m_stretchers.size(); ++i)
 	{
 		m_stretchers[i]->m_spectrum_processes = order;
@@ -116,6 +167,10 @@ void StretchAudioSource::setFreeFilterEnvelope(shared_envelope env)
 {
 	ScopedLock locker(m_cs);
 	m_free_filter_envelope = env;
+	++m_param_change_count;
+	requestSpectralPlan();
+	if (m_frameworker != nullptr)
+		return;
 	for (int i = 0; i < m_stretchers.size(); ++i)
 	{
 		m_stretchers[i]->setFreeFilterEnvelope(env);
@@ -147,6 +202,10 @@ void StretchAudioSource::setAudioBufferAsInputSource(AudioBuffer<float>* buf, in
 	m_seekpos = 0.0;
     m_audiobuffer_is_source = true;
 	m_curfile = URL();
+	m_onsetbuffer = nullptr;
+	m_onsetbuffer_source = buf;
+	m_onsetbuffer_len = len;
+	++m_onsetbuffer_id;
 	if (m_playrange.isEmpty())
 		setPlayRange({ 0.0,1.0 });
 	++m_param_change_count;
@@ -202,6 +261,7 @@ void StretchAudioSource::setSpectralModulesEnabled(const std::array<AudioParamet
 void StretchAudioSource::setSpectralModuleEnabled(int index, bool b)
 {
 	++m_param_change_count;
+	requestSpectralPlan();
 }
 
 void StretchAudioSource::setLoopXFadeLength(double lenseconds)
@@ -302,7 +362,7 @@ void StretchAudioSource::getNextAudioBlock(const AudioSourceChannelInfo & buffer
 		m_output_has_begun = true;
 	bool freezing = m_freezing;
 	
-	if (m_stretchers[0]->isFreezing() != freezing)
+	if (m_frameworker == nullptr && m_stretchers[0]->isFreezing() != freezing)
 	{
 		if (freezing == true && m_inputfile!=nullptr)
 			m_freeze_pos = 1.0/m_inputfile->info.nsamples*m_inputfile->getCurrentPosition();
@@ -332,62 +392,34 @@ void StretchAudioSource::getNextAudioBlock(const AudioSourceChannelInfo & buffer
 	{
 		while (m_stretchoutringbuf.available() < framestoproduce*m_num_outchans)
 		{
-			int readsize = 0;
-			double in_pos = (double)m_inputfile->getCurrentPosition() / (double)m_inputfile->info.nsamples;
-            float in_pos_100 = in_pos*100.0;
-
-            if (m_firstbuffer)
-			{
-				readsize = m_stretchers[0]->get_nsamples_for_fill();
-				m_firstbuffer = false;
-			}
-			else
-			{
-				readsize = m_stretchers[0]->get_nsamples(in_pos*100.0);
-			};
-			int readed = 0;
-			if (readsize != 0)
-			{
-				m_last_filepos = m_inputfile->getCurrentPosition();
-				readed = m_inputfile->readNextBlock(m_file_inbuf, readsize, m_num_outchans);
-			}
-			if (m_rand_count % (int)m_free_filter_envelope->m_transform_y_random_rate == 0)
+			if (m_frameworker != nullptr)
 			{
-				m_free_filter_envelope->updateRandomState();
+				const bool primed = m_lookahead_priming == false
+					|| getNumQueuedFrames() >= m_lookahead_frames;
+				if (primed && pushQueuedFrame(m_lookahead_priming))
+				{
+					m_lookahead_priming = false;
+					continue;
+				}
+				// the worker catches up while the callbacks play silence
+				if (m_lookahead_priming == false)
+					++m_lookahead_underruns;
+				m_lookahead_priming = true;
+				while (m_stretchoutringbuf.available() < framestoproduce*m_num_outchans)
+					m_stretchoutringbuf.push(0.0f);
+				break;
 			}
-			++m_rand_count;
-			
-			auto inbufptrs = m_file_inbuf.getArrayOfWritePointers();
-			REALTYPE onset_max = std::numeric_limits<REALTYPE>::min();
-#ifdef USE_PPL_TO_PROCESS_STRETCHERS
-			std::array<REALTYPE, 16> onset_values_arr;
-			Concurrency::parallel_for(0, (int)m_stretchers.size(), [this, readed, &onset_values_arr](int i)
+			//the frame may already have been computed during the previous callbacks
+			if (m_framejob.state == 0)
+				startFrame();
+			if (m_framejob.state == 1)
 			{
-				REALTYPE onset_val = m_stretchers[i]->process(m_inbufs[i].data(), readed);
-				onset_values_arr[i] = onset_val;
-			});
-			for (int i = 0; i < m_stretchers.size(); ++i)
-				onset_max = std::max(onset_max, onset_values_arr[i]);
-#else
-			for (int i = 0; i < m_stretchers.size(); ++i)
-			{
-				REALTYPE onset_l = m_stretchers[i]->process(inbufptrs[i], readed);
-				onset_max = std::max(onset_max, onset_l);
+				if (m_framejob.stepping)
+					runFrameSteps(std::numeric_limits<double>::max());
+				else
+					processFrame();
 			}
-#endif
-			for (int i = 0; i < m_stretchers.size(); ++i)
-				m_stretchers[i]->here_is_onset(onset_max);
 			int outbufsize = m_stretchers[0]->get_bufsize();
-
-            if (m_stretchers.size() > 1) {
-                m_binaural_beats->process(m_stretchers[0]->out_buf.data(),m_stretchers[1]->out_buf.data(),
-                                          outbufsize, in_pos_100);
-            }
-
-			int nskip = m_stretchers[0]->get_skip_nsamples();
-			if (nskip > 0)
-				m_inputfile->skip(nskip);
-
 			for (int i = 0; i < outbufsize; i++)
 			{
 				for (int ch = 0; ch < m_num_outchans; ++ch)
@@ -397,10 +429,11 @@ void StretchAudioSource::getNextAudioBlock(const AudioSourceChannelInfo & buffer
 
 				}
 			}
-			
+			m_framejob.state = 0;
 		}
 		
 	};
+	const bool swappingengine = startEngineSwap();
 	int previousxfadestate = m_xfadetask.state;
 	auto resamplertask = [this, &ringbuffilltask, &bufferToFill]()
 	{
@@ -430,11 +463,10 @@ void StretchAudioSource::getNextAudioBlock(const AudioSourceChannelInfo & buffer
 					m_xfadetask.buffer.setSample(j, i, m_resampler_outbuf[i*m_num_outchans + j]);
 				}
 			}
-			if (m_process_fftsize != m_xfadetask.requested_fft_size)
+			if (m_nextengine != nullptr)
 			{
-				m_process_fftsize = m_xfadetask.requested_fft_size;
-				//Logger::writeToLog("Initing stretcher objects");
-				initObjects();
+				installEngine(*m_nextengine);
+				m_oldengine = std::move(m_nextengine);
 			}
 			m_xfadetask.state = 2;
 		}
@@ -446,6 +478,10 @@ void StretchAudioSource::getNextAudioBlock(const AudioSourceChannelInfo & buffer
 		//Logger::writeToLog("Rerunning resampler task");
 		resamplertask();
 	}
+	if (swappingengine && m_frameworker != nullptr)
+		m_framecs.exit();
+	if (m_amortize_frames && m_frameworker == nullptr && m_xfadetask.state != 1)
+		computeFrameAhead(bufferToFill.numSamples);
 	
 	bool source_ended = m_inputfile->hasEnded();
 	double samplelimit = 16384.0;
@@ -526,6 +562,8 @@ String StretchAudioSource::setAudioFile(const URL & url)
 		m_curfile = url;
 		m_firstbuffer = true;
         m_audiobuffer_is_source = false;
+		m_onsetbuffer = nullptr;
+		m_onsetbuffer_source = nullptr;
         initObjects();
 		return String();
 	}
@@ -546,11 +584,8 @@ void StretchAudioSource::setNumOutChannels(int chans)
 void StretchAudioSource::initObjects()
 {
 	ScopedLock locker(m_cs);
-	m_inputfile->setActiveRange(m_playrange);
-	if (m_inputfile->getActiveRange().contains(m_inputfile->getCurrentPositionPercent())==false)
-		m_inputfile->seek(m_playrange.getStart(), true);
-	
-	m_firstbuffer = true;
+	// waits for the frame the worker may be computing
+	ScopedLock framelocker(m_framecs);
 	if (m_stretchoutringbuf.getSize() < m_num_outchans*m_process_fftsize)
 	{
 		int newsize = m_num_outchans*m_process_fftsize*2;
@@ -561,15 +596,21 @@ void StretchAudioSource::initObjects()
     {
         m_xfadetask.buffer.setSize(m_num_outchans, m_xfadetask.buffer.getNumSamples());
     }
-	m_stretchoutringbuf.clear();
-	m_resampler->Reset();
-	m_resampler->SetRates(m_inputfile->info.samplerate, m_outsr);
+	// a size change that was waiting for its engine is replaced by this size
+	m_xfadetask.requested_fft_size = m_process_fftsize;
+	m_requested_engine_size = 0;
 	REALTYPE stretchratio = m_playrate;
     FFTWindow windowtype = W_HAMMING;
     if (m_fft_window_type>=0)
         windowtype = (FFTWindow)m_fft_window_type;
 	int inbufsize = m_process_fftsize;
-	double onsetsens = m_onsetdetection;
+	//the stretchers of the previous FFT size are kept in the pool, and those of the new size taken from it
+	if (m_stretchers.empty() == false && m_stretchers[0] != nullptr && m_stretchers[0]->get_bufsize() != m_process_fftsize)
+	{
+		ScopedLock enginelocker(m_enginecs);
+		m_enginepool.put(std::move(m_stretchers));
+		m_stretchers = m_enginepool.take(m_process_fftsize);
+	}
 	m_stretchers.resize(m_num_outchans);
 	for (int i = 0; i < m_stretchers.size(); ++i)
 	{
@@ -580,6 +621,39 @@ void StretchAudioSource::initObjects()
 				m_process_fftsize, windowtype, false, (float)m_inputfile->info.samplerate, i + 1);
 		}
 		m_stretchers[i]->setBufferSize(m_process_fftsize);
+	}
+	m_batchstretchers.resize(m_stretchers.size());
+	for (int i = 0; i < m_stretchers.size(); ++i)
+		m_batchstretchers[i] = m_stretchers[i].get();
+	m_batchonsets.resize(m_stretchers.size());
+    m_binaural_beats = std::make_unique<BinauralBeats>(m_inputfile->info.samplerate);
+    m_binaural_beats->pars = m_bbpar;
+
+	m_file_inbuf.setSize(m_num_outchans, 3 * inbufsize);
+	resetFrameQueue();
+	// the plan of the new size is made here, resetObjects gives it to the stretchers
+	for (auto& e : m_stretchers)
+		e->setSampleRate(m_inputfile->info.samplerate);
+	updateSpectralPlan();
+	resetObjects();
+}
+
+void StretchAudioSource::resetObjects()
+{
+	m_inputfile->setActiveRange(m_playrange);
+	if (m_inputfile->getActiveRange().contains(m_inputfile->getCurrentPositionPercent())==false)
+		m_inputfile->seek(m_playrange.getStart(), true);
+	
+	m_firstbuffer = true;
+	m_framejob.state = 0;
+	m_framejob.pendingskip = 0;
+	m_frame_cost_ms = 0.0;
+	m_stretchoutringbuf.clear();
+	m_resampler->Reset();
+	m_resampler->SetRates(m_inputfile->info.samplerate, m_outsr);
+	double onsetsens = getStretcherOnsetDetection();
+	for (int i = 0; i < m_stretchers.size(); ++i)
+	{
 		m_stretchers[i]->setSampleRate(m_inputfile->info.samplerate);
 		m_stretchers[i]->set_onset_detection_sensitivity(onsetsens);
 		m_stretchers[i]->set_parameters(&m_ppar);
@@ -588,10 +662,481 @@ void StretchAudioSource::initObjects()
 		fill_container(m_stretchers[i]->out_buf, 0.0f);
 		m_stretchers[i]->m_spectrum_processes = m_specproc_order;
 	}
-    m_binaural_beats = std::make_unique<BinauralBeats>(m_inputfile->info.samplerate);
-    m_binaural_beats->pars = m_bbpar;
+	// set_parameters has dropped the plan of the stretchers
+	m_applied_spectralplan = nullptr;
+	applySpectralPlan();
+	m_applied_param_change_count = -1;
+}
 
-	m_file_inbuf.setSize(m_num_outchans, 3 * inbufsize);
+bool StretchAudioSource::buildRequestedEngine()
+{
+	bool worked = false;
+	std::unique_ptr<BuiltEngine> released;
+	{
+		ScopedLock enginelocker(m_enginecs);
+		if (m_retiredengine != nullptr)
+		{
+			m_enginepool.put(std::move(m_retiredengine->stretchers));
+			released = std::move(m_retiredengine);
+			worked = true;
+		}
+	}
+	// the buffers of the old size are released here and not in the callbacks
+	released = nullptr;
+	auto engine = std::make_unique<BuiltEngine>();
+	REALTYPE stretchratio = 1.0f;
+	FFTWindow windowtype = W_HAMMING;
+	std::vector<SpectrumProcess> order;
+	ProcessParameters pars;
+	shared_envelope env;
+	{
+		ScopedLock locker(m_cs);
+		engine->fftsize = m_requested_engine_size.load();
+		if (engine->fftsize <= 0 || engine->fftsize == m_process_fftsize || m_inputfile->info.nsamples == 0)
+			return worked;
+		engine->numchans = m_num_outchans;
+		engine->samplerate = m_inputfile->info.samplerate;
+		engine->lookahead = m_lookahead_frames;
+		stretchratio = (REALTYPE)m_playrate;
+		if (m_fft_window_type >= 0)
+			windowtype = (FFTWindow)m_fft_window_type;
+		order = m_specproc_order;
+		pars = m_ppar;
+		env = m_free_filter_envelope;
+	}
+	{
+		ScopedLock enginelocker(m_enginecs);
+		if (m_readyengine != nullptr)
+		{
+			if (m_readyengine->fftsize == engine->fftsize && m_readyengine->numchans == engine->numchans
+				&& m_readyengine->samplerate == engine->samplerate && m_readyengine->lookahead == engine->lookahead)
+				return worked;
+			m_enginepool.put(std::move(m_readyengine->stretchers));
+			released = std::move(m_readyengine);
+		}
+		engine->stretchers = m_enginepool.take(engine->fftsize);
+	}
+	released = nullptr;
+	const int fftsize = engine->fftsize;
+	const int numchans = engine->numchans;
+	auto& stretchers = engine->stretchers;
+	stretchers.resize(numchans);
+	for (int i = 0; i < numchans; ++i)
+	{
+		if (stretchers[i] == nullptr)
+			stretchers[i] = std::make_shared<ProcessedStretch>(stretchratio,
+				fftsize, windowtype, false, (float)engine->samplerate, i + 1);
+		stretchers[i]->setBufferSize(fftsize);
+		stretchers[i]->setSampleRate(engine->samplerate);
+		// the callbacks then copy the order into a vector of the same size
+		stretchers[i]->m_spectrum_processes = order;
+	}
+	engine->batchstretchers.resize(numchans);
+	for (int i = 0; i < numchans; ++i)
+		engine->batchstretchers[i] = stretchers[i].get();
+	engine->batchonsets.resize(numchans);
+	// so that the first frames of the new size don't make their tables in the callbacks
+	engine->spectralplan = makeSpectralPlan(pars, fftsize, stretchers[0]->getSampleRate(),
+		SpectralPlan::getEnabledStages(order), env, nullptr);
+	engine->inbuf.setSize(numchans, 3 * fftsize);
+	if (numchans * fftsize > 1024 * 1024)
+		engine->outringbuf.resize(numchans * fftsize * 2);
+	if (engine->lookahead > 0)
+	{
+		engine->framequeue.assign((size_t)(engine->lookahead + 1) * numchans * fftsize, 0.0f);
+		engine->framequeueseekcounts.assign(engine->lookahead + 1, 0);
+		engine->framequeuefifo = std::make_unique<AbstractFifo>(engine->lookahead + 1);
+	}
+	ScopedLock enginelocker(m_enginecs);
+	jassert(m_readyengine == nullptr);
+	m_readyengine = std::move(engine);
+	return true;
+}
+
+bool StretchAudioSource::startEngineSwap()
+{
+	const bool swapwanted = m_xfadetask.requested_fft_size != m_process_fftsize;
+	auto isusable = [this](const BuiltEngine& engine)
+	{
+		return engine.fftsize == m_xfadetask.requested_fft_size && engine.numchans == m_num_outchans
+			&& engine.samplerate == m_inputfile->info.samplerate && engine.lookahead == m_lookahead_frames;
+	};
+	// an engine of a size that isn't wanted anymore, or built before the channels, the sample rate or the look-ahead changed
+	if (m_nextengine != nullptr && m_oldengine == nullptr && (swapwanted == false || isusable(*m_nextengine) == false))
+	{
+		m_oldengine = std::move(m_nextengine);
+		if (swapwanted)
+			m_requested_engine_size = m_xfadetask.requested_fft_size;
+	}
+	if (m_oldengine != nullptr || (swapwanted && m_nextengine == nullptr))
+	{
+		if (m_enginecs.tryEnter() == false)
+			return false;
+		bool handedback = false;
+		if (m_oldengine != nullptr && m_retiredengine == nullptr)
+		{
+			m_retiredengine = std::move(m_oldengine);
+			handedback = true;
+		}
+		if (swapwanted && m_nextengine == nullptr && m_readyengine != nullptr && isusable(*m_readyengine))
+		{
+			m_nextengine = std::move(m_readyengine);
+			int size = m_nextengine->fftsize;
+			m_requested_engine_size.compare_exchange_strong(size, 0);
+		}
+		m_enginecs.exit();
+		if (handedback && m_enginebuilder != nullptr)
+			m_enginebuilder->notify();
+	}
+	if (swapwanted == false || m_nextengine == nullptr || m_oldengine != nullptr || m_xfadetask.state != 0)
+		return false;
+	// the worker uses the stretchers and the frame queue without m_cs, so they are only swapped between its frames
+	if (m_frameworker != nullptr && m_framecs.tryEnter() == false)
+		return false;
+	m_xfadetask.state = 1;
+	m_xfadetask.counter = 0;
+	m_xfadetask.xfade_len = 16384;
+	return true;
+}
+
+void StretchAudioSource::installEngine(BuiltEngine& engine)
+{
+	// the swaps don't allocate, the engine then has the stretchers and buffers of the old size
+	m_process_fftsize = engine.fftsize;
+	std::swap(m_stretchers, engine.stretchers);
+	std::swap(m_batchstretchers, engine.batchstretchers);
+	std::swap(m_batchonsets, engine.batchonsets);
+	std::swap(m_file_inbuf, engine.inbuf);
+	if (engine.outringbuf.getSize() > m_stretchoutringbuf.getSize())
+		std::swap(m_stretchoutringbuf, engine.outringbuf);
+	std::swap(m_framequeue, engine.framequeue);
+	std::swap(m_framequeue_seekcounts, engine.framequeueseekcounts);
+	std::swap(m_framequeuefifo, engine.framequeuefifo);
+	m_lookahead_priming = true;
+	// the plan of the old size goes back to the builder with the engine
+	engine.spectralplan = std::atomic_exchange(&m_spectralplan, std::move(engine.spectralplan));
+	m_framequeue_channels = (int)m_stretchers.size();
+	m_framequeue_bufsize = m_process_fftsize;
+	engine.fftsize = 0;
+	resetObjects();
+}
+
+void StretchAudioSource::startFrame()
+{
+	int readsize = 0;
+	double in_pos = (double)m_inputfile->getCurrentPosition() / (double)m_inputfile->info.nsamples;
+	m_framejob.in_pos_100 = in_pos*100.0;
+
+	if (m_firstbuffer)
+	{
+		readsize = m_stretchers[0]->get_nsamples_for_fill();
+		m_firstbuffer = false;
+	}
+	else
+	{
+		readsize = m_stretchers[0]->get_nsamples(in_pos*100.0);
+	};
+	m_framejob.readed = 0;
+	if (readsize != 0)
+	{
+		m_last_filepos = m_inputfile->getCurrentPosition();
+		m_framejob.readed = m_inputfile->readNextBlock(m_file_inbuf, readsize, m_num_outchans);
+	}
+	if (m_rand_count % (int)m_free_filter_envelope->m_transform_y_random_rate == 0)
+	{
+		m_free_filter_envelope->updateRandomState();
+		requestSpectralPlan();
+	}
+	++m_rand_count;
+	applySpectralPlan();
+	m_framejob.state = 1;
+	m_framejob.stepping = false;
+	m_framejob.stretcher = 0;
+	m_framejob.spentms = 0.0;
+	m_framejob.seekcount = m_seek_count;
+	m_framejob.onsetcurve = m_onsetcurve;
+	m_framejob.onsetdetection = m_onsetdetection;
+}
+
+void StretchAudioSource::processFrame()
+{
+	double t0 = Time::getMillisecondCounterHiRes();
+	auto inbufptrs = m_file_inbuf.getArrayOfWritePointers();
+	int readed = m_framejob.readed;
+#ifdef USE_PPL_TO_PROCESS_STRETCHERS
+	Concurrency::parallel_for(0, (int)m_stretchers.size(), [this, readed, inbufptrs](int i)
+	{
+		m_batchonsets[i] = m_stretchers[i]->process(inbufptrs[i], readed);
+	});
+#else
+	// all the channels have the same FFT size, so their transforms are done as batches
+	Stretch::processBatch(m_batchstretchers.data(), inbufptrs, (int)m_batchstretchers.size(), readed, m_batchonsets.data());
+#endif
+	m_framejob.spentms += Time::getMillisecondCounterHiRes() - t0;
+	finishFrame();
+}
+
+bool StretchAudioSource::runFrameSteps(double timelimitms)
+{
+	double t0 = Time::getMillisecondCounterHiRes();
+	if (m_framejob.stepping == false)
+	{
+		auto inbufptrs = m_file_inbuf.getArrayOfWritePointers();
+		for (int i = 0; i < m_stretchers.size(); ++i)
+			m_stretchers[i]->beginFrame(inbufptrs[i], m_framejob.readed);
+		m_framejob.stepping = true;
+	}
+	double elapsed = 0.0;
+	while (m_framejob.stretcher < (int)m_stretchers.size() && elapsed < timelimitms)
+	{
+		if (m_stretchers[m_framejob.stretcher]->runFrameStep())
+		{
+			m_batchonsets[m_framejob.stretcher] = m_stretchers[m_framejob.stretcher]->getFrameOnset();
+			++m_framejob.stretcher;
+		}
+		elapsed = Time::getMillisecondCounterHiRes() - t0;
+	}
+	m_framejob.spentms += elapsed;
+	if (m_framejob.stretcher == (int)m_stretchers.size())
+		finishFrame();
+	return m_framejob.state == 2;
+}
+
+void StretchAudioSource::finishFrame()
+{
+	REALTYPE onset_max = std::numeric_limits<REALTYPE>::min();
+	for (int i = 0; i < m_stretchers.size(); ++i)
+		onset_max = std::max(onset_max, m_batchonsets[i]);
+	// the curve has the strength of the frame whose input ends where this frame's read ended
+	if (m_framejob.onsetcurve != nullptr && m_framejob.readed > 0)
+		onset_max = Stretch::get_onset_from_strength(m_framejob.onsetcurve->getStrength(m_last_filepos + m_framejob.readed),
+			(REALTYPE)m_framejob.onsetdetection);
+	for (int i = 0; i < m_stretchers.size(); ++i)
+		m_stretchers[i]->here_is_onset(onset_max);
+	int outbufsize = m_stretchers[0]->get_bufsize();
+
+	if (m_stretchers.size() > 1) {
+		m_binaural_beats->process(m_stretchers[0]->out_buf.data(),m_stretchers[1]->out_buf.data(),
+			outbufsize, m_framejob.in_pos_100);
+	}
+
+	int nskip = m_stretchers[0]->get_skip_nsamples();
+	if (nskip > 0 && m_frameworker != nullptr)
+		m_framejob.pendingskip += nskip;
+	else if (nskip > 0)
+		m_inputfile->skip(nskip);
+	// the frames that read input take longer, so the estimate follows the slow ones quickly
+	if (m_framejob.spentms > m_frame_cost_ms)
+		m_frame_cost_ms = m_framejob.spentms;
+	else
+		m_frame_cost_ms = 0.9 * m_frame_cost_ms + 0.1 * m_framejob.spentms;
+	m_framejob.state = 2;
+}
+
+void StretchAudioSource::computeFrameAhead(int numsamples)
+{
+	if (m_framejob.state == 2 || m_outsr <= 0.0)
+		return;
+	// frames that take a small part of a callback are computed when their output is needed,
+	// with the FFTs of the channels done together
+	const double callbackms = 1000.0 * numsamples / m_outsr;
+	if (m_framejob.state == 0 && m_frame_cost_ms < 0.25 * callbackms)
+		return;
+	if (m_framejob.state == 0)
+		startFrame();
+	// spread the rest of the work evenly over the callbacks before the output of the frame is needed
+	double insamplespercallback = jmax(1.0, numsamples * m_inputfile->info.samplerate / m_outsr);
+	double callbacksleft = std::floor(m_stretchoutringbuf.available() / m_num_outchans / insamplespercallback);
+	double remainingms = jmax(0.0, m_frame_cost_ms - m_framejob.spentms);
+	runFrameSteps(jmax(0.001, remainingms / (callbacksleft + 1.0)));
+}
+
+void StretchAudioSource::resetFrameQueue()
+{
+	m_lookahead_priming = true;
+	m_framequeue_channels = (int)m_stretchers.size();
+	m_framequeue_bufsize = m_stretchers.empty() ? 0 : m_stretchers[0]->get_bufsize();
+	if (m_lookahead_frames == 0)
+	{
+		m_framequeue = std::vector<float>();
+		m_framequeue_seekcounts = std::vector<int>();
+		m_framequeuefifo = nullptr;
+		return;
+	}
+	// the fifo keeps one of its slots free
+	m_framequeue.assign((size_t)(m_lookahead_frames + 1) * m_framequeue_channels * m_framequeue_bufsize, 0.0f);
+	m_framequeue_seekcounts.assign(m_lookahead_frames + 1, 0);
+	m_framequeuefifo = std::make_unique<AbstractFifo>(m_lookahead_frames + 1);
+}
+
+void StretchAudioSource::applyParametersToStretchers()
+{
+	if (m_stretchers[0]->isFreezing() != m_freezing)
+	{
+		if (m_freezing == true)
+			m_freeze_pos = 1.0/m_inputfile->info.nsamples*m_inputfile->getCurrentPosition();
+		for (auto& e : m_stretchers)
+			e->set_freezing(m_freezing);
+	}
+	if (m_applied_param_change_count == m_param_change_count)
+		return;
+	for (auto& e : m_stretchers)
+	{
+		e->set_rap((float)m_playrate);
+		if (m_fft_window_type >= 0)
+			e->window_type = (FFTWindow)m_fft_window_type;
+		// setting it resets the onset time credit of the stretcher
+		if (e->get_onset_detection_sensitivity() != (float)getStretcherOnsetDetection())
+			e->set_onset_detection_sensitivity((float)getStretcherOnsetDetection());
+		e->setFreeFilterEnvelope(m_free_filter_envelope);
+		e->m_spectrum_processes = m_specproc_order;
+	}
+	m_binaural_beats->pars = m_bbpar;
+	m_applied_param_change_count = m_param_change_count;
+}
+
+std::shared_ptr<const SpectralPlan> StretchAudioSource::makeSpectralPlan(const ProcessParameters& pars, int nfreq,
+	REALTYPE samplerate, int enabledstages, const shared_envelope& env, std::shared_ptr<const SpectralPlan> previous)
+{
+	ScopedLock planlocker(m_plancs);
+	std::shared_ptr<const FreeFilterGainCache::GainCurve> freefiltergains;
+	if ((enabledstages & (1 << SPT_FreeFilter)) != 0 && env != nullptr)
+		freefiltergains = m_freefiltergaincache->getGains(env, nfreq, samplerate);
+	if (previous != nullptr && previous->nfreq == nfreq && previous->samplerate == samplerate
+		&& previous->enabledstages == enabledstages && previous->freefiltergains == freefiltergains && previous->pars == pars)
+		return previous;
+	return SpectralPlan::build(pars, nfreq, samplerate, enabledstages, freefiltergains, previous.get());
+}
+
+bool StretchAudioSource::updateSpectralPlan()
+{
+	ProcessParameters pars;
+	shared_envelope env;
+	int enabledstages = 0;
+	int nfreq = 0;
+	REALTYPE samplerate = 0.0f;
+	{
+		ScopedLock locker(m_cs);
+		if (m_stretchers.empty())
+			return false;
+		nfreq = m_stretchers[0]->get_bufsize();
+		samplerate = m_stretchers[0]->getSampleRate();
+		pars = m_ppar;
+		env = m_free_filter_envelope;
+		enabledstages = SpectralPlan::getEnabledStages(m_specproc_order);
+	}
+	ScopedLock planlocker(m_plancs);
+	auto previous = std::atomic_load(&m_spectralplan);
+	auto plan = makeSpectralPlan(pars, nfreq, samplerate, enabledstages, env, previous);
+	m_retiredplans.erase(std::remove_if(m_retiredplans.begin(), m_retiredplans.end(),
+		[](const std::shared_ptr<const SpectralPlan>& e) { return e.use_count() == 1; }), m_retiredplans.end());
+	if (plan == previous)
+		return false;
+	// the callbacks may have installed the plan of an engine of another size meanwhile
+	if (std::atomic_compare_exchange_strong(&m_spectralplan, &previous, plan) == false)
+		return true;
+	// kept until no stretcher uses it, so that the callbacks don't release it
+	if (previous != nullptr)
+		m_retiredplans.push_back(std::move(previous));
+	return true;
+}
+
+void StretchAudioSource::requestSpectralPlan()
+{
+	if (m_enginebuilder != nullptr)
+		m_enginebuilder->notify();
+}
+
+void StretchAudioSource::applySpectralPlan()
+{
+	auto plan = std::atomic_load(&m_spectralplan);
+	if (plan == m_applied_spectralplan)
+		return;
+	m_applied_spectralplan = std::move(plan);
+	for (auto& e : m_stretchers)
+		e->setSpectralPlan(m_applied_spectralplan);
+}
+
+void StretchAudioSource::startQueuedFrame()
+{
+	// the input the previous frame used is skipped now, unless there was a seek after it was read
+	if (m_framejob.pendingskip > 0 && m_framejob.seekcount == m_seek_count)
+		m_inputfile->skip(m_framejob.pendingskip);
+	m_framejob.pendingskip = 0;
+	applyParametersToStretchers();
+	startFrame();
+}
+
+bool StretchAudioSource::computeQueuedFrame()
+{
+	{
+		ScopedLock locker(m_cs);
+		if (m_framequeuefifo == nullptr || m_framequeuefifo->getFreeSpace() == 0)
+			return false;
+		if (m_stretchers.empty() || m_inputfile->info.nsamples == 0 || m_preview_dry == true
+			|| (int)m_stretchers.size() != m_framequeue_channels || m_stretchers[0]->get_bufsize() != m_framequeue_bufsize)
+			return false;
+		// the parameters and the input are taken with m_cs, the frame is then computed without it
+		m_framecs.enter();
+		startQueuedFrame();
+	}
+	processFrame();
+	int start1, size1, start2, size2;
+	m_framequeuefifo->prepareToWrite(1, start1, size1, start2, size2);
+	jassert(size1 == 1);
+	float* dest = m_framequeue.data() + (size_t)start1 * m_framequeue_channels * m_framequeue_bufsize;
+	for (int ch = 0; ch < m_framequeue_channels; ++ch)
+		FloatVectorOperations::copy(dest + ch * m_framequeue_bufsize, m_stretchers[ch]->out_buf.data(), m_framequeue_bufsize);
+	m_framequeue_seekcounts[start1] = m_framejob.seekcount;
+	m_framequeuefifo->finishedWrite(1);
+	m_framecs.exit();
+	return true;
+}
+
+int StretchAudioSource::getNumQueuedFrames()
+{
+	int start1, size1, start2, size2;
+	m_framequeuefifo->prepareToRead(1, start1, size1, start2, size2);
+	// the frame the worker was computing during a seek is queued after the seek dropped the others
+	while (size1 > 0 && m_framequeue_seekcounts[start1] != m_seek_count)
+	{
+		m_framequeuefifo->finishedRead(1);
+		m_framequeuefifo->prepareToRead(1, start1, size1, start2, size2);
+	}
+	return m_framequeuefifo->getNumReady();
+}
+
+bool StretchAudioSource::pushQueuedFrame(bool fadein)
+{
+	if (getNumQueuedFrames() == 0)
+	{
+		m_frameworker->notify();
+		return false;
+	}
+	int start1, size1, start2, size2;
+	m_framequeuefifo->prepareToRead(1, start1, size1, start2, size2);
+	const float* frame = m_framequeue.data() + (size_t)start1 * m_framequeue_channels * m_framequeue_bufsize;
+	const int fadelen = fadein ? jmin(m_framequeue_bufsize, 4096) : 0;
+	for (int i = 0; i < m_framequeue_bufsize; i++)
+	{
+		const float gain = i < fadelen ? (float)i / fadelen : 1.0f;
+		for (int ch = 0; ch < m_num_outchans; ++ch)
+			m_stretchoutringbuf.push(gain * frame[ch * m_framequeue_bufsize + i]);
+	}
+	m_framequeuefifo->finishedRead(1);
+	m_frameworker->notify();
+	return true;
+}
+
+void StretchAudioSource::dropQueuedFrames()
+{
+	// called with m_cs held, which the callbacks that read the queue hold too
+	if (m_framequeuefifo == nullptr)
+		return;
+	m_framequeuefifo->finishedRead(m_framequeuefifo->getNumReady());
+	m_lookahead_priming = true;
+	if (m_frameworker != nullptr)
+		m_frameworker->notify();
 }
 
 void StretchAudioSource::playDrySound(const AudioSourceChannelInfo & bufferToFill)
@@ -656,7 +1201,7 @@ void StretchAudioSource::setRate(double rate)
 	if (m_cs.tryEnter())
 	{
 		m_playrate = rate;
-		for (int i = 0; i < m_stretchers.size(); ++i)
+		for (int i = 0; m_frameworker == nullptr && i < m_stretchers.size(); ++i)
 		{
 			m_stretchers[i]->set_rap((float)rate);
 		}
@@ -674,15 +1219,14 @@ void StretchAudioSource::setProcessParameters(ProcessParameters * pars, Binaural
 		m_ppar = *pars;
         if (bbpars) {
             m_bbpar = *bbpars;
-            m_binaural_beats->pars = m_bbpar;
+            if (m_frameworker == nullptr)
+                m_binaural_beats->pars = m_bbpar;
         }
 
-		for (int i = 0; i < m_stretchers.size(); ++i)
-		{
-			m_stretchers[i]->set_parameters(pars);
-		}
+		// the stretchers get the parameters with the plan the builder makes for them
 		++m_param_change_count;
 		m_cs.exit();
+		requestSpectralPlan();
 	}
 }
 
@@ -698,7 +1242,7 @@ void StretchAudioSource::setFFTWindowingType(int windowtype)
 	if (m_cs.tryEnter())
 	{
 		m_fft_window_type = windowtype;
-		for (int i = 0; i < m_stretchers.size(); ++i)
+		for (int i = 0; m_frameworker == nullptr && i < m_stretchers.size(); ++i)
 		{
 			m_stretchers[i]->window_type = (FFTWindow)windowtype;
 		}
@@ -710,32 +1254,72 @@ void StretchAudioSource::setFFTWindowingType(int windowtype)
 void StretchAudioSource::setFFTSize(int size, bool force)
 {
     jassert(size>0);
-    if (force || (m_xfadetask.state == 0 && (m_process_fftsize == 0 || size != m_process_fftsize)))
+	if (!force && m_process_fftsize > 0)
 	{
+		// the callbacks keep playing the current size until the builder thread has the engine of
+		// the new one ready, and then cross-fade to it
+		if (size == m_xfadetask.requested_fft_size)
+			return;
         DBG("Using FFT size: " << size);
+		ScopedLock locker(m_cs);
+		m_xfadetask.requested_fft_size = size;
+		m_requested_engine_size = size != m_process_fftsize ? size : 0;
+		if (m_enginebuilder != nullptr)
+			m_enginebuilder->notify();
+		++m_param_change_count;
+		return;
+	}
+    DBG("Using FFT size: " << size);
+	ScopedLock locker(m_cs);
+	m_process_fftsize = size;
+	initObjects();
+	++m_param_change_count;
+}
+
+void StretchAudioSource::setEnginePoolBudget(int64 bytes)
+{
+	ScopedLock locker(m_enginecs);
+	m_enginepool.setBudget(bytes);
+}
+
+int64 StretchAudioSource::getEnginePoolBudget()
+{
+	ScopedLock locker(m_enginecs);
+	return m_enginepool.getBudget();
+}
+
+void StretchAudioSource::setFrameAmortization(bool b)
+{
+	ScopedLock locker(m_cs);
+	m_amortize_frames = b;
+}
 
+void StretchAudioSource::setLookAheadFrames(int frames)
+{
+	frames = jlimit(0, 16, frames);
+	if (frames == m_lookahead_frames)
+		return;
+	// the worker finishes the frame it's computing
+	if (m_frameworker != nullptr)
+		m_frameworker->stopThread(1000);
+	{
 		ScopedLock locker(m_cs);
-		if (m_xfadetask.buffer.getNumChannels() < m_num_outchans)
-		{
-			m_xfadetask.buffer.setSize(m_num_outchans, m_xfadetask.buffer.getNumSamples());
-			
-		}
-		if (!force && m_process_fftsize > 0)
-		{
-			m_xfadetask.state = 1;
-			m_xfadetask.counter = 0;
-			m_xfadetask.xfade_len = 16384;
-			m_xfadetask.requested_fft_size = size;
-		}
-		else
+		ScopedLock framelocker(m_framecs);
+		if (m_framejob.pendingskip > 0 && m_framejob.seekcount == m_seek_count)
+			m_inputfile->skip(m_framejob.pendingskip);
+		m_framejob.pendingskip = 0;
+		m_framejob.state = 0;
+		m_frameworker = nullptr;
+		m_lookahead_frames = frames;
+		resetFrameQueue();
+		if (frames > 0)
 		{
-			m_process_fftsize = size;
-			initObjects();
+			m_frameworker = std::make_unique<FrameWorker>(*this);
+			m_applied_param_change_count = -1;
 		}
-
-
-		++m_param_change_count;
 	}
+	if (m_frameworker != nullptr)
+		m_frameworker->startThread(Thread::Priority::high);
 }
 
 void StretchAudioSource::setPaused(bool b)
@@ -769,7 +1353,10 @@ void StretchAudioSource::seekPercent(double pos)
 	//m_firstbuffer = true;
 	//m_resampler->Reset();
 	m_inputfile->seek(pos, true);
+	++m_seek_count;
 	++m_param_change_count;
+	//the frames computed ahead are from before the seek
+	dropQueuedFrames();
 }
 
 double StretchAudioSource::getOutputDurationSecondsForRange(Range<double> range, int fftsize)
@@ -789,15 +1376,69 @@ void StretchAudioSource::setOnsetDetection(double x)
 	if (m_cs.tryEnter())
 	{
 		m_onsetdetection = x;
-		for (int i = 0; i < m_stretchers.size(); ++i)
+		for (int i = 0; m_frameworker == nullptr && i < m_stretchers.size(); ++i)
 		{
-			m_stretchers[i]->set_onset_detection_sensitivity((float)x);
+			m_stretchers[i]->set_onset_detection_sensitivity((float)getStretcherOnsetDetection());
 		}
 		++m_param_change_count;
 		m_cs.exit();
 	}
 }
 
+void StretchAudioSource::setOnsetPreAnalysis(bool b)
+{
+	if (b == m_onset_preanalysis)
+		return;
+	m_onset_preanalysis = b;
+	updateOnsetAnalysis();
+}
+
+bool StretchAudioSource::updateOnsetAnalysis()
+{
+	std::shared_ptr<const OnsetCurve> curve;
+	bool ready = true;
+	if (m_onset_preanalysis && m_onsetdetection > 1e-3 && m_process_fftsize > 0)
+	{
+		FFTWindow windowtype = m_fft_window_type >= 0 ? (FFTWindow)m_fft_window_type : W_HAMMING;
+		const double sr = m_inputfile->info.samplerate;
+		if (m_audiobuffer_is_source && m_onsetbuffer_source != nullptr)
+		{
+			if (m_onsetbuffer == nullptr)
+			{
+				// the source buffer is reused for the next recording, so the analysis gets its own copy
+				auto copy = std::make_shared<AudioBuffer<float>>(m_onsetbuffer_source->getNumChannels(), m_onsetbuffer_len);
+				for (int i = 0; i < copy->getNumChannels(); ++i)
+					copy->copyFrom(i, 0, *m_onsetbuffer_source, i, 0, m_onsetbuffer_len);
+				m_onsetbuffer = copy;
+			}
+			curve = m_onsetanalyzer->getCurve(m_onsetbuffer, "buffer " + String((pointer_sized_int)this) + " " + String(m_onsetbuffer_id),
+				sr, m_process_fftsize, windowtype);
+			ready = curve != nullptr;
+		}
+		else if (m_audiobuffer_is_source == false && m_curfile.isLocalFile())
+		{
+			curve = m_onsetanalyzer->getCurve(m_curfile, m_inputfile->info.nsamples, m_inputfile->info.nchannels,
+				sr, m_process_fftsize, windowtype);
+			ready = curve != nullptr;
+		}
+	}
+	if (curve != m_onsetcurve)
+	{
+		ScopedLock locker(m_cs);
+		m_onsetcurve = curve;
+		for (int i = 0; m_frameworker == nullptr && i < m_stretchers.size(); ++i)
+			m_stretchers[i]->set_onset_detection_sensitivity((float)getStretcherOnsetDetection());
+		++m_param_change_count;
+	}
+	return ready;
+}
+
+std::shared_ptr<const OnsetCurve> StretchAudioSource::getOnsetCurve()
+{
+	ScopedLock locker(m_cs);
+	return m_onsetcurve;
+}
+
 void StretchAudioSource::setPlayRange(Range<double> playrange, bool force)
 {
 	if (!force && (playrange == m_playrange || playrange == m_inputfile->getActiveRange()))
@@ -837,3 +1478,57 @@ bool StretchAudioSource::hasReachedEnd()
 	//return m_output_counter>=m_process_fftsize*2;
 	return m_output_silence_counter>=65536;
 }
+
+void StretchEnginePool::put(Engine engine)
+{
+	if (engine.empty())
+		return;
+	m_usage += getMemoryUsage(engine);
+	m_engines.push_front(std::move(engine));
+	trim();
+}
+
+StretchEnginePool::Engine StretchEnginePool::take(int fftsize)
+{
+	for (auto it = m_engines.begin(); it != m_engines.end(); ++it)
+	{
+		if (it->front()->get_bufsize() == fftsize)
+		{
+			Engine result = std::move(*it);
+			m_engines.erase(it);
+			m_usage -= getMemoryUsage(result);
+			return result;
+		}
+	}
+	return Engine();
+}
+
+void StretchEnginePool::setBudget(int64 bytes)
+{
+	m_budget = jmax<int64>(0, bytes);
+	trim();
+}
+
+void StretchEnginePool::clear()
+{
+	m_engines.clear();
+	m_usage = 0;
+}
+
+int64 StretchEnginePool::getMemoryUsage(const Engine& engine)
+{
+	int64 result = 0;
+	for (auto& e : engine)
+		if (e != nullptr)
+			result += e->getMemoryUsage();
+	return result;
+}
+
+void StretchEnginePool::trim()
+{
+	while (m_engines.empty() == false && m_usage > m_budget)
+	{
+		m_usage -= getMemoryUsage(m_engines.back());
+		m_engines.pop_back();
+	}
+}
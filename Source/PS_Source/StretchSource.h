@@ -8,10 +8,38 @@
 #include "Input/AInputS.h"
 #include "ProcessedStretch.h"
 #include "BinauralBeats.h"
+#include "OnsetAnalysis.h"
 #include <mutex>
 #include <array>
+#include <list>
+#include <atomic>
 #include "../WDL/resample.h"
 
+// The stretchers of all the output channels that were built for an FFT size are kept here after
+// switching to another size, so that switching back doesn't allocate and plan everything again.
+// The least recently used ones are released when the pool goes over its memory budget.
+class StretchEnginePool
+{
+public:
+	using Engine = std::vector<std::shared_ptr<ProcessedStretch>>;
+	// Adds the engine as the most recently used one
+	void put(Engine engine);
+	// Removes the engine of the FFT size from the pool and returns it, empty if there isn't one
+	Engine take(int fftsize);
+	void setBudget(int64 bytes);
+	int64 getBudget() const { return m_budget; }
+	int64 getMemoryUsage() const { return m_usage; }
+	int getNumEngines() const { return (int)m_engines.size(); }
+	void clear();
+	static int64 getMemoryUsage(const Engine& engine);
+private:
+	void trim();
+	// most recently used first
+	std::list<Engine> m_engines;
+	int64 m_budget = 256 * 1024 * 1024;
+	int64 m_usage = 0;
+};
+
 class StretchAudioSource final : public PositionableAudioSource
 {
 public:
@@ -52,8 +80,25 @@ public:
 	double getOutputSamplerate() const { return m_outsr; }
 	void setProcessParameters(ProcessParameters* pars, BinauralBeatsParameters * bbpars=0);
 	const ProcessParameters& getProcessParameters();
+	// Without force the output keeps the current size until the stretchers of the new one have been
+	// built on a background thread, and then cross-fades to them
 	void setFFTSize(int size, bool force=false);
 	int getFFTSize() { return m_process_fftsize; }
+	// Memory the stretchers of the recently used FFT sizes may take, 0 disables keeping them
+	void setEnginePoolBudget(int64 bytes);
+	int64 getEnginePoolBudget();
+	// Computes the next frame a step at a time during the callbacks before its output is needed,
+	// when a frame takes a large part of a callback
+	void setFrameAmortization(bool b);
+	bool getFrameAmortization() const { return m_amortize_frames; }
+	// Computes the frames on a worker thread up to the number of frames ahead of the output, the callbacks
+	// then only copy them out. The parameter changes reach the output that many frames later.
+	// 0 computes the frames in the callbacks.
+	void setLookAheadFrames(int frames);
+	int getLookAheadFrames() const { return m_lookahead_frames; }
+	// How many times the worker was behind during playback and the callbacks output silence instead
+	// of a frame. The queue filling up again after a seek or a reset isn't counted.
+	int getLookAheadUnderruns() const { return m_lookahead_underruns.load(); }
 	
 	double getFreezePos() const { return m_freeze_pos; }
 	void setFreezing(bool b) { m_freezing = b; }
@@ -67,6 +112,15 @@ public:
 	double getOutputDurationSecondsForRange(Range<double> range, int fftsize);
 	
 	void setOnsetDetection(double x);
+	double getOnsetDetection() const { return m_onsetdetection; }
+	// Takes the onsets from a curve of the whole input computed on background threads, instead of
+	// analysing the spectrum of the input of each frame, once the curve is ready
+	void setOnsetPreAnalysis(bool b);
+	bool getOnsetPreAnalysis() const { return m_onset_preanalysis; }
+	// Call on the message thread, starts the analysis when needed and installs the curve when it's done.
+	// Returns false while the curve that will be used isn't ready.
+	bool updateOnsetAnalysis();
+	std::shared_ptr<const OnsetCurve> getOnsetCurve();
 	void setPlayRange(Range<double> playrange, bool force=false);
 	Range<double> getPlayRange() { return m_playrange; }
 	bool isLoopEnabled();
@@ -112,6 +166,10 @@ private:
 	LinearSmoothedValue<double> m_vol_smoother;
 	std::unique_ptr<AInputS> m_inputfile;
 	std::vector<std::shared_ptr<ProcessedStretch>> m_stretchers;
+	StretchEnginePool m_enginepool;
+	// the stretchers and their onset values for Stretch::processBatch
+	std::vector<Stretch*> m_batchstretchers;
+	std::vector<REALTYPE> m_batchonsets;
 
     std::unique_ptr<BinauralBeats> m_binaural_beats;
 
@@ -154,6 +212,44 @@ private:
 	int64_t m_output_length = 0;
 	bool m_clip_output = true;
 	void initObjects();
+	// the state initObjects and installEngine reset for the stretchers they have put in place
+	void resetObjects();
+	// The stretchers of an FFT size built off the audio thread, with the buffers whose size depends
+	// on it, for the callbacks to swap in when the FFT size changes during playback. An engine that
+	// was swapped out goes back to the builder, which puts its stretchers into the pool and releases
+	// the rest.
+	struct BuiltEngine
+	{
+		int fftsize = 0;
+		int numchans = 0;
+		double samplerate = 0.0;
+		int lookahead = 0;
+		StretchEnginePool::Engine stretchers;
+		std::vector<Stretch*> batchstretchers;
+		std::vector<REALTYPE> batchonsets;
+		AudioBuffer<float> inbuf;
+		CircularBuffer<float> outringbuf{ 0 }; // only when the current one is too small for the size
+		std::vector<float> framequeue;
+		std::vector<int> framequeueseekcounts;
+		std::unique_ptr<AbstractFifo> framequeuefifo;
+		std::shared_ptr<const SpectralPlan> spectralplan; // with the free filter curve of the size
+	};
+	class EngineBuilder;
+	std::unique_ptr<EngineBuilder> m_enginebuilder;
+	// guards the pool and the engines passed between the builder and the callbacks, the callbacks only try to enter it
+	CriticalSection m_enginecs;
+	std::unique_ptr<BuiltEngine> m_readyengine;
+	std::unique_ptr<BuiltEngine> m_retiredengine;
+	std::atomic<int> m_requested_engine_size{ 0 };
+	// used by the callbacks with m_cs, the engine taken from the builder and the one that was swapped out
+	std::unique_ptr<BuiltEngine> m_nextengine;
+	std::unique_ptr<BuiltEngine> m_oldengine;
+	// on the builder thread, returns false when there was nothing to do
+	bool buildRequestedEngine();
+	// in the callbacks, returns true when the cross-fade to the next engine was started, m_framecs
+	// is then held until the engine has been installed
+	bool startEngineSwap();
+	void installEngine(BuiltEngine& engine);
 	shared_envelope m_free_filter_envelope;
 	AudioFormatManager* m_afm = nullptr;
 	struct
@@ -165,6 +261,73 @@ private:
 		int requested_fft_size = 0;
 		File requested_file;
 	} m_xfadetask;
+	// the next frame of the stretchers, which can be computed over several callbacks
+	struct
+	{
+		int state = 0; // 0 not started, 1 input read and being computed, 2 done, output not yet used
+		bool stepping = false;
+		int readed = 0;
+		float in_pos_100 = 0.0f;
+		int stretcher = 0;
+		double spentms = 0.0;
+		int pendingskip = 0; // the worker skips the input at the start of the next frame
+		int seekcount = 0;
+		std::shared_ptr<const OnsetCurve> onsetcurve;
+		double onsetdetection = 0.0;
+	} m_framejob;
+	double m_frame_cost_ms = 0.0;
+	bool m_amortize_frames = true;
+	void startFrame();
+	void processFrame();
+	// runs steps of the frame until the time is used, returns true when the frame is done
+	bool runFrameSteps(double timelimitms);
+	void finishFrame();
+	void computeFrameAhead(int numsamples);
+	// the frames computed ahead by the worker, each one the out_bufs of all the channels
+	class FrameWorker;
+	std::unique_ptr<FrameWorker> m_frameworker;
+	CriticalSection m_framecs; // held while a frame is computed without m_cs
+	std::vector<float> m_framequeue;
+	// the seek count when each queued frame was started, the frames from before the last seek are dropped
+	std::vector<int> m_framequeue_seekcounts;
+	std::unique_ptr<AbstractFifo> m_framequeuefifo;
+	int m_framequeue_channels = 0;
+	int m_framequeue_bufsize = 0;
+	int m_lookahead_frames = 0;
+	std::atomic<int> m_lookahead_underruns{ 0 };
+	// after a seek, a reset or an underrun the output stays muted until the queue has the look-ahead
+	// frames again, and the first frame after that is faded in
+	bool m_lookahead_priming = true;
+	int m_applied_param_change_count = -1;
+	int m_seek_count = 0;
+	void resetFrameQueue();
+	void applyParametersToStretchers();
+	// The tables of the parameters shared by all the stretchers. The builder thread makes a new plan
+	// when the parameters, the enabled stages or the free filter curve have changed and publishes it
+	// with std::atomic_store, the frames only take it with std::atomic_load.
+	std::shared_ptr<const SpectralPlan> m_spectralplan;
+	std::shared_ptr<const SpectralPlan> m_applied_spectralplan; // the one the stretchers were given
+	// held while a plan is made, the free filter envelope gives its version to one thread at a time
+	CriticalSection m_plancs;
+	// the replaced plans, released by the builder once the stretchers don't use them anymore
+	std::vector<std::shared_ptr<const SpectralPlan>> m_retiredplans;
+	SharedResourcePointer<FreeFilterGainCache> m_freefiltergaincache;
+	// returns previous when nothing the plan depends on has changed
+	std::shared_ptr<const SpectralPlan> makeSpectralPlan(const ProcessParameters& pars, int nfreq, REALTYPE samplerate,
+		int enabledstages, const shared_envelope& env, std::shared_ptr<const SpectralPlan> previous);
+	// on the builder thread and in initObjects, returns false when the plan didn't change
+	bool updateSpectralPlan();
+	// wakes the builder to make the plan of the changed parameters, can be called from any thread
+	void requestSpectralPlan();
+	// gives the stretchers the published plan when it isn't the one they have
+	void applySpectralPlan();
+	void startQueuedFrame();
+	bool computeQueuedFrame();
+	// drops the frames from before the last seek, which are at the front
+	int getNumQueuedFrames();
+	// returns false when the worker hasn't computed the next frame yet
+	bool pushQueuedFrame(bool fadein);
+	void dropQueuedFrames();
 	int m_pause_fade_counter = 0;
 	bool m_preview_dry = false;
 	double m_dryplayrate = 1.0;
@@ -172,4 +335,14 @@ private:
 	int64_t m_last_filepos = 0;
 	void playDrySound(const AudioSourceChannelInfo & bufferToFill);
 	int m_current_spec_order_preset = -1;
+	SharedResourcePointer<OnsetAnalyzer> m_onsetanalyzer;
+	bool m_onset_preanalysis = false;
+	std::shared_ptr<const OnsetCurve> m_onsetcurve;
+	// a copy of the input buffer for the analysis and the id that tells the buffers apart
+	OnsetAnalyzer::SharedBuffer m_onsetbuffer;
+	AudioBuffer<float>* m_onsetbuffer_source = nullptr;
+	int m_onsetbuffer_len = 0;
+	int m_onsetbuffer_id = 0;
+	// the stretchers don't detect the onsets while the curve is used
+	double getStretcherOnsetDetection() const { return m_onsetcurve != nullptr ? 0.0 : m_onsetdetection; }
 };
@@ -474,6 +474,14 @@ PaulstretchpluginAudioProcessorEditor::PaulstretchpluginAudioProcessorEditor(Pau
 	{
 		*processor.getFloatParameter((int)cpi_octaves_ratio0 + index) = val;
 	};
+	m_ratiomixeditor.GetInterpolation = [this]()
+	{
+		return processor.getRatioMixInterpolation();
+	};
+	m_ratiomixeditor.OnInterpolationChanged = [this](bool b)
+	{
+		processor.setRatioMixInterpolation(b);
+	};
 	m_wave_container->addAndMakeVisible(&m_wavecomponent);
 
     auto tabbgcol = Colour(0xff303030);
@@ -1112,6 +1120,16 @@ void PaulstretchpluginAudioProcessorEditor::timerCallback(int id)
 			waveinfotext += String(processor.getStretchSource()->m_param_change_count)+" parameter changes handled\n";
 			waveinfotext += String(m_wavecomponent.m_image_init_count) + " waveform image inits\n" 
 				+ String(m_wavecomponent.m_image_update_count) + " waveform image updates\n";
+			if (processor.getNumFFTThreads() > 1)
+			{
+				float speedup = processor.getParallelFFTSpeedup();
+				waveinfotext += "Large FFTs split over " + String(processor.getNumFFTThreads()) + " threads";
+				if (speedup > 0.0f)
+					waveinfotext += ", " + String(speedup, 2) + "x faster at size " + String(FFTPlanRegistry::getParallelSpeedupSize());
+				waveinfotext += "\n";
+			}
+			if (processor.getLookAheadFrames() > 0)
+				waveinfotext += String(processor.getStretchSource()->getLookAheadUnderruns()) + " look-ahead underruns\n";
 			m_wavecomponent.m_infotext = waveinfotext;
 		}
 		else
@@ -1500,6 +1518,26 @@ void WaveformComponent::paint(Graphics & g)
 		m_thumbnail->drawChannels(g, { 0,m_topmargin,getWidth(),getHeight() - m_topmargin },
 			thumblen*m_view_range.getStart(), thumblen*m_view_range.getEnd(), 1.0f);
 	}
+	auto onsetcurve = m_sas->getOnsetCurve();
+	if (onsetcurve != nullptr && onsetcurve->numsamples > 0)
+	{
+		// the onsets the playback will use with the current sensitivity, the strongest one of each column
+		g.setColour(Colours::orange.withAlpha(0.6f));
+		const double sensitivity = m_sas->getOnsetDetection();
+		const int numhops = (int)onsetcurve->strengths.size();
+		for (int x = 0; x < getWidth(); ++x)
+		{
+			double t0 = jmap<double>(x, 0, getWidth(), m_view_range.getStart(), m_view_range.getEnd());
+			double t1 = jmap<double>(x + 1, 0, getWidth(), m_view_range.getStart(), m_view_range.getEnd());
+			int hop0 = jlimit(0, numhops, (int)(t0 * onsetcurve->numsamples / onsetcurve->hop));
+			int hop1 = jlimit(0, numhops, (int)(t1 * onsetcurve->numsamples / onsetcurve->hop) + 1);
+			float strength = 0.0f;
+			for (int i = hop0; i < hop1; ++i)
+				strength = jmax(strength, onsetcurve->strengths[i]);
+			if (Stretch::get_onset_from_strength(strength, (REALTYPE)sensitivity) > 0.5)
+				g.drawVerticalLine(x, (float)m_topmargin, (float)getHeight());
+		}
+	}
 	if (m_sr > 0.0 && m_fft_size > 0 && m_time_sel_start>=0.0)
 	{
 		tick_interval = 1.0 / m_sr * m_fft_size;
@@ -1898,7 +1936,8 @@ void SpectralVisualizer::setState(const ProcessParameters & pars, int nfreqs, do
 	spectrum_do_pitch_shift(pars, nfreqs, m_fft->freq.data(), m_freqs2.data(), ratio);
 	spectrum_do_freq_shift(pars, nfreqs, samplerate, m_freqs2.data(), m_freqs1.data());
 	spectrum_do_compressor(pars, nfreqs, m_freqs1.data(), m_freqs2.data());
-	spectrum_spread(nfreqs, samplerate, m_freqs3, m_freqs2.data(), m_freqs1.data(), pars.spread.bandwidth);
+	auto spreadwarp = SharedResourcePointer<SpreadWarpTableCache>()->getTable(nfreqs, samplerate);
+	spectrum_spread(nfreqs, *spreadwarp, m_freqs3.data(), m_freqs2.data(), m_freqs1.data(), pars.spread.bandwidth);
 	//if (pars.harmonics.enabled)
 	//	spectrum_do_harmonics(pars, m_freqs3, nfreqs, samplerate, m_freqs1.data(), m_freqs2.data());
 	//else spectrum_copy(nfreqs, m_freqs1.data(), m_freqs2.data());
@@ -2396,6 +2435,26 @@ void PerfMeterComponent::mouseDown(const MouseEvent & ev)
 	bufferingmenu.addItem(103, "Large", true, curbufamount == 3);
 	bufferingmenu.addItem(104, "Very large", true, curbufamount == 4);
 	bufferingmenu.addItem(105, "Huge", true, curbufamount == 5);
+	PopupMenu fftthreadsmenu;
+	int curfftthreads = m_proc->getNumFFTThreads();
+	fftthreadsmenu.addItem(201, "Off", true, curfftthreads == 1);
+	for (int i = 2; i <= PaulstretchpluginAudioProcessor::getMaxFFTThreads(); ++i)
+		fftthreadsmenu.addItem(200 + i, String(i), true, curfftthreads == i);
+	bufferingmenu.addSubMenu("Split large FFTs over threads", fftthreadsmenu);
+	PopupMenu fftmemorymenu;
+	int curfftmemory = m_proc->getFFTSizeMemoryBudget();
+	fftmemorymenu.addItem(301, "Off", true, curfftmemory == 0);
+	const int fftmemorychoices[] = { 128, 256, 512, 1024 };
+	for (int i = 0; i < 4; ++i)
+		fftmemorymenu.addItem(302 + i, String(fftmemorychoices[i]) + " MB", true, curfftmemory == fftmemorychoices[i]);
+	bufferingmenu.addSubMenu("Keep recent FFT sizes in memory", fftmemorymenu);
+	PopupMenu lookaheadmenu;
+	int curlookahead = m_proc->getLookAheadFrames();
+	lookaheadmenu.addItem(401, "Off", true, curlookahead == 0);
+	for (int i = 1; i <= 8; i *= 2)
+		lookaheadmenu.addItem(401 + i, String(i) + (i == 1 ? " frame" : " frames"), true, curlookahead == i);
+	bufferingmenu.addSubMenu("Compute frames ahead on a worker thread", lookaheadmenu);
+	bufferingmenu.addItem(501, "Analyse the onsets of the whole file ahead", true, m_proc->getOnsetPreAnalysis());
 
     auto opts = PopupMenu::Options().withTargetComponent(this);
     if (!JUCEApplicationBase::isStandaloneApp()) {
@@ -2415,6 +2474,16 @@ void PerfMeterComponent::mouseDown(const MouseEvent & ev)
             if (r > 100)
                 m_proc->setPreBufferAmount(r - 100);
         }
+        if (r > 200 && r < 300)
+            m_proc->setNumFFTThreads(r - 200);
+        if (r == 301)
+            m_proc->setFFTSizeMemoryBudget(0);
+        if (r > 301 && r < 306)
+            m_proc->setFFTSizeMemoryBudget(128 << (r - 302));
+        if (r > 400 && r < 410)
+            m_proc->setLookAheadFrames(r - 401);
+        if (r == 501)
+            m_proc->setOnsetPreAnalysis(!m_proc->getOnsetPreAnalysis());
     });
 }
 
@@ -2695,6 +2764,22 @@ void RatioMixerEditor::setSlidersSnap(bool flag)
 }
 
 
+void RatioMixerEditor::mouseDown(const MouseEvent & ev)
+{
+	if (!GetInterpolation || !OnInterpolationChanged)
+		return;
+	PopupMenu menu;
+	menu.addItem(1, "Interpolate between bins", true, GetInterpolation());
+	auto opts = PopupMenu::Options().withTargetComponent(this).withMousePosition();
+#if JUCE_IOS
+	opts = opts.withStandardItemHeight(34);
+#endif
+	menu.showMenuAsync(opts, [this](int r) {
+		if (r == 1)
+			OnInterpolationChanged(!GetInterpolation());
+	});
+}
+
 void RatioMixerEditor::paint(Graphics & g)
 {
 	g.fillAll(Colour(0xff222222));
@@ -294,8 +294,11 @@ public:
 	std::function<void(int, double)> OnRatioChanged;
 	std::function<void(int, double)> OnRatioLevelChanged;
 	std::function<double(int which, int index)> GetParameterValue;
+	std::function<bool()> GetInterpolation;
+	std::function<void(bool)> OnInterpolationChanged;
 	void timerCallback() override;
 	void paint(Graphics& g) override;
+	void mouseDown(const MouseEvent& ev) override;
     void setSlidersSnap(bool flag);
 private:
 	uptrvec<Slider> m_ratio_sliders;
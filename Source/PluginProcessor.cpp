@@ -47,6 +47,26 @@ int optimizebufsize(int n) {
 	else return n2;
 };
 
+// The buffer sizes optimizebufsize can give that are within the tolerance of n
+static std::vector<int> getBufSizesNear(int n, double tolerance)
+{
+	std::vector<int> result;
+	const int last = (int)(n * (1.0 + tolerance));
+	for (int bufsize = get_optimized_updown((int)ceil(n * (1.0 - tolerance)), true); bufsize <= last; bufsize = get_optimized_updown(bufsize + 1, true))
+		result.push_back(bufsize);
+	return result;
+}
+
+// All the FFT sizes (twice the buffer size) that setFFTSize can end up using
+static std::vector<int> getPossibleFFTSizes()
+{
+	std::vector<int> result;
+	const int maxbufsize = optimizebufsize((int)pow(2, 7.0 + 14.5));
+	for (int bufsize = optimizebufsize(128); bufsize <= maxbufsize; bufsize = get_optimized_updown(bufsize + 1, true))
+		result.push_back(bufsize * 2);
+	return result;
+}
+
 inline AudioParameterFloat* make_floatpar(String id, String name, float minv, float maxv, float defv, float step, float skew)
 {
 	return new AudioParameterFloat(juce::ParameterID(id, 1), name, NormalisableRange<float>(minv, maxv, step, skew), defv);
@@ -310,6 +330,45 @@ m_bufferingthread("pspluginprebufferthread"), m_is_stand_alone_offline(is_stand_
     
     m_show_technical_info = m_propsfile->m_props_file->getBoolValue("showtechnicalinfo", false);
 
+    // 0 : FFTW_ESTIMATE only, 1 : FFTW_MEASURE, 2 : FFTW_PATIENT, measured in the background
+    int planningmode = jlimit(0, 2, m_propsfile->m_props_file->getIntValue("fftwplanningmode", 1));
+    m_fftplanregistry->setPlanningMode((FFTPlanningMode)planningmode,
+        m_propsfile->m_props_file->getFile().getSiblingFile("fftwf_wisdom.txt"));
+
+    // Which FFT backend is the fastest at each size, timed in the background on the first run
+    String backendtable = m_propsfile->m_props_file->getValue("fftbackendtable");
+    if (backendtable.isNotEmpty())
+        m_fftplanregistry->setBackendTable(FFTPlanRegistry::backendTableFromString(backendtable));
+    else if (FFTPlan::getAvailableBackends().size() > 1 && m_fftplanregistry->isAutotuneRunning() == false)
+    {
+        m_fftplanregistry->startBackendAutotune(getPossibleFFTSizes(), [](const FFTPlanRegistry::BackendTable& table)
+        {
+            String tablestr = FFTPlanRegistry::backendTableToString(table);
+            MessageManager::callAsync([tablestr]()
+            {
+                SharedResourcePointer<MyPropertiesFile> propsfile;
+                propsfile->m_props_file->setValue("fftbackendtable", tablestr);
+            });
+        });
+    }
+
+    // The speed of the FFT sizes near the ones that have been used, timed in the background
+    m_fftplanregistry->setSizeTimings(FFTPlanRegistry::sizeTimingsFromString(m_propsfile->m_props_file->getValue("fftsizetimings")),
+        [](const FFTPlanRegistry::SizeTimingTable& table)
+    {
+        String tablestr = FFTPlanRegistry::sizeTimingsToString(table);
+        MessageManager::callAsync([tablestr]()
+        {
+            SharedResourcePointer<MyPropertiesFile> propsfile;
+            propsfile->m_props_file->setValue("fftsizetimings", tablestr);
+        });
+    });
+
+    // The largest transforms can be split over several threads, 1 keeps them on the buffering thread
+    m_fftplanregistry->setNumFFTThreads(jlimit(1, getMaxFFTThreads(), m_propsfile->m_props_file->getIntValue("fftthreads", 1)));
+    // Switching back to a recently used FFT size reuses its stretchers, within this memory budget
+    m_stretch_source->setEnginePoolBudget((int64)jmax(0, m_propsfile->m_props_file->getIntValue("fftsizememorymb", 256)) << 20);
+
     DBG("Constructed PS plugin");
 }
 
@@ -390,12 +449,15 @@ ValueTree PaulstretchpluginAudioProcessor::getStateTree(bool ignoreoptions, bool
 	{
 		paramtree.setProperty("specorderb" + String(i), specorder[i].m_index, nullptr);
 	}
+	paramtree.setProperty("ratiomixinterpolate", m_ratiomix_interpolate, nullptr);
 	if (ignoreoptions == false)
 	{
 		if (m_use_backgroundbuffering)
 			paramtree.setProperty("prebufamount", m_prebuffer_amount, nullptr);
 		else
 			paramtree.setProperty("prebufamount", -1, nullptr);
+		paramtree.setProperty("lookaheadframes", m_stretch_source->getLookAheadFrames(), nullptr);
+		paramtree.setProperty("onsetpreanalysis", m_stretch_source->getOnsetPreAnalysis(), nullptr);
 		paramtree.setProperty("loadfilewithstate", m_load_file_with_state, nullptr);
 		storeToTreeProperties(paramtree, nullptr, "playwhenhostrunning", m_play_when_host_plays, 
 			"capturewhenhostrunning", m_capture_when_host_plays,"savecapturedaudio",m_save_captured_audio,
@@ -457,6 +519,7 @@ void PaulstretchpluginAudioProcessor::setStateFromTree(ValueTree tree)
 				}
 			}
 			getFromTreeProperties(tree, "waveviewrange", m_wave_view_range);
+			m_ratiomix_interpolate = tree.getProperty("ratiomixinterpolate", false);
 			getFromTreeProperties(tree, getParameters());
 
 #if !(JUCE_IOS || JUCE_ANDROID)
@@ -471,6 +534,9 @@ void PaulstretchpluginAudioProcessor::setStateFromTree(ValueTree tree)
 			m_use_backgroundbuffering = false;
 		else
 			setPreBufferAmount(m_is_stand_alone_offline ? 0 : prebufamt);
+		int lookahead = tree.getProperty("lookaheadframes", 0);
+		setLookAheadFrames(m_is_stand_alone_offline ? 0 : lookahead);
+		setOnsetPreAnalysis(tree.getProperty("onsetpreanalysis", false));
 
         if (!m_restore_playstate) {
             // use previous paused value
@@ -585,22 +651,123 @@ void PaulstretchpluginAudioProcessor::parameterGestureChanged(int parameterIndex
 {
 }
 
+void PaulstretchpluginAudioProcessor::setNumFFTThreads(int numthreads)
+{
+    numthreads = jlimit(1, getMaxFFTThreads(), numthreads);
+    m_propsfile->m_props_file->setValue("fftthreads", numthreads);
+    m_fftplanregistry->setNumFFTThreads(numthreads);
+}
+
+int PaulstretchpluginAudioProcessor::getNumFFTThreads()
+{
+    return m_fftplanregistry->getNumFFTThreads();
+}
+
+int PaulstretchpluginAudioProcessor::getMaxFFTThreads()
+{
+    return jlimit(1, 8, SystemStats::getNumCpus());
+}
+
+float PaulstretchpluginAudioProcessor::getParallelFFTSpeedup()
+{
+    return m_fftplanregistry->getParallelSpeedup();
+}
+
+void PaulstretchpluginAudioProcessor::setFFTSizeMemoryBudget(int megabytes)
+{
+    megabytes = jmax(0, megabytes);
+    m_propsfile->m_props_file->setValue("fftsizememorymb", megabytes);
+    m_stretch_source->setEnginePoolBudget((int64)megabytes << 20);
+}
+
+int PaulstretchpluginAudioProcessor::getFFTSizeMemoryBudget()
+{
+    return (int)(m_stretch_source->getEnginePoolBudget() >> 20);
+}
+
+void PaulstretchpluginAudioProcessor::setLookAheadFrames(int frames)
+{
+    m_stretch_source->setLookAheadFrames(frames);
+}
+
+int PaulstretchpluginAudioProcessor::getLookAheadFrames()
+{
+    return m_stretch_source->getLookAheadFrames();
+}
+
+void PaulstretchpluginAudioProcessor::setOnsetPreAnalysis(bool b)
+{
+    m_stretch_source->setOnsetPreAnalysis(b);
+}
+
+bool PaulstretchpluginAudioProcessor::getOnsetPreAnalysis()
+{
+    return m_stretch_source->getOnsetPreAnalysis();
+}
+
+double PaulstretchpluginAudioProcessor::getFFTSizeRange()
+{
+    // The huge sizes need the largest prebuffering. When the split FFTs are fast enough, each
+    // doubling of their speed allows one prebuffering step less, down to Large.
+    int minprebuffer = 5;
+    const float speedup = m_fftplanregistry->getParallelSpeedup();
+    if (speedup >= 2.0f)
+        minprebuffer = jmax(3, 5 - (int)std::log2(speedup));
+    if (m_prebuffer_amount >= minprebuffer)
+        return 14.5;
+    return 10.0; // chicken out from allowing huge FFT sizes if not enough prebuffering
+}
+
 void PaulstretchpluginAudioProcessor::setFFTSize(float size, bool force)
 {
-    if (fabsf(m_last_fftsizeparamval - size) > 0.00001f || force) {
+    const double range = getFFTSizeRange();
+    const int64 fastest = m_fastest_fftsize.load();
+    if (fabsf(m_last_fftsizeparamval - size) > 0.00001f || range != m_last_fftsizerange || force
+        || fastest != m_last_fastest_fftsize) {
 
-        if (m_prebuffer_amount == 5)
-            m_fft_size_to_use = pow(2, 7.0 + size * 14.5);
-        else m_fft_size_to_use = pow(2, 7.0 + size * 10.0); // chicken out from allowing huge FFT sizes if not enough prebuffering
+        m_fft_size_to_use = pow(2, 7.0 + size * range);
         int optim = optimizebufsize(m_fft_size_to_use);
+        if ((int)(fastest >> 32) == optim)
+            optim = (int)(fastest & 0xffffffff);
         m_fft_size_to_use = optim;
         m_stretch_source->setFFTSize(optim, force);
 
         m_last_fftsizeparamval = size;
+        m_last_fftsizerange = range;
+        m_last_fastest_fftsize = fastest;
         //Logger::writeToLog(String(m_fft_size_to_use));
     }
 }
 
+void PaulstretchpluginAudioProcessor::updateFastestFFTSize()
+{
+    const float size = *getFloatParameter(cpi_fftsize);
+    const double range = getFFTSizeRange();
+    const int sizetimingsversion = m_fftplanregistry->getSizeTimingsVersion();
+    if (size == m_fastest_fftsize_paramval && range == m_fastest_fftsize_range
+        && sizetimingsversion == m_last_sizetimingsversion)
+        return;
+    const int requested = pow(2, 7.0 + size * range);
+    const int optim = optimizebufsize(requested);
+    int result = optim;
+    // The sizes within 3% of the requested one sound the same, so the one that runs
+    // the fastest is used once they have been timed
+    auto candidates = getBufSizesNear(requested, 0.03);
+    if (candidates.size() > 1)
+    {
+        std::vector<int> fftsizes;
+        for (int bufsize : candidates)
+            fftsizes.push_back(bufsize * 2);
+        int fastest = m_fftplanregistry->getFastestSize(fftsizes);
+        if (fastest > 0)
+            result = fastest / 2;
+    }
+    m_fastest_fftsize = ((int64)optim << 32) | result;
+    m_fastest_fftsize_paramval = size;
+    m_fastest_fftsize_range = range;
+    m_last_sizetimingsversion = sizetimingsversion;
+}
+
 void PaulstretchpluginAudioProcessor::startplay(Range<double> playrange, int numoutchans, int maxBlockSize, String& err)
 {
 	m_stretch_source->setPlayRange(playrange);
@@ -671,6 +838,7 @@ void PaulstretchpluginAudioProcessor::updateStretchParametersFromPluginParameter
 
 	for (int i = 0; i < 8; ++i)
 		pars.ratiomix.ratios[i] = *getFloatParameter((int)cpi_octaves_ratio0 + i);
+	pars.ratiomix.interpolate = m_ratiomix_interpolate;
 
 	pars.filter.low = *getFloatParameter(cpi_filter_low);
 	pars.filter.high = *getFloatParameter(cpi_filter_high);
@@ -867,6 +1035,10 @@ String PaulstretchpluginAudioProcessor::offlineRender(OfflineRenderParams render
             m_offline_render_state = 0;
             m_offline_render_cancel_requested = false;
 
+            // the render uses the same onsets as the playback, so it waits for the analysis
+            while (sc->updateOnsetAnalysis() == false && m_offline_render_cancel_requested == false)
+                Thread::sleep(10);
+
             DBG("Starting rendering of " << outlenframes << " frames, " << outlensecs << " secs" << ", loops: " << renderpars.numloops << " play range s: " << sc->getPlayRange().getStart() << "  e: " << sc->getPlayRange().getEnd());
 
             while (outcounter < outlenframes)
@@ -1449,6 +1621,7 @@ void PaulstretchpluginAudioProcessor::timerCallback(int id)
 {
 	if (id == 1)
 	{
+		updateFastestFFTSize();
 		bool capture = *getBoolParameter(cpi_capture_trigger);
 		if (capture == false && m_max_reclen != *getFloatParameter(cpi_max_capture_len))
 		{
@@ -1487,6 +1660,8 @@ void PaulstretchpluginAudioProcessor::timerCallback(int id)
 
 
 
+		m_stretch_source->updateOnsetAnalysis();
+
 		if (m_cur_num_out_chans != *m_outchansparam)
 		{
 			jassert(m_curmaxblocksize > 0);
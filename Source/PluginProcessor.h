@@ -243,6 +243,24 @@ public:
     void resetParameters();
     void setPreBufferAmount(int x);
 	int getPreBufferAmount();
+	// Threads that the largest FFTs are split over, stored in the settings.
+	// The speed-up is 0 until it has been timed, or when the FFTs aren't split.
+	void setNumFFTThreads(int numthreads);
+	int getNumFFTThreads();
+	static int getMaxFFTThreads();
+	float getParallelFFTSpeedup();
+	// Megabytes of memory the stretchers of recently used FFT sizes may keep, 0 to not keep them
+	void setFFTSizeMemoryBudget(int megabytes);
+	int getFFTSizeMemoryBudget();
+	// Frames computed ahead on a worker thread, stored with the instance. 0 computes them in the callbacks.
+	void setLookAheadFrames(int frames);
+	int getLookAheadFrames();
+	// Uses the onsets of the whole input analysed ahead on background threads, stored with the instance
+	void setOnsetPreAnalysis(bool b);
+	bool getOnsetPreAnalysis();
+	// The ratio mixer interpolates between the two nearest bins of the shifted positions, stored with the state
+	void setRatioMixInterpolation(bool b) { m_ratiomix_interpolate = b; }
+	bool getRatioMixInterpolation() const { return m_ratiomix_interpolate; }
 	bool m_load_file_with_state = true;
 	ValueTree getStateTree(bool ignoreoptions, bool ignorefile);
 	void setStateFromTree(ValueTree tree);
@@ -253,6 +271,7 @@ public:
 	bool m_state_dirty = false;
 	std::unique_ptr<AudioThumbnail> m_thumb;
 	bool m_show_technical_info = false;
+	bool m_ratiomix_interpolate = false;
 	Range<double> m_wave_view_range;
     int m_prepare_count = 0;
     shared_envelope m_free_filter_envelope;
@@ -310,6 +329,14 @@ private:
 	SignalSmoother m_prebufsmoother;
 	int m_fft_size_to_use = 1024;
     float m_last_fftsizeparamval = -1.0f;
+    double m_last_fftsizerange = 0.0;
+    // The buffer size the parameter rounds to in the high 32 bits and the fastest one that sounds
+    // the same in the low ones, picked by the timer so that the callbacks don't wait for the plan registry
+    std::atomic<int64> m_fastest_fftsize{ 0 };
+    int64 m_last_fastest_fftsize = 0;
+    float m_fastest_fftsize_paramval = -1.0f;
+    double m_fastest_fftsize_range = 0.0;
+    int m_last_sizetimingsversion = -1;
 	double m_last_outpos_pos = 0.0;
 	double m_last_in_pos = 0.0;
 	std::vector<int> m_bufamounts{ 4096,8192,16384,32768,65536,262144 };
@@ -319,6 +346,10 @@ private:
     int mPluginWindowHeight = 745;
 
 	void setFFTSize(float size, bool force=false);
+	// on the message thread, for setFFTSize
+	void updateFastestFFTSize();
+	// exponent range of the FFT size parameter, the huge sizes need enough prebuffering
+	double getFFTSizeRange();
 	void startplay(Range<double> playrange, int numoutchans, int maxBlockSize, String& err);
 	SharedResourcePointer<MyThumbCache> m_thumbcache;
 	AudioParameterInt* m_outchansparam = nullptr;
@@ -337,6 +368,7 @@ private:
 	AudioFilePreviewComponent* m_previewcomponent = nullptr;
 	void saveCaptureBuffer();
 	SharedResourcePointer<MyThreadPool> m_threadpool;
+	SharedResourcePointer<FFTPlanRegistry> m_fftplanregistry;
 	int m_midinote_to_use = -1;
 	ADSR m_adsr;
 	bool m_is_stand_alone_offline = false;
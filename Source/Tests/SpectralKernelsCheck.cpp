@@ -0,0 +1,133 @@
+// SPDX-License-Identifier: GPLv3-or-later WITH Appstore-exception
+
+// Checks each set of spectral kernels the build has against the scalar reference ones, at sizes
+// that leave remainders after the vector loops, from buffers that aren't aligned, and with
+// filter band limits at and around the ends of the spectrum. Returns 1 if any of them differ.
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "../PS_Source/SpectralKernels.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+using namespace SpectralKernels;
+
+namespace
+{
+	struct Checker
+	{
+		const Table& reference = getReferenceTable();
+		const Table* table = nullptr;
+		Random random{ 12345 };
+		int numfailed = 0;
+
+		// a few floats more than n, so that the buffers can start off alignment
+		std::vector<float> makeInput(int n, float low, float high)
+		{
+			std::vector<float> v(n + 8);
+			for (auto& e : v)
+				e = low + (high - low) * random.nextFloat();
+			return v;
+		}
+
+		void fail(const char* kernel, int n, int offset, int index, float expected, float actual)
+		{
+			if (numfailed++ < 20)
+				printf("%s %s n=%d offset=%d: bin %d is %.9g, the reference gives %.9g\n",
+					table->name, kernel, n, offset, index, actual, expected);
+		}
+
+		// the element-wise kernels give exactly the same floats
+		void compareExactly(const char* kernel, int n, int offset, const float* expected, const float* actual)
+		{
+			for (int i = 0; i < n; ++i)
+				if (expected[i] != actual[i])
+				{
+					fail(kernel, n, offset, i, expected[i], actual[i]);
+					return;
+				}
+		}
+
+		// the sums and the filter damping are done in lanes and differ in the last bits, by more the
+		// more steps the float rounding of the reference and of the lanes had to drift apart
+		void compareClosely(const char* kernel, int n, int offset, int index, int steps, float expected, float actual)
+		{
+			const float tolerance = 1e-6f + 1.2e-7f * steps;
+			if (std::abs(expected - actual) > tolerance * std::abs(expected) + 1e-30f)
+				fail(kernel, n, offset, index, expected, actual);
+		}
+
+		void check(int n, int offset)
+		{
+			auto src1 = makeInput(n, -1.0f, 1.0f);
+			auto src2 = makeInput(n, 0.0f, 2.0f);
+			const float* a = src1.data() + offset;
+			const float* b = src2.data() + offset;
+			std::vector<float> expectedbuf(n + 8), actualbuf(n + 8);
+			float* expected = expectedbuf.data() + offset;
+			float* actual = actualbuf.data() + offset;
+			auto run = [&](const char* kernel, auto&& fn)
+			{
+				std::fill(expectedbuf.begin(), expectedbuf.end(), 7.0f);
+				std::fill(actualbuf.begin(), actualbuf.end(), 7.0f);
+				fn(reference, expected);
+				fn(*table, actual);
+				//including the floats after the end, which must not be written
+				compareExactly(kernel, n + 8 - offset, offset, expected, actual);
+			};
+			run("zero", [&](const Table& t, float* dest) { t.zero(dest, n); });
+			run("fill", [&](const Table& t, float* dest) { t.fill(dest, 0.25f, n); });
+			run("copy", [&](const Table& t, float* dest) { t.copy(a, dest, n); });
+			run("add", [&](const Table& t, float* dest) { t.copy(a, dest, n); t.add(dest, b, 0.3f, n); });
+			run("multiply", [&](const Table& t, float* dest) { t.copy(a, dest, n); t.multiply(dest, -1.7f, n); });
+			run("multiplyTo", [&](const Table& t, float* dest) { t.multiplyTo(a, 0.6f, dest, n); });
+			run("multiplyBins", [&](const Table& t, float* dest) { t.multiplyBins(a, b, dest, n); });
+			run("multiplyBins in place", [&](const Table& t, float* dest) { t.copy(a, dest, n); t.multiplyBins(dest, b, dest, n); });
+			run("preserveTonal", [&](const Table& t, float* dest) { t.preserveTonal(b, a, 0.8f, dest, n); });
+			run("preserveNoise", [&](const Table& t, float* dest) { t.preserveNoise(b, a, 0.8f, dest, n); });
+
+			compareClosely("sumOfSquares", n, offset, 0, n, reference.sumOfSquares(a, n), table->sumOfSquares(a, n));
+			compareClosely("sumOfSquaresOfProduct", n, offset, 0, n, reference.sumOfSquaresOfProduct(a, b, n),
+				table->sumOfSquaresOfProduct(a, b, n));
+
+			const int limits[] = { -1, 0, 1, n / 3, n / 2, n - 1, n, n + 1 };
+			for (int low : limits)
+				for (int high : limits)
+					for (bool stop : { false, true })
+					{
+						table->filter(a, actual, n, low, high, stop, 0.9995f);
+						reference.filter(a, expected, n, low, high, stop, 0.9995f);
+						for (int i = 0; i < n; ++i)
+							compareClosely(stop ? "filter stop" : "filter", n, offset, i, i, expected[i], actual[i]);
+					}
+		}
+
+		void checkTable(const Table& t)
+		{
+			table = &t;
+			const int before = numfailed;
+			for (int n = 1; n <= 67; n += 2)
+				for (int offset = 0; offset < 4; ++offset)
+					check(n, offset);
+			for (int n : { 255, 1023, 4097, 16385 })
+				for (int offset = 0; offset < 4; ++offset)
+					check(n, offset);
+			printf("%s kernels: %s\n", t.name, numfailed == before ? "same as the reference" : "DIFFERENT");
+		}
+	};
+}
+
+int main()
+{
+	Checker checker;
+	checker.checkTable(getBaselineTable());
+#if PS_SPECTRAL_AVX2
+	if (SystemStats::hasAVX2())
+		checker.checkTable(getAVX2Table());
+	else
+		printf("the CPU can't run the AVX2 kernels, not checked\n");
+#endif
+	printf("the kernels picked for this CPU are the %s ones\n", getTable().name);
+	return checker.numfailed == 0 ? 0 : 1;
+}
@@ -260,6 +260,7 @@ void EnvelopeComponent::showPopupMenu()
                 double val = 1.0 - m_envelope->GetNodeAtIndex(i).pt_y;
                 m_envelope->GetNodeAtIndex(i).pt_y = val;
             }
+            m_envelope->updateMinMaxValues();
         }
         else if (r == 3)
         {
@@ -8,6 +8,8 @@
 #include <vector>
 #include <algorithm>
 #include <random>
+#include <tuple>
+#include <atomic>
 #include "../JuceLibraryCode/JuceHeader.h"
 #include "PS_Source/globals.h"
 
@@ -209,7 +211,7 @@ public:
     void SetName(String Name) { m_name=Name; }
     const String& GetName() const { return m_name; }
     double GetDefValue() const { return m_defvalue; }
-    void SetDefValue(double value) { m_defvalue=value; }
+    void SetDefValue(double value) { m_defvalue=value; markChanged(); }
     int GetDefShape() const { return m_defshape; }
 	ValueTree saveState(Identifier id) const
 	{
@@ -245,6 +247,7 @@ public:
 			}
 			SortNodes();
 		}
+		markChanged();
 	}
 	MD5 getHash() const
 	{
@@ -259,6 +262,25 @@ public:
 		return MD5(mb);
 	}
 	
+	// Changes whenever getTransformedValue may give other values than before. The node changes and
+	// the random state bump it, the transformation members are set directly, so they are compared
+	// to the ones of the previous call. Call it from one thread at a time.
+	int64 getVersion()
+	{
+		auto transform = std::make_tuple(m_transform_x_shift, m_transform_y_shift, m_transform_y_scale,
+			m_transform_y_sinus, m_transform_y_sinus_freq, m_transform_y_tilt, m_transform_y_random_amount,
+			m_transform_y_random_linear_interpolation, m_transform_y_random_bands, m_transform_wrap_x,
+			m_minvalue, m_maxvalue);
+		if (transform != m_versioned_transform)
+		{
+			m_versioned_transform = transform;
+			markChanged();
+		}
+		return m_version.load();
+	}
+	// for the changes made through the node references of GetNodeAtIndex
+	void markChanged() { ++m_version; }
+	
     int GetNumPoints() const { return (int)m_nodes.size(); }
     void SetDefShape(int value) { m_defshape=value; }
 	double getNodeLeftBound(int index, double margin=0.01) const noexcept
@@ -278,7 +300,7 @@ public:
 		return m_nodes[index + 1].pt_x - margin;
 	}
 	const std::vector<envelope_point>& get_all_nodes() const { return m_nodes; }
-    void set_all_nodes(nodes_t nds) { m_nodes=std::move(nds); }
+    void set_all_nodes(nodes_t nds) { m_nodes=std::move(nds); markChanged(); }
     void set_reset_nodes(const std::vector<envelope_point>& nodes, bool convertvalues=false)
     {
         if (convertvalues==false)
@@ -294,6 +316,7 @@ public:
                     node.pt_y=scaled_to_normalized_func(node.pt_y);
                     m_nodes.push_back(node);
                 }
+                markChanged();
             }
         }
     }
@@ -301,6 +324,7 @@ public:
     {
         m_nodes=m_reset_nodes;
         m_playoffset=0.0;
+        markChanged();
     }
     Colour GetColor() const
     {
@@ -324,16 +348,19 @@ public:
         m_nodes.push_back(newnode);
         if (!m_updateopinprogress)
             SortNodes();
+        markChanged();
     }
     void ClearAllNodes()
     {
         m_nodes.clear();
+        markChanged();
     }
     void DeleteNode(int indx)
     {
         if (indx<0 || indx>m_nodes.size()-1)
             return;
         m_nodes.erase(m_nodes.begin()+indx);
+        markChanged();
     }
     void delete_nodes_in_time_range(double t0, double t1)
     {
@@ -341,11 +368,13 @@ public:
                                        std::end(m_nodes),
                                        [t0,t1](const envelope_point& a) { return a.pt_x>=t0 && a.pt_x<=t1; } ),
                                        std::end(m_nodes) );
+        markChanged();
     }
 	template<typename F>
 	void removePointsConditionally(F predicate)
 	{
 		m_nodes.erase(std::remove_if(m_nodes.begin(), m_nodes.end(), predicate), m_nodes.end());
+		markChanged();
 	}
     envelope_point& GetNodeAtIndex(int indx)
     {
@@ -391,6 +420,7 @@ public:
         if (indx<0) i=0;
         if (indx>(int)m_nodes.size()-1) i=(int)m_nodes.size()-1;
         m_nodes[i]=anode;
+        markChanged();
     }
     void SetNodeTimeValue(int indx,bool setTime,bool setValue,double atime,double avalue)
     {
@@ -399,6 +429,7 @@ public:
         if (indx>(int)m_nodes.size()-1) i=(int)m_nodes.size()-1;
         if (setTime) m_nodes[i].pt_x=atime;
         if (setValue) m_nodes[i].pt_y=avalue;
+        markChanged();
     }
 
 
@@ -474,6 +505,7 @@ public:
     {
         stable_sort(m_nodes.begin(),m_nodes.end(),
              [](const envelope_point& a, const envelope_point& b){ return a.pt_x<b.pt_x; } );
+        markChanged();
     }
     double minimum_value() const { return m_minvalue; }
     double maximum_value() const { return m_maxvalue; }
@@ -503,9 +535,11 @@ public:
 			node.ShapeParam1 = jlimit(0.0, 1.0, node.ShapeParam1);
 			m_nodes[i] = node;
 		}
+		markChanged();
 	}
 	void adjustEnvelopeSegmentValues(int index, double amount)
 	{
+		markChanged();
 		if (index >= m_old_nodes.size())
 		{
 			m_nodes.back().pt_y = jlimit(0.0,1.0,m_old_nodes.back().pt_y+amount);
@@ -642,6 +676,7 @@ public:
 		}
 		m_minvalue = minv;
 		m_maxvalue = maxv;
+		markChanged();
 	}
 	void updateRandomState()
 	{
@@ -649,6 +684,7 @@ public:
 		std::uniform_real_distribution<double> dist(0.0,1.0);
 		for (int i = 0; i < m_transform_y_random_bands+1; ++i)
 			m_randbuf[i] = dist(m_randgen);
+		markChanged();
 	}
 private:
     nodes_t m_nodes;
@@ -669,6 +705,8 @@ private:
     grid_t m_value_grid;
 	std::mt19937 m_randgen;
 	std::vector<double> m_randbuf;
+	std::atomic<int64> m_version{ 0 };
+	std::tuple<double, double, double, double, double, double, double, bool, int, bool, double, double> m_versioned_transform;
 	JUCE_LEAK_DETECTOR(breakpoint_envelope)
 };
 
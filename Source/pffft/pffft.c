@@ -57,6 +57,29 @@
   - 2011/10/02, version 1: This is the very first release of this file.
 */
 
+/*
+  pffft_avx2.c and pffft_avx512.c compile this file again with 8 and 16
+  float vectors. They rename the public functions with PFFFT_PREFIX, so
+  that all the builds can be linked into the same program.
+*/
+#ifdef PFFFT_PREFIX
+#  define pffft_new_setup PFFFT_PREFIX(new_setup)
+#  define pffft_destroy_setup PFFFT_PREFIX(destroy_setup)
+#  define pffft_transform PFFFT_PREFIX(transform)
+#  define pffft_transform_ordered PFFFT_PREFIX(transform_ordered)
+#  define pffft_zreorder PFFFT_PREFIX(zreorder)
+#  define pffft_zconvolve_accumulate PFFFT_PREFIX(zconvolve_accumulate)
+#  define pffft_aligned_malloc PFFFT_PREFIX(aligned_malloc)
+#  define pffft_aligned_free PFFFT_PREFIX(aligned_free)
+#  define pffft_simd_size PFFFT_PREFIX(simd_size)
+#  define validate_pffft_simd PFFFT_PREFIX(validate_simd)
+#  define cffti1_ps PFFFT_PREFIX(cffti1_ps)
+#  define cfftf1_ps PFFFT_PREFIX(cfftf1_ps)
+#  define pffft_cplx_finalize PFFFT_PREFIX(cplx_finalize)
+#  define pffft_cplx_preprocess PFFFT_PREFIX(cplx_preprocess)
+#  define pffft_transform_internal PFFFT_PREFIX(transform_internal)
+#endif
+
 #include "pffft.h"
 #include <stdlib.h>
 #include <stdio.h>
@@ -93,10 +116,106 @@
 // define PFFFT_SIMD_DISABLE if you want to use scalar code instead of simd code
 //#define PFFFT_SIMD_DISABLE
 
+/*
+  AVX-512 support macros, 16 floats by simd vector. Only used by
+  pffft_avx512.c, which is compiled with AVX-512F enabled.
+*/
+#if !defined(PFFFT_SIMD_DISABLE) && defined(PFFFT_SIMD_AVX512)
+#include <immintrin.h>
+typedef __m512 v4sf;
+#  define SIMD_SZ 16
+#  define VZERO() _mm512_setzero_ps()
+#  define VMUL(a,b) _mm512_mul_ps(a,b)
+#  define VADD(a,b) _mm512_add_ps(a,b)
+#  define VMADD(a,b,c) _mm512_fmadd_ps(a,b,c)
+#  define VSUB(a,b) _mm512_sub_ps(a,b)
+#  define LD_PS1(p) _mm512_set1_ps(p)
+#  define INTERLEAVE2(in1, in2, out1, out2) {                                  \
+    v4sf tmp__ = _mm512_permutex2var_ps(in1, _mm512_setr_epi32(0,16,1,17,2,18,3,19,4,20,5,21,6,22,7,23), in2); \
+    out2 = _mm512_permutex2var_ps(in1, _mm512_setr_epi32(8,24,9,25,10,26,11,27,12,28,13,29,14,30,15,31), in2); \
+    out1 = tmp__;                                                               \
+  }
+#  define UNINTERLEAVE2(in1, in2, out1, out2) {                                \
+    v4sf tmp__ = _mm512_permutex2var_ps(in1, _mm512_setr_epi32(0,2,4,6,8,10,12,14,16,18,20,22,24,26,28,30), in2); \
+    out2 = _mm512_permutex2var_ps(in1, _mm512_setr_epi32(1,3,5,7,9,11,13,15,17,19,21,23,25,27,29,31), in2); \
+    out1 = tmp__;                                                               \
+  }
+/* transposes the 16x16 matrix in x[0..15], by swapping the off diagonal
+   blocks of size 8, 4, 2 and 1. The lanes that each swap takes from the
+   first and second vector of a pair, 16+ is the second vector */
+static const int vtranspose16_idx[4][2][16] = {
+  { {0,1,2,3,4,5,6,7,16,17,18,19,20,21,22,23}, {8,9,10,11,12,13,14,15,24,25,26,27,28,29,30,31} },
+  { {0,1,2,3,16,17,18,19,8,9,10,11,24,25,26,27}, {4,5,6,7,20,21,22,23,12,13,14,15,28,29,30,31} },
+  { {0,1,16,17,4,5,20,21,8,9,24,25,12,13,28,29}, {2,3,18,19,6,7,22,23,10,11,26,27,14,15,30,31} },
+  { {0,16,2,18,4,20,6,22,8,24,10,26,12,28,14,30}, {1,17,3,19,5,21,7,23,9,25,11,27,13,29,15,31} }
+};
+static ALWAYS_INLINE(void) vtranspose16(v4sf *x) {
+  int stage, s, i;
+  for (stage = 0, s = 8; stage < 4; ++stage, s /= 2) {
+    __m512i va = _mm512_loadu_si512(vtranspose16_idx[stage][0]);
+    __m512i vb = _mm512_loadu_si512(vtranspose16_idx[stage][1]);
+    for (i = 0; i < 16; ++i) {
+      if ((i & s) == 0) {
+        v4sf a = x[i], b = x[i+s];
+        x[i] = _mm512_permutex2var_ps(a, va, b);
+        x[i+s] = _mm512_permutex2var_ps(a, vb, b);
+      }
+    }
+  }
+}
+#  define VTRANSPOSE(x) vtranspose16(x)
+#  define VREVERSE(a) _mm512_permutexvar_ps(_mm512_setr_epi32(15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0), a)
+#  define VLOADU(p) _mm512_loadu_ps(p)
+#  define VALIGNED(ptr) ((((long long)(ptr)) & 0x3F) == 0)
+
+/*
+  AVX2 support macros, 8 floats by simd vector. Only used by pffft_avx2.c,
+  which is compiled with AVX2 and FMA enabled.
+*/
+#elif !defined(PFFFT_SIMD_DISABLE) && defined(PFFFT_SIMD_AVX2)
+#include <immintrin.h>
+typedef __m256 v4sf;
+#  define SIMD_SZ 8
+#  define VZERO() _mm256_setzero_ps()
+#  define VMUL(a,b) _mm256_mul_ps(a,b)
+#  define VADD(a,b) _mm256_add_ps(a,b)
+#  define VMADD(a,b,c) _mm256_fmadd_ps(a,b,c)
+#  define VSUB(a,b) _mm256_sub_ps(a,b)
+#  define LD_PS1(p) _mm256_set1_ps(p)
+#  define INTERLEAVE2(in1, in2, out1, out2) {                                  \
+    v4sf lo__ = _mm256_unpacklo_ps(in1, in2), hi__ = _mm256_unpackhi_ps(in1, in2); \
+    out1 = _mm256_permute2f128_ps(lo__, hi__, 0x20);                            \
+    out2 = _mm256_permute2f128_ps(lo__, hi__, 0x31);                            \
+  }
+#  define UNINTERLEAVE2(in1, in2, out1, out2) {                                \
+    v4sf ev__ = _mm256_shuffle_ps(in1, in2, _MM_SHUFFLE(2,0,2,0));              \
+    v4sf od__ = _mm256_shuffle_ps(in1, in2, _MM_SHUFFLE(3,1,3,1));              \
+    out1 = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(ev__), _MM_SHUFFLE(3,1,2,0))); \
+    out2 = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(od__), _MM_SHUFFLE(3,1,2,0))); \
+  }
+static ALWAYS_INLINE(void) vtranspose8(v4sf *x) {
+  v4sf t0 = _mm256_unpacklo_ps(x[0], x[1]), t1 = _mm256_unpackhi_ps(x[0], x[1]);
+  v4sf t2 = _mm256_unpacklo_ps(x[2], x[3]), t3 = _mm256_unpackhi_ps(x[2], x[3]);
+  v4sf t4 = _mm256_unpacklo_ps(x[4], x[5]), t5 = _mm256_unpackhi_ps(x[4], x[5]);
+  v4sf t6 = _mm256_unpacklo_ps(x[6], x[7]), t7 = _mm256_unpackhi_ps(x[6], x[7]);
+  v4sf u0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1,0,1,0)), u1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3,2,3,2));
+  v4sf u2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1,0,1,0)), u3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3,2,3,2));
+  v4sf u4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1,0,1,0)), u5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3,2,3,2));
+  v4sf u6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1,0,1,0)), u7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3,2,3,2));
+  x[0] = _mm256_permute2f128_ps(u0, u4, 0x20); x[4] = _mm256_permute2f128_ps(u0, u4, 0x31);
+  x[1] = _mm256_permute2f128_ps(u1, u5, 0x20); x[5] = _mm256_permute2f128_ps(u1, u5, 0x31);
+  x[2] = _mm256_permute2f128_ps(u2, u6, 0x20); x[6] = _mm256_permute2f128_ps(u2, u6, 0x31);
+  x[3] = _mm256_permute2f128_ps(u3, u7, 0x20); x[7] = _mm256_permute2f128_ps(u3, u7, 0x31);
+}
+#  define VTRANSPOSE(x) vtranspose8(x)
+#  define VREVERSE(a) _mm256_permutevar8x32_ps(a, _mm256_setr_epi32(7,6,5,4,3,2,1,0))
+#  define VLOADU(p) _mm256_loadu_ps(p)
+#  define VALIGNED(ptr) ((((long long)(ptr)) & 0x1F) == 0)
+
 /*
    Altivec support macros 
 */
-#if !defined(PFFFT_SIMD_DISABLE) && (defined(__ppc__) || defined(__ppc64__) || defined(__powerpc__) || defined(__powerpc64__))
+#elif !defined(PFFFT_SIMD_DISABLE) && (defined(__ppc__) || defined(__ppc64__) || defined(__powerpc__) || defined(__powerpc64__))
 #include <altivec.h>
 typedef vector float v4sf;
 #  define SIMD_SZ 4
@@ -203,11 +322,37 @@ typedef float v4sf;
 #if !defined(PFFFT_SIMD_DISABLE)
 typedef union v4sf_union {
   v4sf  v;
-  float f[4];
+  float f[SIMD_SZ];
 } v4sf_union;
 
 #include <string.h>
 
+#if SIMD_SZ > 4
+/* detect bugs with the vector support macros of the wide builds */
+void validate_pffft_simd(void) {
+  v4sf_union m[SIMD_SZ], t, u;
+  v4sf x[SIMD_SZ];
+  int i, j;
+  for (i=0; i < SIMD_SZ; ++i) {
+    for (j=0; j < SIMD_SZ; ++j) m[i].f[j] = (float)(i*SIMD_SZ + j);
+    x[i] = m[i].v;
+  }
+  INTERLEAVE2(m[0].v, m[1].v, t.v, u.v);
+  for (j=0; j < SIMD_SZ/2; ++j) {
+    assert(t.f[2*j] == j && t.f[2*j+1] == SIMD_SZ + j);
+    assert(u.f[2*j] == SIMD_SZ/2 + j && u.f[2*j+1] == SIMD_SZ + SIMD_SZ/2 + j);
+  }
+  UNINTERLEAVE2(m[0].v, m[1].v, t.v, u.v);
+  for (j=0; j < SIMD_SZ; ++j) { assert(t.f[j] == 2*j && u.f[j] == 2*j+1); }
+  t.v = VREVERSE(m[0].v);
+  for (j=0; j < SIMD_SZ; ++j) { assert(t.f[j] == SIMD_SZ-1-j); }
+  VTRANSPOSE(x);
+  for (i=0; i < SIMD_SZ; ++i) {
+    t.v = x[i];
+    for (j=0; j < SIMD_SZ; ++j) { assert(t.f[j] == j*SIMD_SZ + i); }
+  }
+}
+#else
 #define assertv4(v,f0,f1,f2,f3) assert(v.f[0] == (f0) && v.f[1] == (f1) && v.f[2] == (f2) && v.f[3] == (f3))
 
 /* detect bugs with the vector support macros */
@@ -247,6 +392,7 @@ void validate_pffft_simd(void) {
          a2.f[0], a2.f[1], a2.f[2], a2.f[3], a3.f[0], a3.f[1], a3.f[2], a3.f[3]); 
   assertv4(a0, 0, 4, 8, 12); assertv4(a1, 1, 5, 9, 13); assertv4(a2, 2, 6, 10, 14); assertv4(a3, 3, 7, 11, 15);
 }
+#endif // SIMD_SZ > 4
 #else
 void validate_pffft_simd() {} // allow test_pffft.c to call this function even when simd is not available..
 #endif //!PFFFT_SIMD_DISABLE
@@ -471,6 +617,7 @@ static NEVER_INLINE(void) passf5_ps(int ido, int l1, const v4sf *cc, v4sf *ch,
 #undef cc_ref
 }
 
+#if SIMD_SZ <= 4 // the wide builds do real transforms with the complex passes, see pffft_real_transform_wide
 static NEVER_INLINE(void) radf2_ps(int ido, int l1, const v4sf * RESTRICT cc, v4sf * RESTRICT ch, const float *wa1) {
   static const float minus_one = -1.f;
   int i, k, l1ido = l1*ido;
@@ -1050,6 +1197,7 @@ static NEVER_INLINE(v4sf *) rfftb1_ps(int n, const v4sf *input_readonly, v4sf *w
   }
   return in; /* this is in fact the output .. */
 }
+#endif // SIMD_SZ <= 4
 
 static int decompose(int n, int *ifac, const int *ntryh) {
   int nl = n, nf = 0, i, j = 0;
@@ -1078,6 +1226,7 @@ static int decompose(int n, int *ifac, const int *ntryh) {
 
 
 
+#if SIMD_SZ <= 4
 static void rffti1_ps(int n, float *wa, int *ifac)
 {
   static const int ntryh[] = { 4,2,3,5,0 };
@@ -1110,6 +1259,7 @@ static void rffti1_ps(int n, float *wa, int *ifac)
     l1 = l2;
   }
 } /* rffti1 */
+#endif // SIMD_SZ <= 4
 
 void cffti1_ps(int n, float *wa, int *ifac)
 {
@@ -1205,6 +1355,9 @@ struct PFFFT_Setup {
   v4sf *data; // allocated room for twiddle coefs
   float *e;    // points into 'data' , N/4*3 elements
   float *twiddle; // points into 'data', N/4 elements
+#if SIMD_SZ > 4
+  float *rtwiddle; // cos and sin of the real split pass, points into 'data', N/2 elements each
+#endif
 };
 
 PFFFT_Setup *pffft_new_setup(int N, pffft_transform_t transform) {
@@ -1220,10 +1373,18 @@ PFFFT_Setup *pffft_new_setup(int N, pffft_transform_t transform) {
   s->transform = transform;  
   /* nb of complex simd vectors */
   s->Ncvec = (transform == PFFFT_REAL ? N/2 : N)/SIMD_SZ;
+#if SIMD_SZ > 4
+  /* the wide builds do a real transform of size N as a complex transform
+     of size N/2 followed by a split pass, which has its own twiddles */
+  s->data = (v4sf*)pffft_aligned_malloc((transform == PFFFT_REAL ? 4 : 2)*s->Ncvec * sizeof(v4sf));
+  s->rtwiddle = (float*)(s->data + 2*s->Ncvec);
+#else
   s->data = (v4sf*)pffft_aligned_malloc(2*s->Ncvec * sizeof(v4sf));
+#endif
   s->e = (float*)s->data;
   s->twiddle = (float*)(s->data + (2*s->Ncvec*(SIMD_SZ-1))/SIMD_SZ);  
 
+#if SIMD_SZ <= 4
   if (transform == PFFFT_REAL) {
     for (k=0; k < s->Ncvec; ++k) {
       int i = k/SIMD_SZ;
@@ -1235,22 +1396,34 @@ PFFFT_Setup *pffft_new_setup(int N, pffft_transform_t transform) {
       }
     }
     rffti1_ps(N/SIMD_SZ, s->twiddle, s->ifac);
-  } else {
+  } else
+#endif
+  {
+    int Nc = s->Ncvec*SIMD_SZ; /* N, or N/2 for the real transforms of the wide builds */
     for (k=0; k < s->Ncvec; ++k) {
       int i = k/SIMD_SZ;
       int j = k%SIMD_SZ;
       for (m=0; m < SIMD_SZ-1; ++m) {
-        float A = -2*M_PI*(m+1)*k / N;
-        s->e[(2*(i*3 + m) + 0)*SIMD_SZ + j] = cos(A);
-        s->e[(2*(i*3 + m) + 1)*SIMD_SZ + j] = sin(A);
+        float A = -2*M_PI*(m+1)*k / Nc;
+        s->e[(2*(i*(SIMD_SZ-1) + m) + 0)*SIMD_SZ + j] = cos(A);
+        s->e[(2*(i*(SIMD_SZ-1) + m) + 1)*SIMD_SZ + j] = sin(A);
       }
     }
-    cffti1_ps(N/SIMD_SZ, s->twiddle, s->ifac);
+    cffti1_ps(Nc/SIMD_SZ, s->twiddle, s->ifac);
+#if SIMD_SZ > 4
+    if (transform == PFFFT_REAL) {
+      for (k=0; k < Nc; ++k) {
+        double A = 2*M_PI*k / N;
+        s->rtwiddle[k] = cos(A);
+        s->rtwiddle[Nc + k] = -sin(A);
+      }
+    }
+#endif
   }
 
   /* check that N is decomposable with allowed prime factors */
   for (k=0, m=1; k < s->ifac[1]; ++k) { m *= s->ifac[2+k]; }
-  if (m != N/SIMD_SZ) {
+  if (m != (SIMD_SZ > 4 ? s->Ncvec : N/SIMD_SZ)) {
     pffft_destroy_setup(s); s = 0;
   }
 
@@ -1265,6 +1438,7 @@ void pffft_destroy_setup(PFFFT_Setup *s) {
 
 #if !defined(PFFFT_SIMD_DISABLE)
 
+#if SIMD_SZ == 4
 /* [0 0 1 2 3 4 5 6 7 8] -> [0 8 7 6 5 4 3 2 1] */
 static void reversed_copy(int N, const v4sf *in, int in_stride, v4sf *out) {
   v4sf g0, g1;
@@ -1298,6 +1472,7 @@ static void unreversed_copy(int N, const v4sf *in, v4sf *out, int out_stride) {
   h0 = VSWAPHL(h0, h1);
   UNINTERLEAVE2(h0, g1, out[0], out[1]);
 }
+#endif // SIMD_SZ == 4
 
 void pffft_zreorder(PFFFT_Setup *setup, const float *in, float *out, pffft_direction_t direction) {
   int k, N = setup->N, Ncvec = setup->Ncvec;
@@ -1305,6 +1480,11 @@ void pffft_zreorder(PFFFT_Setup *setup, const float *in, float *out, pffft_direc
   v4sf *vout = (v4sf*)out;
   assert(in != out);
   if (setup->transform == PFFFT_REAL) {
+#if SIMD_SZ > 4
+    /* the real transforms of the wide builds always produce the ordered layout */
+    (void)N; (void)direction;
+    for (k=0; k < 2*Ncvec; ++k) vout[k] = vin[k];
+#else
     int k, dk = N/32;
     if (direction == PFFFT_FORWARD) {
       for (k=0; k < dk; ++k) {
@@ -1321,21 +1501,223 @@ void pffft_zreorder(PFFFT_Setup *setup, const float *in, float *out, pffft_direc
       unreversed_copy(dk, (v4sf*)(in + N/4), (v4sf*)(out + N - 6*SIMD_SZ), -8);
       unreversed_copy(dk, (v4sf*)(in + 3*N/4), (v4sf*)(out + N - 2*SIMD_SZ), -8);
     }
+#endif
   } else {
     if (direction == PFFFT_FORWARD) {
       for (k=0; k < Ncvec; ++k) { 
-        int kk = (k/4) + (k%4)*(Ncvec/4);
+        int kk = (k/SIMD_SZ) + (k%SIMD_SZ)*(Ncvec/SIMD_SZ);
         INTERLEAVE2(vin[k*2], vin[k*2+1], vout[kk*2], vout[kk*2+1]);
       }
     } else {
       for (k=0; k < Ncvec; ++k) { 
-        int kk = (k/4) + (k%4)*(Ncvec/4);
+        int kk = (k/SIMD_SZ) + (k%SIMD_SZ)*(Ncvec/SIMD_SZ);
         UNINTERLEAVE2(vin[kk*2], vin[kk*2+1], vout[k*2], vout[k*2+1]);
       }
     }
   }
 }
 
+#if SIMD_SZ > 4
+/* cos and sin of 2*pi*k/16, the twiddles of the dfts across the lanes */
+static const float lane_cos[8] = { 1.f, 0.92387953251f, 0.70710678118f, 0.38268343236f,
+                                   0.f, -0.38268343236f, -0.70710678118f, -0.92387953251f };
+static const float lane_sin[8] = { 0.f, 0.38268343236f, 0.70710678118f, 0.92387953251f,
+                                   1.f, 0.92387953251f, 0.70710678118f, 0.38268343236f };
+
+#if SIMD_SZ == 16
+static const int lane_bitrev[16] = { 0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15 };
+#else
+static const int lane_bitrev[8] = { 0, 4, 2, 6, 1, 5, 3, 7 };
+#endif
+
+/*
+  SIMD_SZ point dft of the vectors r[0..SIMD_SZ-1] + i*i[0..SIMD_SZ-1], done
+  separately for each lane. fsign = -1 for the forward dft, +1 for the
+  backward one. Radix 2, decimation in time.
+*/
+static ALWAYS_INLINE(void) vdft_lanes(v4sf *r, v4sf *i, float fsign) {
+  v4sf xr[SIMD_SZ], xi[SIMD_SZ];
+  int j, size, s, t;
+  for (j=0; j < SIMD_SZ; ++j) { xr[lane_bitrev[j]] = r[j]; xi[lane_bitrev[j]] = i[j]; }
+  for (size=2; size <= SIMD_SZ; size *= 2) {
+    int half = size/2;
+    for (s=0; s < SIMD_SZ; s += size) {
+      for (t=0; t < half; ++t) {
+        v4sf ar = xr[s+t], ai = xi[s+t], br = xr[s+t+half], bi = xi[s+t+half];
+        if (4*t == size) {
+          /* the twiddle is -i for the forward dft, +i for the backward one */
+          if (fsign < 0) { v4sf tmp = br; br = bi; bi = VSUB(VZERO(), tmp); }
+          else { v4sf tmp = br; br = VSUB(VZERO(), bi); bi = tmp; }
+        } else if (t != 0) {
+          VCPLXMUL(br, bi, LD_PS1(lane_cos[t*16/size]), LD_PS1(fsign*lane_sin[t*16/size]));
+        }
+        xr[s+t] = VADD(ar, br); xi[s+t] = VADD(ai, bi);
+        xr[s+t+half] = VSUB(ar, br); xi[s+t+half] = VSUB(ai, bi);
+      }
+    }
+  }
+  for (j=0; j < SIMD_SZ; ++j) { r[j] = xr[j]; i[j] = xi[j]; }
+}
+
+/* transpose, twiddles and dft of one SIMD_SZ x SIMD_SZ block, like the 4x4 version below */
+static ALWAYS_INLINE(void) pffft_cplx_finalize_block(const v4sf *in, const v4sf *e, v4sf *r, v4sf *i) {
+  int j;
+  for (j=0; j < SIMD_SZ; ++j) { r[j] = in[2*j]; i[j] = in[2*j+1]; }
+  VTRANSPOSE(r);
+  VTRANSPOSE(i);
+  for (j=1; j < SIMD_SZ; ++j) {
+    VCPLXMUL(r[j], i[j], e[2*(j-1)], e[2*(j-1)+1]);
+  }
+  vdft_lanes(r, i, -1);
+}
+
+static ALWAYS_INLINE(void) pffft_cplx_preprocess_block(v4sf *r, v4sf *i, const v4sf *e, v4sf *out) {
+  int j;
+  vdft_lanes(r, i, +1);
+  for (j=1; j < SIMD_SZ; ++j) {
+    VCPLXMULCONJ(r[j], i[j], e[2*(j-1)], e[2*(j-1)+1]);
+  }
+  VTRANSPOSE(r);
+  VTRANSPOSE(i);
+  for (j=0; j < SIMD_SZ; ++j) { out[2*j] = r[j]; out[2*j+1] = i[j]; }
+}
+
+void pffft_cplx_finalize(int Ncvec, const v4sf *in, v4sf *out, const v4sf *e) {
+  int k, j, dk = Ncvec/SIMD_SZ; // number of SIMD_SZ x SIMD_SZ matrix blocks
+  assert(in != out);
+  for (k=0; k < dk; ++k) {
+    v4sf r[SIMD_SZ], i[SIMD_SZ];
+    pffft_cplx_finalize_block(in + 2*k*SIMD_SZ, e + 2*k*(SIMD_SZ-1), r, i);
+    for (j=0; j < SIMD_SZ; ++j) { *out++ = r[j]; *out++ = i[j]; }
+  }
+}
+
+void pffft_cplx_preprocess(int Ncvec, const v4sf *in, v4sf *out, const v4sf *e) {
+  int k, j, dk = Ncvec/SIMD_SZ; // number of SIMD_SZ x SIMD_SZ matrix blocks
+  assert(in != out);
+  for (k=0; k < dk; ++k) {
+    v4sf r[SIMD_SZ], i[SIMD_SZ];
+    for (j=0; j < SIMD_SZ; ++j) { r[j] = in[2*(k*SIMD_SZ + j)]; i[j] = in[2*(k*SIMD_SZ + j) + 1]; }
+    pffft_cplx_preprocess_block(r, i, e + 2*k*(SIMD_SZ-1), out + 2*k*SIMD_SZ);
+  }
+}
+
+/*
+  The wide builds transform N real samples as the N/2 complex numbers
+  z[n] = x[2n] + i.x[2n+1], the split passes convert between the spectrum
+  Z of z and the spectrum X of x:
+
+  X[k] = (Z[k] + conj(Z[N/2-k]))/2 - i.W^k.(Z[k] - conj(Z[N/2-k]))/2
+  Z[k] = (X[k] + conj(X[N/2-k])) + i.W^-k.(X[k] - conj(X[N/2-k]))
+
+  with W = exp(-2.i.pi/N) and Z[N/2] = Z[0]. The backward one includes the
+  factor 2 that makes the backward real transform scaled by N. The
+  spectra are kept as separate arrays of real and imaginary parts while
+  the split passes read them.
+*/
+static NEVER_INLINE(void) pffft_real_split_forward(int Nc, const float *zr, const float *zi,
+                                                    v4sf *out, const float *rtwiddle) {
+  int k;
+  v4sf half = LD_PS1(0.5f);
+  assert(VALIGNED(zr) && VALIGNED(zi));
+  for (k=0; k < Nc/SIMD_SZ; ++k) {
+    v4sf a = *(const v4sf*)(zr + k*SIMD_SZ), b = *(const v4sf*)(zi + k*SIMD_SZ), c, d;
+    v4sf wr = *(const v4sf*)(rtwiddle + k*SIMD_SZ), wi = *(const v4sf*)(rtwiddle + Nc + k*SIMD_SZ);
+    v4sf sr, dr, si, di, xr, xi;
+    if (k == 0) {
+      /* the mirrored bins of the first vector wrap around to Z[0] */
+      v4sf_union cu, du;
+      int t;
+      for (t=0; t < SIMD_SZ; ++t) { cu.f[t] = zr[(Nc - t) % Nc]; du.f[t] = zi[(Nc - t) % Nc]; }
+      c = cu.v; d = du.v;
+    } else {
+      c = VREVERSE(VLOADU(zr + Nc - (k+1)*SIMD_SZ + 1));
+      d = VREVERSE(VLOADU(zi + Nc - (k+1)*SIMD_SZ + 1));
+    }
+    sr = VADD(a, c); dr = VSUB(a, c);
+    si = VADD(b, d); di = VSUB(b, d);
+    xr = VMUL(half, VMADD(wr, si, VMADD(wi, dr, sr)));
+    xi = VMUL(half, VSUB(VMADD(wi, si, di), VMUL(wr, dr)));
+    INTERLEAVE2(xr, xi, out[2*k], out[2*k+1]);
+  }
+  /* F(0) and F(N/2) go to the first complex entry, like in the 4 wide builds */
+  ((float*)out)[1] = zr[0] - zi[0];
+}
+
+/* k-th vector of Z, xr[0] is F(0) and xi[0] is F(N/2) */
+static ALWAYS_INLINE(void) pffft_real_split_backward(int Nc, const float *xr, const float *xi, const float *rtwiddle,
+                                                      int k, v4sf *zr, v4sf *zi) {
+  v4sf a = *(const v4sf*)(xr + k*SIMD_SZ), b = *(const v4sf*)(xi + k*SIMD_SZ), c, d;
+  v4sf wr = *(const v4sf*)(rtwiddle + k*SIMD_SZ), wi = *(const v4sf*)(rtwiddle + Nc + k*SIMD_SZ);
+  v4sf sr, dr, si, di;
+  if (k == 0) {
+    v4sf_union bu, cu, du;
+    int t;
+    bu.v = b; bu.f[0] = 0;
+    cu.f[0] = xi[0]; du.f[0] = 0;
+    for (t=1; t < SIMD_SZ; ++t) { cu.f[t] = xr[Nc - t]; du.f[t] = xi[Nc - t]; }
+    b = bu.v; c = cu.v; d = du.v;
+  } else {
+    c = VREVERSE(VLOADU(xr + Nc - (k+1)*SIMD_SZ + 1));
+    d = VREVERSE(VLOADU(xi + Nc - (k+1)*SIMD_SZ + 1));
+  }
+  sr = VADD(a, c); dr = VSUB(a, c);
+  si = VADD(b, d); di = VSUB(b, d);
+  *zr = VADD(VSUB(sr, VMUL(wr, si)), VMUL(wi, dr));
+  *zi = VMADD(wr, dr, VMADD(wi, si, di));
+}
+
+/* real transforms of the wide builds, the output is always in the ordered layout */
+static void pffft_real_transform_wide(PFFFT_Setup *setup, const float *finput, float *foutput, v4sf *scratch,
+                                      pffft_direction_t direction) {
+  int k, j, Ncvec = setup->Ncvec, Nc = Ncvec*SIMD_SZ, dk = Ncvec/SIMD_SZ;
+  int nf_odd = (setup->ifac[1] & 1);
+  const v4sf *vinput = (const v4sf*)finput;
+  const v4sf *e = (const v4sf*)setup->e;
+  v4sf *voutput = (v4sf*)foutput, *res;
+  float *sr = (float*)scratch, *si = sr + Nc;
+  assert(VALIGNED(scratch));
+  if (direction == PFFFT_FORWARD) {
+    /* start from the buffer that makes the complex passes end up in voutput,
+       the split pass then reads from scratch while writing the output */
+    v4sf *tmp = (nf_odd ? scratch : voutput);
+    for (k=0; k < Ncvec; ++k) {
+      UNINTERLEAVE2(vinput[k*2], vinput[k*2+1], tmp[k*2], tmp[k*2+1]);
+    }
+    res = cfftf1_ps(Ncvec, tmp, (tmp == scratch ? voutput : scratch), tmp,
+                    setup->twiddle, &setup->ifac[0], -1);
+    assert(res == voutput); (void)res;
+    /* pffft_cplx_finalize and the reordering into the natural order in one go */
+    for (k=0; k < dk; ++k) {
+      v4sf r[SIMD_SZ], i[SIMD_SZ];
+      pffft_cplx_finalize_block(voutput + 2*k*SIMD_SZ, e + 2*k*(SIMD_SZ-1), r, i);
+      for (j=0; j < SIMD_SZ; ++j) {
+        *(v4sf*)(sr + (k + j*dk)*SIMD_SZ) = r[j];
+        *(v4sf*)(si + (k + j*dk)*SIMD_SZ) = i[j];
+      }
+    }
+    pffft_real_split_forward(Nc, sr, si, voutput, setup->rtwiddle);
+  } else {
+    for (k=0; k < Ncvec; ++k) {
+      UNINTERLEAVE2(vinput[k*2], vinput[k*2+1], *(v4sf*)(sr + k*SIMD_SZ), *(v4sf*)(si + k*SIMD_SZ));
+    }
+    /* the split pass and pffft_cplx_preprocess in one go */
+    for (k=0; k < dk; ++k) {
+      v4sf r[SIMD_SZ], i[SIMD_SZ];
+      for (j=0; j < SIMD_SZ; ++j) {
+        pffft_real_split_backward(Nc, sr, si, setup->rtwiddle, k + j*dk, &r[j], &i[j]);
+      }
+      pffft_cplx_preprocess_block(r, i, e + 2*k*(SIMD_SZ-1), voutput + 2*k*SIMD_SZ);
+    }
+    res = cfftf1_ps(Ncvec, voutput, scratch, voutput, setup->twiddle, &setup->ifac[0], +1);
+    for (k=0; k < Ncvec; ++k) {
+      INTERLEAVE2(res[k*2], res[k*2+1], voutput[k*2], voutput[k*2+1]);
+    }
+  }
+}
+
+#else // SIMD_SZ > 4
+
 void pffft_cplx_finalize(int Ncvec, const v4sf *in, v4sf *out, const v4sf *e) {
   int k, dk = Ncvec/SIMD_SZ; // number of 4x4 matrix blocks
   v4sf r0, i0, r1, i1, r2, i2, r3, i3;
@@ -1606,6 +1988,8 @@ static NEVER_INLINE(void) pffft_real_preprocess(int Ncvec, const v4sf *in, v4sf
 }
 
 
+#endif // SIMD_SZ > 4
+
 void pffft_transform_internal(PFFFT_Setup *setup, const float *finput, float *foutput, v4sf *scratch,
                              pffft_direction_t direction, int ordered) {
   int k, Ncvec   = setup->Ncvec;
@@ -1622,14 +2006,25 @@ void pffft_transform_internal(PFFFT_Setup *setup, const float *finput, float *fo
 
   assert(VALIGNED(finput) && VALIGNED(foutput));
 
+#if SIMD_SZ > 4
+  if (setup->transform == PFFFT_REAL) {
+    (void)ordered; (void)ib;
+    pffft_real_transform_wide(setup, finput, foutput, buff[1], direction);
+    return;
+  }
+#endif
+
   //assert(finput != foutput);
   if (direction == PFFFT_FORWARD) {
     ib = !ib;
+#if SIMD_SZ <= 4
     if (setup->transform == PFFFT_REAL) { 
       ib = (rfftf1_ps(Ncvec*2, vinput, buff[ib], buff[!ib],
                       setup->twiddle, &setup->ifac[0]) == buff[0] ? 0 : 1);      
       pffft_real_finalize(Ncvec, buff[ib], buff[!ib], (v4sf*)setup->e);
-    } else {
+    } else
+#endif
+    {
       v4sf *tmp = buff[ib];
       for (k=0; k < Ncvec; ++k) {
         UNINTERLEAVE2(vinput[k*2], vinput[k*2+1], tmp[k*2], tmp[k*2+1]);
@@ -1649,11 +2044,14 @@ void pffft_transform_internal(PFFFT_Setup *setup, const float *finput, float *fo
       pffft_zreorder(setup, (float*)vinput, (float*)buff[ib], PFFFT_BACKWARD); 
       vinput = buff[ib]; ib = !ib;
     }
+#if SIMD_SZ <= 4
     if (setup->transform == PFFFT_REAL) {
       pffft_real_preprocess(Ncvec, vinput, buff[ib], (v4sf*)setup->e);
       ib = (rfftb1_ps(Ncvec*2, buff[ib], buff[0], buff[1], 
                       setup->twiddle, &setup->ifac[0]) == buff[0] ? 0 : 1);
-    } else {
+    } else
+#endif
+    {
       pffft_cplx_preprocess(Ncvec, vinput, buff[ib], (v4sf*)setup->e);
       ib = (cfftf1_ps(Ncvec, buff[ib], buff[0], buff[1], 
                       setup->twiddle, &setup->ifac[0], +1) == buff[0] ? 0 : 1);
@@ -1706,6 +2104,20 @@ void pffft_zconvolve_accumulate(PFFFT_Setup *s, const float *a, const float *b,
 #endif
 
   assert(VALIGNED(a) && VALIGNED(b) && VALIGNED(ab));
+#if SIMD_SZ > 4
+  if (s->transform == PFFFT_REAL) {
+    /* the real spectra of the wide builds are in the ordered layout */
+    ab[0] += a[0]*b[0]*scaling;
+    ab[1] += a[1]*b[1]*scaling;
+    for (i=1; i < s->N/2; ++i) {
+      ar = a[2*i]; ai = a[2*i+1];
+      br = b[2*i]; bi = b[2*i+1];
+      ab[2*i] += (ar*br - ai*bi)*scaling;
+      ab[2*i+1] += (ar*bi + ai*br)*scaling;
+    }
+    return;
+  }
+#endif
   ar = ((v4sf_union*)va)[0].f[0];
   ai = ((v4sf_union*)va)[1].f[0];
   br = ((v4sf_union*)vb)[0].f[0];
@@ -0,0 +1,11 @@
+/*
+  8 float wide build of pffft.c for x86 CPUs with AVX2 and FMA. This file
+  must be compiled with those enabled (-mavx2 -mfma, /arch:AVX2), see
+  pffft_wide.h for how it is used.
+*/
+
+#if defined(__AVX2__)
+#define PFFFT_SIMD_AVX2
+#define PFFFT_PREFIX(name) pffft_avx2_##name
+#include "pffft.c"
+#endif
@@ -0,0 +1,11 @@
+/*
+  16 float wide build of pffft.c for x86 CPUs with AVX-512F. This file
+  must be compiled with that enabled (-mavx512f, /arch:AVX512), see
+  pffft_wide.h for how it is used.
+*/
+
+#if defined(__AVX512F__)
+#define PFFFT_SIMD_AVX512
+#define PFFFT_PREFIX(name) pffft_avx512_##name
+#include "pffft.c"
+#endif
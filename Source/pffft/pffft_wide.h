@@ -0,0 +1,43 @@
+/*
+  8 (AVX2 + FMA) and 16 (AVX-512F) float wide builds of pffft for x86
+  CPUs, from pffft_avx2.c and pffft_avx512.c. They are only linked in
+  when the build defines PS_PFFFT_WIDE, and the caller has to check that
+  the CPU has the instructions before using them.
+
+  They work like the functions of pffft.h, with these differences:
+
+  - the real transforms require N to be a multiple of 2*simd_size^2, so
+    128 for AVX2 and 512 for AVX-512, the complex ones simd_size^2.
+
+  - the real transforms are done as a complex transform of size N/2,
+    their output is always in the ordered layout, pffft_transform and
+    pffft_transform_ordered do the same thing.
+
+  - buffers need an alignment of 32 (AVX2) or 64 (AVX-512) bytes,
+    pffft_aligned_malloc already gives 64.
+*/
+
+#ifndef PFFFT_WIDE_H
+#define PFFFT_WIDE_H
+
+#include "pffft.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  PFFFT_Setup *pffft_avx2_new_setup(int N, pffft_transform_t transform);
+  void pffft_avx2_destroy_setup(PFFFT_Setup *);
+  void pffft_avx2_transform_ordered(PFFFT_Setup *setup, const float *input, float *output, float *work, pffft_direction_t direction);
+  int pffft_avx2_simd_size(void);
+
+  PFFFT_Setup *pffft_avx512_new_setup(int N, pffft_transform_t transform);
+  void pffft_avx512_destroy_setup(PFFFT_Setup *);
+  void pffft_avx512_transform_ordered(PFFFT_Setup *setup, const float *input, float *output, float *work, pffft_direction_t direction);
+  int pffft_avx512_simd_size(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PFFFT_WIDE_H